@@ -1,12 +1,19 @@
 
 CFLAGS += -Wextra -Wconversion
 
+SRCS := ioqueueglobal.c ioqueuestats.c ioqueuebuf.c ioqueuerate.c
+
 TGTS := libioqueue.a
-SRCS := ioqueue.c
+SRCS += ioqueue.c
 
-$(call depends,libioqueue.a,ioqueue.o)
+$(call depends,libioqueue.a,ioqueue.o ioqueueglobal.o ioqueuestats.o ioqueuebuf.o ioqueuerate.o)
 
 TGTS += libioqueuemt.a
 SRCS += ioqueuemt.c
 
-$(call depends,libioqueuemt.a,ioqueuemt.o)
+$(call depends,libioqueuemt.a,ioqueuemt.o ioqueueglobal.o ioqueuestats.o ioqueuebuf.o ioqueuerate.o)
+
+TGTS += libioqueueuring.a
+SRCS += ioqueueuring.c
+
+$(call depends,libioqueueuring.a,ioqueueuring.o ioqueueglobal.o ioqueuestats.o ioqueuebuf.o ioqueuerate.o)
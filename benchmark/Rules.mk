@@ -17,3 +17,8 @@ TGTS += benchpc
 SRCS += benchpc.cc
 
 $(call depends,benchpc,../libioqueuemt.a)
+
+TGTS += benchuring
+SRCS += benchuring.cc
+
+$(call depends,benchuring,../libioqueueuring.a)
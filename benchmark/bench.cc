@@ -7,6 +7,7 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,6 +15,7 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -26,7 +28,7 @@
 #define IOQ_BACKEND "kaio"
 #endif
 #ifndef IOQ_OPEN_FLAGS
-#define IOQ_OPEN_FLAGS (O_RDONLY | O_DIRECT)
+#define IOQ_OPEN_FLAGS (O_DIRECT)   /* OR'd with O_RDONLY, or O_RDWR when writing */
 #endif
 
 using namespace std;
@@ -36,6 +38,10 @@ static int Q_DEPTH;
 static int BUFSIZE;
 static int REQUESTS;
 static int RANDSEED;
+static int WRITE_PCT;
+static int SEQUENTIAL;
+static int SYNC_EVERY;
+static const char *LATENCY_FILE;
 
 static vector<void *> _buffers;
 static vector<string> _config_help;
@@ -47,6 +53,13 @@ do { \
     _config_help.push_back(#var ": " help " (default " #def ")\n"); \
 } while (0);
 
+#define ENVSTR(var, help) \
+do { \
+    var = getenv(#var); \
+    if (VERBOSE) fprintf(stderr, "%-8s = %s\n", #var, var ? var : ""); \
+    _config_help.push_back(#var ": " help " (default none)\n"); \
+} while (0);
+
 static void
 env_init()
 {
@@ -55,6 +68,14 @@ env_init()
     ENVOPT(BUFSIZE, 512, "write buffer size");
     ENVOPT(REQUESTS, 262144, "number of requests to execute");
     ENVOPT(RANDSEED, 0, "seed for random number generator");
+    ENVOPT(WRITE_PCT, 0, "percentage of requests that are writes, overwriting the files");
+    ENVOPT(SEQUENTIAL, 0, "issue requests at sequential rather than random offsets");
+    ENVOPT(SYNC_EVERY, 0, "fdatasync a file after every this many writes, 0 for never");
+    ENVSTR(LATENCY_FILE, "file to write the latency distribution of each type of request to");
+    if (WRITE_PCT < 0 || WRITE_PCT > 100) {
+        fprintf(stderr, "WRITE_PCT must be between 0 and 100\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 void
@@ -71,21 +92,31 @@ void
 init_buffers()
 {
     for (int i = 0; i < Q_DEPTH; i++) {
-        _buffers.push_back(NULL);
-        int ret = posix_memalign(&_buffers[i], 512, BUFSIZE);
-        if (ret != 0) {
-            fprintf(stderr, "posix_memalign: %s\n", strerror(ret));
+        void *const buf = ioqueue_buf_alloc((size_t)BUFSIZE);
+        if (buf == NULL) {
+            perror("ioqueue_buf_alloc");
             exit(EXIT_FAILURE);
         }
+        /* the data written by write requests */
+        memset(buf, 'w', (size_t)BUFSIZE);
+        _buffers.push_back(buf);
     }
 }
 
 void
 free_buffers()
 {
+    /* wait for every buffer to be returned by its callback */
+    while (_buffers.size() < (size_t)Q_DEPTH) {
+        if (ioqueue_reap(1) == -1) {
+            perror("ioqueue_reap");
+            exit(EXIT_FAILURE);
+        }
+    }
     for (unsigned int i = 0; i < _buffers.size(); i++) {
-        free(_buffers[i]);
+        ioqueue_buf_free(_buffers[i]);
     }
+    _buffers.clear();
 }
 
 #ifndef CLOCK_MONOTONIC_RAW
@@ -106,33 +137,77 @@ timevalue(struct timeval tv)
     return (int64_t)(tv.tv_sec) * 1000000000L + (int64_t)(tv.tv_usec) * 100L;
 }
 
-int64_t _time_wait_total = 0;
+enum bench_op {
+    OP_READ,
+    OP_WRITE,
+    OP_SYNC,
+    OP_COUNT
+};
+
+static const char *const _op_names[OP_COUNT] = { "read", "write", "sync" };
+
+int64_t _time_wait_total[OP_COUNT];
+int _op_total[OP_COUNT];
+
+/* the latency of every completed request in nanoseconds, sorted once the run is over */
+static vector<int64_t> _latencies[OP_COUNT];
+
+/* buffers held back from the free pool while an fdatasync takes their queue slot */
+static vector<void *> _held;
 
 void
-aio_callback(void *closure, ssize_t result, void *buf)
+op_callback(enum bench_op op, void *closure, ssize_t result)
 {
-    // fail benchmark on read error
+    // fail benchmark on error
     if (result < 0) {
-        fprintf(stderr, "pread: %s", strerror(-(int)result));
+        fprintf(stderr, "%s: %s\n", _op_names[op], strerror(errno));
         exit(EXIT_FAILURE);
     }
-    // track total request latency
-    _time_wait_total += timestamp() - (int64_t)(closure);
+    // track total and individual request latency
+    const int64_t latency = timestamp() - (int64_t)(closure);
+    _time_wait_total[op] += latency;
+    _op_total[op]++;
+    _latencies[op].push_back(latency);
+}
+
+void
+read_callback(void *closure, ssize_t result, void *buf)
+{
+    op_callback(OP_READ, closure, result);
+    // return buffer to free pool
+    _buffers.push_back(buf);
+}
+
+void
+write_callback(void *closure, ssize_t result, void *buf)
+{
+    op_callback(OP_WRITE, closure, result);
     // return buffer to free pool
     _buffers.push_back(buf);
 }
 
+void
+sync_callback(void *closure, ssize_t result, void *)
+{
+    op_callback(OP_SYNC, closure, result);
+    // return the held buffer to free pool
+    _buffers.push_back(_held.back());
+    _held.pop_back();
+}
+
 vector< pair<int, off_t> > _files;
+vector<off_t> _cursors;
 
 void
 open_files(char **argv)
 {
     int ret;
     struct stat st;
+    const int flags = IOQ_OPEN_FLAGS | (WRITE_PCT > 0 ? O_RDWR : O_RDONLY);
     for (char **path = argv + 1; *path; path++) {
-        int fd = open(*path, IOQ_OPEN_FLAGS);
+        int fd = open(*path, flags);
         if (fd == -1) {
-            fprintf(stderr, "%s: open(%s, %d): %s\n", *argv, *path, IOQ_OPEN_FLAGS, strerror(errno));
+            fprintf(stderr, "%s: open(%s, %d): %s\n", *argv, *path, flags, strerror(errno));
             exit(EXIT_FAILURE);
         }
         ret = fstat(fd, &st);
@@ -159,16 +234,25 @@ open_files(char **argv)
         }
 #endif
         _files.push_back(make_pair(fd, st.st_size / BUFSIZE * BUFSIZE));
+        _cursors.push_back(0);
     }
 }
 
 pair<int, off_t>
-next_read_request(struct random_data *rdata)
+next_request(struct random_data *rdata, int n)
 {
     union {
         int32_t r[2];
         uint64_t val;
     } res;
+    if (SEQUENTIAL) {
+        // each file in turn, from where it was left off
+        size_t i = (size_t)n % _files.size();
+        pair<int, off_t> f = _files[i];
+        f.second = _cursors[i];
+        _cursors[i] = (_cursors[i] + BUFSIZE) % _files[i].second;
+        return f;
+    }
     random_r(rdata, &res.r[0]);
     random_r(rdata, &res.r[1]);
     // random file descriptor from those opened
@@ -179,6 +263,52 @@ next_read_request(struct random_data *rdata)
     return f;
 }
 
+enum bench_op
+next_op(struct random_data *rdata)
+{
+    int32_t r;
+    if (WRITE_PCT == 0 || WRITE_PCT == 100) {
+        return WRITE_PCT ? OP_WRITE : OP_READ;
+    }
+    random_r(rdata, &r);
+    return r % 100 < WRITE_PCT ? OP_WRITE : OP_READ;
+}
+
+/* the latency in nanoseconds that `pct` percent of the sorted `latencies` are at or below */
+int64_t
+percentile(const vector<int64_t> &latencies, double pct)
+{
+    size_t rank = (size_t)ceil((double)latencies.size() * pct / 100.0);
+    if (rank == 0) {
+        rank = 1;
+    }
+    return latencies[min(rank, latencies.size()) - 1];
+}
+
+/* write a histogram of each type of request's latencies, in microseconds */
+void
+write_latencies(const char *me, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: fopen(%s): %s\n", me, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "# backend op latency_us count\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        const vector<int64_t> &latencies = _latencies[op];
+        for (size_t i = 0, j; i < latencies.size(); i = j) {
+            const int64_t us = latencies[i] / 1000;
+            for (j = i + 1; j < latencies.size() && latencies[j] / 1000 == us; j++);
+            fprintf(fp, "%s %s %lld %zu\n", IOQ_BACKEND, _op_names[op], (long long)us, j - i);
+        }
+    }
+    if (fclose(fp) == EOF) {
+        fprintf(stderr, "%s: fclose(%s): %s\n", me, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
 void
 close_files()
 {
@@ -187,6 +317,19 @@ close_files()
     }
 }
 
+void
+ioqueue_setup()
+{
+    /* initialize an aio context */
+    if (ioqueue_init(Q_DEPTH) == -1) {
+        perror("ioqueue_init");
+        exit(EXIT_FAILURE);
+    }
+
+    /* allocate buffers from the queue's pool */
+    init_buffers();
+}
+
 void
 ioqueue_bench()
 {
@@ -198,18 +341,26 @@ ioqueue_bench()
     memset(&rdata, 0, sizeof(rdata));
     initstate_r(RANDSEED, rstate, sizeof(rstate), &rdata);
 
-    /* initialize an aio context */
-    ret = ioqueue_init(Q_DEPTH);
-    if (ret == -1) {
-        perror("ioqueue_init");
-        exit(EXIT_FAILURE);
-    }
-
     /* queue all the requests */
-    for (int i = 0; i < REQUESTS; ) {
-        while (!_buffers.empty()) {
-            /* generate a random read request */
-            const pair<int, off_t> req = next_read_request(&rdata);
+    int sync_fd = -1;
+    for (int i = 0, writes = 0; i < REQUESTS; ) {
+        while (!_buffers.empty() && i < REQUESTS) {
+            /* sync the file last written to, holding a buffer back for the queue slot it takes */
+            if (sync_fd != -1) {
+                _held.push_back(_buffers.back());
+                _buffers.pop_back();
+                ret = ioqueue_fdatasync(sync_fd, &sync_callback, (void *)(timestamp()));
+                if (ret == -1) {
+                    perror("ioqueue_fdatasync");
+                    exit(EXIT_FAILURE);
+                }
+                sync_fd = -1;
+                continue;
+            }
+
+            /* generate a read or write request */
+            const enum bench_op op = next_op(&rdata);
+            const pair<int, off_t> req = next_request(&rdata, i);
 
             /* take the next available buffer */
             void *const buf = _buffers.back();
@@ -218,13 +369,20 @@ ioqueue_bench()
             /* record the start time as a pointer (TODO: pass actual pointer to timestamp) */
             void *const closure = (void *)(timestamp());
 
-            /* enqueue the read request -- non-blocking */
-            ret = ioqueue_pread(req.first, buf, BUFSIZE, req.second, &aio_callback, closure);
+            /* enqueue the request -- non-blocking */
+            if (op == OP_WRITE) {
+                ret = ioqueue_pwrite(req.first, buf, BUFSIZE, req.second, &write_callback, closure);
+            } else {
+                ret = ioqueue_pread(req.first, buf, BUFSIZE, req.second, &read_callback, closure);
+            }
             if (ret == -1) {
-                perror("ioqueue_pread");
+                perror(op == OP_WRITE ? "ioqueue_pwrite" : "ioqueue_pread");
                 exit(EXIT_FAILURE);
             }
             i++;
+            if (op == OP_WRITE && SYNC_EVERY > 0 && ++writes % SYNC_EVERY == 0) {
+                sync_fd = req.first;
+            }
         }
 
         /* reap completed requests -- blocking, as no buffers remain */
@@ -235,7 +393,8 @@ ioqueue_bench()
         }
     }
 
-    /* reap all requests and destroy the queue */
+    /* reap all requests, release the buffers and destroy the queue */
+    free_buffers();
     ioqueue_destroy();
 }
 
@@ -257,9 +416,9 @@ main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    /* open input files and allocate buffers */
+    /* open input files, initialize the queue and allocate buffers */
     open_files(argv);
-    init_buffers();
+    ioqueue_setup();
 
     /* record start time */
     time_start = timestamp();
@@ -278,23 +437,41 @@ main(int argc, char **argv)
     /* record finish time */
     time_total = timestamp() - time_start;
 
-    /* report throughput and average request latency */
-    fprintf(stderr, "backend         reqs    bufsize depth   rtime   utime   stime   cpu     us/op   op/s    MB/s\n");
-    fprintf(stdout, "%-15s ", IOQ_BACKEND);
-    fprintf(stdout, "%-7d ", REQUESTS);
-    fprintf(stdout, "%-7d ", BUFSIZE);
-    fprintf(stdout, "%-7d ", Q_DEPTH);
-    fprintf(stdout, "%-7lld ", (long long)((double)time_total / 1e6));
-    fprintf(stdout, "%-7lld ", (long long)((double)time_cpu_user / 1e3));
-    fprintf(stdout, "%-7lld ", (long long)((double)time_cpu_system / 1e3));
-    fprintf(stdout, "%-7lld ", (long long)((double)(time_cpu_user + time_cpu_system) / 1e3));
-    fprintf(stdout, "%-7lld ", (long long)((double)_time_wait_total / 1e3 / REQUESTS));
-    fprintf(stdout, "%-7lld ", (long long)(REQUESTS / ((double)_time_wait_total / 1e9)));
-    fprintf(stdout, "%-7.2f ", ((double)BUFSIZE * REQUESTS / (1 << 20)) / ((double)_time_wait_total / 1e9));
-    fprintf(stdout, "\n");
+    /* report throughput, average and tail request latency of each type of request issued */
+    fprintf(stderr, "backend         op      reqs    bufsize depth   rtime   utime   stime   cpu     us/op   op/s    MB/s    "
+                    "p50     p90     p99     p99.9   max\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        sort(_latencies[op].begin(), _latencies[op].end());
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        const int reqs = _op_total[op];
+        const double wait = (double)_time_wait_total[op];
+        const int bytes = op == OP_SYNC ? 0 : BUFSIZE;
+        if (reqs == 0) continue;
+        fprintf(stdout, "%-15s ", IOQ_BACKEND);
+        fprintf(stdout, "%-7s ", _op_names[op]);
+        fprintf(stdout, "%-7d ", reqs);
+        fprintf(stdout, "%-7d ", BUFSIZE);
+        fprintf(stdout, "%-7d ", Q_DEPTH);
+        fprintf(stdout, "%-7lld ", (long long)((double)time_total / 1e6));
+        fprintf(stdout, "%-7lld ", (long long)((double)time_cpu_user / 1e3));
+        fprintf(stdout, "%-7lld ", (long long)((double)time_cpu_system / 1e3));
+        fprintf(stdout, "%-7lld ", (long long)((double)(time_cpu_user + time_cpu_system) / 1e3));
+        fprintf(stdout, "%-7lld ", (long long)(wait / 1e3 / reqs));
+        fprintf(stdout, "%-7lld ", (long long)(reqs / (wait / 1e9)));
+        fprintf(stdout, "%-7.2f ", ((double)bytes * reqs / (1 << 20)) / (wait / 1e9));
+        fprintf(stdout, "%-7lld ", (long long)(percentile(_latencies[op], 50) / 1000));
+        fprintf(stdout, "%-7lld ", (long long)(percentile(_latencies[op], 90) / 1000));
+        fprintf(stdout, "%-7lld ", (long long)(percentile(_latencies[op], 99) / 1000));
+        fprintf(stdout, "%-7lld ", (long long)(percentile(_latencies[op], 99.9) / 1000));
+        fprintf(stdout, "%-7lld ", (long long)(_latencies[op].back() / 1000));
+        fprintf(stdout, "\n");
+    }
+    if (LATENCY_FILE != NULL) {
+        write_latencies(*argv, LATENCY_FILE);
+    }
 
     /* close input files and exit*/
     close_files();
-    free_buffers();
     exit(EXIT_SUCCESS);
 }
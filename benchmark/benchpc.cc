@@ -1,5 +1,5 @@
 #define IOQ_BACKEND "pthread"
-#define IOQ_OPEN_FLAGS (O_RDONLY)
+#define IOQ_OPEN_FLAGS (0)
 #define IOQ_FADV_POLICY POSIX_FADV_NOREUSE
 #include "bench.cc"
 
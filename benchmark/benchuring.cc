@@ -0,0 +1,8 @@
+#define IOQ_BACKEND "uring"
+#include "bench.cc"
+
+//
+// io_uring ioqueue benchmark
+//
+
+// Nothing to see here, move along.
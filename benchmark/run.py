@@ -1,21 +1,38 @@
 import os
+import subprocess
 import sys
 
-def test(requests, bufsize, depth, binary, path):
-    cmd = 'REQUESTS=%d BUFSIZE=%d Q_DEPTH=%d %s %s'
-    cmd %= (requests, bufsize, depth, binary, path)
-    ret = os.system(cmd)
-    if ret:
-        raise SystemExit(ret)
+COLUMNS = ('p50', 'p90', 'p99', 'p99.9', 'max')
 
-def testmt(requests, bufsize, depth, binary, path):
-    test(requests, bufsize, depth, binary + 'mt', path)
+def test(requests, bufsize, depth, binary, path, results):
+    env = dict(os.environ, REQUESTS=str(requests), BUFSIZE=str(bufsize), Q_DEPTH=str(depth))
+    if 'LATENCY_FILE' in os.environ:
+        # one distribution per buffer size
+        env['LATENCY_FILE'] = '%s.%d' % (os.environ['LATENCY_FILE'], bufsize)
+    proc = subprocess.Popen([binary, path], env=env, stdout=subprocess.PIPE, universal_newlines=True)
+    out = proc.communicate()[0]
+    sys.stdout.write(out)
+    if proc.returncode:
+        raise SystemExit(proc.returncode)
+    # backend op reqs bufsize depth rtime utime stime cpu us/op op/s MB/s p50 p90 p99 p99.9 max
+    for line in out.splitlines():
+        fields = line.split()
+        results.append((fields[0], fields[1], bufsize, fields[-len(COLUMNS):]))
+
+def testmt(requests, bufsize, depth, binary, path, results):
+    test(requests, bufsize, depth, binary + 'mt', path, results)
 
 args = list(sys.argv[1:])
 binary = args.pop(0)
 path = args.pop(0)
 depth = int(args.pop(0)) if args else 32
-for s in xrange(10):
-    requests = 1 << (18 - s/3)
+results = []
+for s in range(10):
+    requests = 1 << (18 - s // 3)
     bufsize = 1 << (9 + s)
-    test(requests, bufsize, depth, binary, path)
+    test(requests, bufsize, depth, binary, path, results)
+
+# the latency percentiles in microseconds across the sweep
+sys.stdout.write('\n%-15s %-7s %-7s %s\n' % ('backend', 'op', 'bufsize', ' '.join('%-7s' % c for c in COLUMNS)))
+for backend, op, bufsize, values in results:
+    sys.stdout.write('%-15s %-7s %-7d %s\n' % (backend, op, bufsize, ' '.join('%-7s' % v for v in values)))
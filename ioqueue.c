@@ -17,16 +17,23 @@
 // and Lesser General Public License along with this program. If not,
 // see <http://www.gnu.org/licenses/>.
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <errno.h>
 #include <limits.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <linux/aio_abi.h>
 #include <sys/eventfd.h>
 #include "ioqueue.h"
+#include "ioqueuepriv.h"
 
 /** KAIO l-value helpers **/
 /* the request file operation */
@@ -43,6 +50,8 @@
 #define IOCB_DATA(iocbp)              (*(void**)&((iocbp)->aio_data))
 /* the request flags */
 #define IOCB_FLAGS(iocbp)      (*(unsigned int*)&((iocbp)->aio_flags))
+/* the request I/O priority */
+#define IOCB_PRIO(iocbp)       (*(unsigned short*)&((iocbp)->aio_reqprio))
 /* the request eventfd */
 #define IOCB_RESFD(iocbp)      (*(int*)&((iocbp)->aio_resfd))
 /* the event closure data */
@@ -55,6 +64,36 @@ extern int io_submit(aio_context_t ctx, long nr, struct iocb *ios[]);
 extern int io_cancel(aio_context_t ctx, struct iocb *iocbp, struct io_event *evp);
 extern int io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events, struct timespec *timeout);
 
+/**
+ * KAIO completion ring
+ *   The kernel maps this ring into user space at the address given by
+ *   the aio_context_t.  Completed events may be consumed directly from
+ *   it by advancing the head, without calling io_getevents().
+ */
+struct aio_ring {
+    unsigned int id;
+    unsigned int nr;                /* number of io_events */
+    unsigned int head;              /* written by the consumer */
+    unsigned int tail;              /* written by the kernel */
+    unsigned int magic;
+    unsigned int compat_features;
+    unsigned int incompat_features;
+    unsigned int header_length;     /* size of this header */
+    struct io_event io_events[];
+};
+#define AIO_RING_MAGIC 0xa10a10a1
+
+/**
+ * fused read gap buffer
+ *   The scratch buffer that the gaps between fused reads are read into.
+ *   It is held by the fused reads built while it is current, and freed
+ *   once it has been replaced and the last of them has completed.
+ */
+struct ioqueue_pad {
+    void *data;         /* `fuse_gap` bytes from the pool */
+    unsigned int refs;  /* fused reads in flight that read into it */
+};
+
 /**
  * ioqueue request closure
  *   Contains reference to the callback, the callback closure, and the
@@ -64,251 +103,2425 @@ extern int io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event
 struct ioqueue_request {
     ioqueue_cb cb;
     void *cb_data;
+    unsigned int id;  /* the request slot, ioq->slots[id] == &request */
+    unsigned int gen; /* the number of times the slot has been used */
+    int handle;       /* the request handle, or -1 when free */
+    int64_t t_submit;   /* when the request was enqueued */
+    int64_t t_dispatch; /* when the request was passed to io_submit(), or 0 */
+    int fused;        /* the request is read by another's iocb, see ioqueue_fuse() */
+    int cached;       /* the request is served from a read-ahead or cache block, or fills a cache block */
+    unsigned int nfused;  /* for the first request of a fused read, the requests it reads */
+    struct iovec *iov;    /* for the first request of a fused read, the buffers it reads into */
+    struct ioqueue_pad *pad;  /* for the first request of a fused read, the gap buffer it holds, or NULL */
+    struct ioqueue_request *next; /* the next request of a fused read, or on the done-list */
+    ssize_t res;      /* the result while on the done-list, or of a split request so far */
+    int err;          /* the error while on the done-list, or of a split request so far */
+    unsigned int tag; /* the rate limit tag, or 0 */
+    int held;         /* the request has been held back by its rate limit */
+    int charged;      /* the request has been charged to its rate limit, which it is only once */
+    int64_t deadline; /* when the request is no longer worth submitting, or 0 */
+    struct ioqueue_block *blk;  /* the read-ahead buffer or cache block it reads into, or NULL */
+    struct iovec dst; /* for a cache fill, bounced or split request, the caller's own buffer and length */
+    off_t dst_off;    /* for a cache fill, bounced or split request, the caller's own offset */
+    void *bounce;     /* the aligned buffer of an unaligned request, see ioqueue_bounce() */
+    int rmw;          /* for an unaligned write, 1 while reading its blocks and 2 while writing them */
+    off_t eof;        /* for an unaligned write, where its blocks were read short, or -1 */
+    uint64_t seq;     /* the order the request was enqueued in */
+    int harvested;    /* its completion event has been reaped */
+    struct ioqueue_request *after;  /* the earlier write it is ordered behind, or NULL */
+    struct ioqueue_request *deps;   /* the writes ordered behind it, linked by next */
+    struct ioqueue_request *parent; /* for a part of a split request, the request, or NULL */
+    unsigned int nchunk;  /* for a split request, its parts not yet done, itself included */
+    size_t split;         /* for a split request, the length of each part */
+    size_t split_next;    /* for a split request, where in the caller's buffer the next part starts */
+    int hedged;       /* one of the reads of a hedged pread, see ioqueue_hedge_done() */
+    int hedge_fd;     /* for a hedged pread, the replica its backup read goes to, or -1 once sent */
+    int64_t hedge_delay;  /* for a hedged pread, how long after dispatch its backup read is sent, or -1 */
+    struct ioqueue_request *hedge;  /* the other read it is racing, or NULL */
     struct iocb iocb; /* IO_DATA(&request.iocb) == (void*)&request */
 };
 
-/** global variables **/
+/**
+ * read-ahead streams
+ *   Preads on a file registered with ioqueue_set_readahead() are watched
+ *   for sequential offsets.  Once IOQUEUE_RA_SEQ reads in a row have each
+ *   started where the last ended, the next `window` bytes are read into
+ *   one of two staging buffers, and the other is filled as soon as reads
+ *   move into the first.  Preads within a loaded buffer are copied from it
+ *   and complete on the next reap, and those within one still loading
+ *   wait for its read.  The window doubles with each read-ahead up to
+ *   `max`, halves when a buffer is refilled with less than half of it
+ *   read, and starts over at a read elsewhere in the file.
+ */
+#define IOQUEUE_RA_SEQ      2                   /* sequential reads before reading ahead */
+#define IOQUEUE_RA_MIN      ((size_t)64 << 10)  /* the first read-ahead window */
+#define IOQUEUE_RA_ALIGN    ((size_t)4096)      /* read-ahead offset and length alignment, for O_DIRECT */
+
+/* a read-ahead buffer or block cache entry, filled by a single read that later preads may wait on */
+struct ioqueue_block {
+    struct ioqueue_stream *stream;  /* the read-ahead stream, or NULL for a cache block */
+    int fd;             /* for a cache block, the file, or -1 when unused */
+    unsigned int hnext; /* for a cache block, the next in its hash chain */
+    int ref;            /* for a cache block, it was read since the clock hand last passed */
+    char *data;         /* the buffer, from the pool */
+    off_t off;          /* the file offset of data[0] */
+    size_t len;         /* the bytes held, or being read while loading */
+    size_t used;        /* the bytes copied out since it was loaded */
+    int eof;            /* the read came back short */
+    int stale;          /* a write overlapped it while loading */
+    struct ioqueue_request *loading;   /* the read in flight, or NULL */
+    /* preads waiting on the read, linked by next */
+    struct ioqueue_request *waiters, *waiters_tail;
+    unsigned int nwaiters;
+};
+
+struct ioqueue_stream {
+    int fd;             /* the file, or -1 once disabled with a read-ahead still in flight */
+    size_t max;         /* the largest window */
+    size_t min;         /* the smallest window */
+    size_t window;      /* the next read-ahead length */
+    off_t next;         /* where a sequential read would start */
+    unsigned int seq;   /* sequential reads in a row, up to IOQUEUE_RA_SEQ */
+    struct ioqueue_block bufs[2];
+};
+
+/**
+ * block cache
+ *   Preads that fit within one aligned `block` of a file are served from
+ *   a fixed set of cached blocks, found through a hash of file and offset.
+ *   A hit is copied out and completes on the next reap.  The first pread
+ *   to miss reads the whole block into the cache in place of its own
+ *   read, then copies its part out, and preads of the same block meanwhile
+ *   wait on it.  Blocks are evicted by CLOCK: the hand passes over blocks
+ *   being read, clears the reference bit of blocks read since it last
+ *   passed, and evicts the first block without it.  Blocks that came back
+ *   short or failed are not kept, and writes through the queue drop the
+ *   blocks they overlap.
+ */
+struct ioqueue_cache {
+    struct ioqueue_block *blocks;
+    unsigned int *hash;     /* the first block of each chain, or UINT_MAX */
+    unsigned int nblock;
+    unsigned int mask;      /* the hash table size - 1 */
+    unsigned int hand;      /* the clock hand */
+    size_t block;           /* the block size, a power of two */
+    char *data;             /* nblock * block bytes from the pool */
+};
+
+/**
+ * hedged reads
+ *   A pread given several replicas of the same data reads one of them,
+ *   taken in turn, and once it has been in flight for longer than
+ *   `hedge_pct` percent of recent hedged preads took, a backup read of the
+ *   next replica is sent, or sent at once if the first read fails.  The
+ *   first read to succeed completes the pread, and the other is cancelled
+ *   or, failing that, discarded on completion.
+ *   Both read into buffers from the pool, so the loser never touches the
+ *   caller's buffer once the callback has run.  Latencies decay by half
+ *   every IOQUEUE_HEDGE_WINDOW preads, so the threshold follows the
+ *   devices, and backup reads wait for IOQUEUE_HEDGE_WARMUP of them.
+ */
+#define IOQUEUE_HEDGE_PCT       95.0    /* the default percentile */
+#define IOQUEUE_HEDGE_WARMUP    16      /* latencies recorded before sending backup reads */
+#define IOQUEUE_HEDGE_WINDOW    1024    /* latencies recorded before halving their weight */
 
-/* KAIO request buffer, when not in-flight, as passed to io_submit()
- *   - the array head is a queue of requests yet to be submitted
- *   - the array tail is a stack of completed and unused requests
+/**
+ * ioqueue instance
+ *   Each instance owns a KAIO context along with its request and event
+ *   buffers; no state is shared between instances.
  */
-static struct iocb **_io_reqs;
-/* KAIO event buffer for completed I/O events, as received from io_getevents() */
-static struct io_event *_io_evs;
-/* KAIO context - opaque integer handle */
-static aio_context_t _ctx = 0;
-static unsigned int _depth;      /* maximum outstanding requests */
-static unsigned int _nreqs;      /* allocated request objects */
-static unsigned int _nfree;      /* free request stack size */
-static unsigned int _nwait;      /* waiting request stack size */
-static int _eventfd;    /* eventfd(2) for poll/epoll */
+struct ioqueue {
+    /* KAIO request buffer, when not in-flight, as passed to io_submit()
+     *   - the array head is a queue of requests yet to be submitted
+     *   - the array tail is a stack of completed and unused requests
+     */
+    struct iocb **io_reqs;
+    /* request objects by slot, for resolving handles */
+    struct ioqueue_request **slots;
+    /* KAIO event buffer for completed I/O events, as received from io_getevents() */
+    struct io_event *io_evs;
+    /* KAIO context - opaque integer handle */
+    aio_context_t ctx;
+    /* KAIO completion ring, or NULL when its layout is not recognised */
+    struct aio_ring *ring;
+    int64_t busypoll;        /* nanoseconds to spin before blocking */
+    unsigned int flush_batch;   /* auto-flush once this many requests wait */
+    int64_t flush_delay;        /* auto-flush once the oldest has waited this long */
+    int64_t wait_since;         /* when the oldest waiting request was queued */
+    int flushing;               /* the wait-queue is being submitted */
+    size_t fuse_gap;            /* fuse reads at most this many bytes apart */
+    size_t fuse_max;            /* the largest fused read, or 0 to disable fusing */
+    struct ioqueue_pad *fuse_pad;   /* reads the gaps between fused reads, or NULL */
+    struct iocb **fuse_sort;    /* the wait-queue reads ordered by file and offset */
+    unsigned int nextra;        /* requests in flight beyond one per iocb, i.e. fused */
+    /* completed requests of fused reads that are yet to run their callback */
+    struct ioqueue_request *done_head, *done_tail;
+    unsigned int ndone;
+    struct ioqueue_rate rate;   /* rate limits by tag */
+    struct iocb **rate_held;    /* the requests held back by a flush */
+    int64_t rate_next;          /* when the first held request may be submitted */
+    int edf;                    /* a waiting request has a deadline */
+    struct ioqueue_request **shed;  /* the waiting requests past their deadline */
+    struct ioqueue_stream **streams;    /* read-ahead streams by file */
+    unsigned int nstream;
+    unsigned int maxstream;
+    unsigned int ninternal;     /* read-aheads outstanding, which are not the caller's requests */
+    unsigned int limit;         /* the caller's requests allowed outstanding, the rest of `depth` is kept for internal ones */
+    struct ioqueue_cache cache; /* the block cache, when cache.nblock > 0 */
+    size_t align;               /* bounce requests not aligned to this, or 0 */
+    unsigned int nrmw;          /* unaligned writes outstanding */
+    uint64_t seq;               /* the next request's order */
+    unsigned int ninflight;     /* iocbs submitted and not yet reaped */
+    int requeued;               /* a reap moved requests onto the wait-queue */
+    size_t split_max;           /* split preads and pwrites longer than this, or 0 */
+    struct ioqueue_hist hedge_hist; /* the recent latencies of hedged preads */
+    double hedge_pct;           /* send backup reads past this percentile of them */
+    int64_t hedge_min;          /* and no sooner than this */
+    unsigned int hedge_next;    /* the replica the next hedged pread reads first */
+    unsigned int nhedge;        /* hedged preads yet to send their backup read */
+    unsigned int depth;      /* maximum outstanding requests */
+    unsigned int nreqs;      /* allocated request objects */
+    unsigned int nfree;      /* free request stack size */
+    unsigned int nwait;      /* waiting request stack size */
+    int eventfd;    /* eventfd(2) for poll/epoll */
+    struct ioqueue_stats stats;
+    struct ioqueue_pool pool;   /* I/O buffers */
+};
 
+/* only read the completion ring directly if it is a known layout */
+static void ioqueue_ring_attach(ioqueue_t *ioq)
+{
+    ioq->ring = (struct aio_ring *)(uintptr_t)ioq->ctx;
+    if (ioq->ring->magic != AIO_RING_MAGIC || ioq->ring->incompat_features != 0 ||
+            ioq->ring->header_length != sizeof(struct aio_ring)) {
+        ioq->ring = NULL;
+    }
+}
 
-/* initiliaze the io queue to the given maximum outstanding requests */
-int ioqueue_init(unsigned int depth)
+/* create an io queue with the given maximum outstanding requests */
+ioqueue_t *ioqueue_create(unsigned int depth)
 {
     int ret;
-    if (_ctx != 0 || depth == 0 || depth > INT_MAX) {
+    ioqueue_t *ioq;
+    if (depth == 0 || depth > INT_MAX) {
         errno = EINVAL;
-        return -1;
+        return NULL;
+    }
+    ioq = calloc(1, sizeof(ioqueue_t));
+    if (ioq == NULL) {
+        return NULL;
+    }
+    ioq->io_reqs = malloc((size_t)depth * sizeof(struct iocb *));
+    if (ioq->io_reqs == NULL) {
+        free(ioq);
+        return NULL;
     }
-    _io_reqs = malloc((size_t)depth * sizeof(struct iocb *));
-    if (_io_reqs == NULL) {
+    ioq->io_evs = malloc((size_t)depth * sizeof(struct io_event));
+    if (ioq->io_evs == NULL) {
+        free(ioq->io_reqs);
+        free(ioq);
+        return NULL;
+    }
+    ioq->slots = malloc((size_t)depth * sizeof(struct ioqueue_request *));
+    if (ioq->slots == NULL) {
+        free(ioq->io_reqs);
+        free(ioq->io_evs);
+        free(ioq);
+        return NULL;
+    }
+    ret = io_setup(depth, &ioq->ctx);
+    if (ret < 0) {
+        free(ioq->io_reqs);
+        free(ioq->io_evs);
+        free(ioq->slots);
+        free(ioq);
+        errno = -ret;
+        return NULL;
+    }
+    ioq->depth = (unsigned int)depth;
+    ioq->limit = (unsigned int)depth;
+    ioq->nreqs = 0;
+    ioq->nfree = 0;
+    ioq->nwait = 0;
+    ioq->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ioq->hedge_pct = IOQUEUE_HEDGE_PCT;
+    ioqueue_ring_attach(ioq);
+    return ioq;
+}
+
+/**
+ * internal request slots
+ *   Read-aheads, split parts and backup reads take their slots from a
+ *   reserve of half the caller's depth on top of it, so they never make
+ *   a caller's request fail with EAGAIN.  The reserve is only added once
+ *   one of them is enabled.  The kernel context, the request arrays and
+ *   the handles are all sized by the total, so the queue must be idle.
+ */
+static int ioqueue_reserve(ioqueue_t *ioq)
+{
+    int ret;
+    unsigned int i;
+    aio_context_t ctx = 0;
+    struct iocb **io_reqs;
+    struct io_event *io_evs;
+    struct ioqueue_request **slots;
+    struct iocb **fuse_sort = NULL, **rate_held = NULL;
+    struct ioqueue_request **shed = NULL;
+    const unsigned int depth = ioq->limit + (ioq->limit + 1) / 2;
+
+    if (ioq->depth > ioq->limit) return 0;
+    if (ioq->nfree != ioq->nreqs) {
+        errno = EBUSY;
         return -1;
     }
-    _io_evs = malloc((size_t)depth * sizeof(struct io_event));
-    if (_io_evs == NULL) {
-        free(_io_reqs);
+    if (depth > INT_MAX) {
+        errno = EINVAL;
         return -1;
     }
-    ret = io_setup(depth, &_ctx);
+    io_reqs = malloc((size_t)depth * sizeof(struct iocb *));
+    io_evs = malloc((size_t)depth * sizeof(struct io_event));
+    slots = malloc((size_t)depth * sizeof(struct ioqueue_request *));
+    if (ioq->fuse_sort != NULL) {
+        fuse_sort = malloc((size_t)depth * sizeof(struct iocb *));
+    }
+    if (ioq->rate_held != NULL) {
+        rate_held = malloc((size_t)depth * sizeof(struct iocb *));
+    }
+    if (ioq->shed != NULL) {
+        shed = malloc((size_t)depth * sizeof(struct ioqueue_request *));
+    }
+    if (io_reqs == NULL || io_evs == NULL || slots == NULL || (ioq->fuse_sort != NULL && fuse_sort == NULL) ||
+        (ioq->rate_held != NULL && rate_held == NULL) || (ioq->shed != NULL && shed == NULL)) {
+        ret = -ENOMEM;
+    } else {
+        ret = io_setup(depth, &ctx);
+    }
     if (ret < 0) {
-        free(_io_reqs);
-        free(_io_evs);
+        free(io_reqs);
+        free(io_evs);
+        free(slots);
+        free(fuse_sort);
+        free(rate_held);
+        free(shed);
         errno = -ret;
         return -1;
     }
-    _depth = (unsigned int)depth;
-    _nreqs = 0;
-    _nfree = 0;
-    _nwait = 0;
-    _eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    /* nothing is in flight, so the old context is destroyed at once */
+    io_destroy(ioq->ctx);
+    ioq->ctx = ctx;
+    ioqueue_ring_attach(ioq);
+    /* every request is free, restack them at the tail of the larger array */
+    memcpy(slots, ioq->slots, (size_t)ioq->nreqs * sizeof(struct ioqueue_request *));
+    for (i = 0; i < ioq->nreqs; i++) {
+        io_reqs[depth - 1 - i] = &slots[i]->iocb;
+    }
+    free(ioq->io_reqs);
+    free(ioq->io_evs);
+    free(ioq->slots);
+    free(ioq->fuse_sort);
+    free(ioq->rate_held);
+    free(ioq->shed);
+    ioq->io_reqs = io_reqs;
+    ioq->io_evs = io_evs;
+    ioq->slots = slots;
+    ioq->fuse_sort = fuse_sort;
+    ioq->rate_held = rate_held;
+    ioq->shed = shed;
+    ioq->depth = depth;
     return 0;
 }
 
+/* create an io queue of `depth` outstanding requests, there are no worker threads to size */
+ioqueue_t *ioqueue_create_threads(unsigned int depth, unsigned int min_threads, unsigned int max_threads, unsigned int backlog)
+{
+    (void)min_threads;
+    (void)max_threads;
+    (void)backlog;
+    return ioqueue_create(depth);
+}
+
 /* retrieve a file descrptor suitable for io readiness notifications via e.g. poll/epoll */
-int ioqueue_eventfd()
+int ioqueue_ctx_eventfd(ioqueue_t *ioq)
+{
+    return ioq->eventfd;
+}
+
+/* the requests outstanding on behalf of the caller, i.e. excluding read-aheads */
+static unsigned int ioqueue_outstanding(const ioqueue_t *ioq)
 {
-    return _eventfd;
+    return ioq->nreqs - ioq->nfree - ioq->ninternal;
 }
 
-/* allocate (or retrieve) a request object */
-static struct ioqueue_request * ioqueue_request_alloc()
+/* allocate (or retrieve) a request object, for the caller or else from the reserved slots */
+static struct ioqueue_request * ioqueue_request_alloc(ioqueue_t *ioq, int internal)
 {
     struct ioqueue_request *req;
-    if (_nfree > 0) {
+    if (internal ? ioq->ninternal >= ioq->depth - ioq->limit : ioqueue_outstanding(ioq) >= ioq->limit) {
+        /* internal requests never take the caller's slots, nor the caller theirs */
+        if (!internal) ioq->stats.eagain++;
+        errno = EAGAIN;
+        return NULL;
+    }
+    if (ioq->nfree > 0) {
         /* pop a request from the tail free-stack */
-        req = IOCB_DATA(_io_reqs[_depth - (_nfree--)]);
-    } else if (_nreqs < _depth) {
+        req = IOCB_DATA(ioq->io_reqs[ioq->depth - (ioq->nfree--)]);
+    } else if (ioq->nreqs < ioq->depth) {
         /* allocate a new request */
         req = malloc(sizeof(struct ioqueue_request));
         if (req == NULL) return NULL;
-        _nreqs++;
+        req->id = ioq->nreqs;
+        req->gen = 0;
+        ioq->slots[ioq->nreqs++] = req;
     } else {
         /* queue overflow */
+        ioq->stats.eagain++;
         errno = EAGAIN;
         return NULL;
     }
-    /* clear request and set self pointer */
-    memset(req, 0, sizeof(struct ioqueue_request));
+    /* clear request, set self pointer and issue a new handle */
+    req->cb = NULL;
+    req->cb_data = NULL;
+    req->fused = 0;
+    req->cached = 0;
+    req->iov = NULL;
+    req->pad = NULL;
+    req->next = NULL;
+    req->tag = 0;
+    req->held = 0;
+    req->charged = 0;
+    req->deadline = 0;
+    req->blk = NULL;
+    req->bounce = NULL;
+    req->rmw = 0;
+    req->harvested = 0;
+    req->after = NULL;
+    req->deps = NULL;
+    req->parent = NULL;
+    req->nchunk = 0;
+    req->hedged = 0;
+    req->hedge_fd = -1;
+    req->hedge = NULL;
+    req->seq = ioq->seq++;
+    memset(&req->iocb, 0, sizeof(struct iocb));
     IOCB_DATA(&req->iocb) = req;
+    req->handle = ioqueue_handle(req->id, ioq->depth, req->gen++);
+    req->t_submit = ioqueue_now();
+    req->t_dispatch = 0;
     /* push onto the head wait-queue */
-    _io_reqs[_nwait++] = &req->iocb;
+    if (ioq->nwait == 0) {
+        ioq->wait_since = req->t_submit;
+    }
+    ioq->io_reqs[ioq->nwait++] = &req->iocb;
     return req;
 }
 
 /* free a request */
-static void ioqueue_request_free(struct ioqueue_request *req)
+static void ioqueue_request_free(ioqueue_t *ioq, struct ioqueue_request *req)
 {
     /* push onto the tail free-stack */
-    _io_reqs[_depth - (++_nfree)] = &req->iocb;
+    req->handle = -1;
+    ioq->io_reqs[ioq->depth - (++ioq->nfree)] = &req->iocb;
 }
 
-static void
-ioqueue_request_finish(struct ioqueue_request *const req, ssize_t res, int err)
+/* the read-ahead stream of a file, or NULL */
+static struct ioqueue_stream *ioqueue_stream_find(ioqueue_t *ioq, int fd)
 {
-    if (res < 0) {
-        /* set errno for callback */
-        errno = err;
+    unsigned int i;
+    for (i = 0; i < ioq->nstream; i++) {
+        if (ioq->streams[i]->fd == fd) {
+            return ioq->streams[i];
+        }
     }
-    /* run callback */
-    switch (IOCB_OP(&req->iocb)) {
-    case IOCB_CMD_PREAD:
-    case IOCB_CMD_PWRITE:
-        (* (ioqueue_cb) req->cb)(req->cb_data, res, IOCB_BUF(&req->iocb));
-        break;
-    default:
-        /* unreachable */
-        abort();
+    return NULL;
+}
+
+/* free a disabled stream once no read-ahead is filling its buffers */
+static void ioqueue_stream_release(ioqueue_t *ioq, struct ioqueue_stream *s)
+{
+    unsigned int i;
+    if (s->fd != -1 || s->bufs[0].loading != NULL || s->bufs[1].loading != NULL) return;
+    for (i = 0; ioq->streams[i] != s; i++) { }
+    ioq->streams[i] = ioq->streams[--ioq->nstream];
+    ioqueue_pool_free(&ioq->pool, s->bufs[0].data);
+    ioqueue_pool_free(&ioq->pool, s->bufs[1].data);
+    free(s);
+}
+
+/* append a list of `n` requests, linked by next, to the done-list */
+static void ioqueue_done_push(ioqueue_t *ioq, struct ioqueue_request *head, struct ioqueue_request *tail, unsigned int n)
+{
+    if (ioq->done_tail != NULL) {
+        ioq->done_tail->next = head;
+    } else {
+        ioq->done_head = head;
     }
-    /* push free'd request onto tail-stack */
-    ioqueue_request_free(req);
+    ioq->done_tail = tail;
+    ioq->ndone += n;
 }
 
-/* enqueue a pread request  */
-int ioqueue_pread(int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_data)
+/* append a request to the wait-queue */
+static void ioqueue_request_push(ioqueue_t *ioq, struct ioqueue_request *req)
 {
-    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL) {
-        errno = EINVAL;
-        return -1;
+    if (ioq->nwait == 0) {
+        ioq->wait_since = ioqueue_now();
     }
+    ioq->io_reqs[ioq->nwait++] = &req->iocb;
+}
 
-    struct ioqueue_request *const req = ioqueue_request_alloc();
-    if (req == NULL) return -1;
+/* the hash chain of a file's block */
+static unsigned int ioqueue_cache_hash(const struct ioqueue_cache *c, int fd, off_t off)
+{
+    const uint64_t key = ((uint64_t)(unsigned int)fd << 40) ^ (uint64_t)off / c->block;
+    return (unsigned int)((key * 0x9e3779b97f4a7c15ull) >> 32) & c->mask;
+}
 
-    req->cb = (ioqueue_cb) cb;
-    req->cb_data = cb_data;
-    IOCB_OP(&req->iocb) = IOCB_CMD_PREAD;
-    IOCB_FD(&req->iocb) = fd;
-    IOCB_BUF(&req->iocb) = buf;
-    IOCB_LEN(&req->iocb) = len;
-    IOCB_OFF(&req->iocb) = offset;
-    if (_eventfd != -1) {
-        IOCB_FLAGS(&req->iocb) |= IOCB_FLAG_RESFD;
-        IOCB_RESFD(&req->iocb) = _eventfd;
+/* the cache block of a file at the block aligned `off`, or NULL */
+static struct ioqueue_block *ioqueue_cache_find(struct ioqueue_cache *c, int fd, off_t off)
+{
+    unsigned int i;
+    for (i = c->hash[ioqueue_cache_hash(c, fd, off)]; i != UINT_MAX; i = c->blocks[i].hnext) {
+        if (c->blocks[i].fd == fd && c->blocks[i].off == off) {
+            return &c->blocks[i];
+        }
     }
-    return 0;
+    return NULL;
 }
 
-/* enqueue a pwrite request  */
-int ioqueue_pwrite(int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_data)
+/* the bytes a read or write request covers, counting every buffer of a vectored one */
+static size_t ioqueue_request_len(const struct ioqueue_request *req)
 {
-    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL) {
-        errno = EINVAL;
-        return -1;
+    int i;
+    size_t len;
+    const struct iovec *iov;
+    if (IOCB_OP(&req->iocb) != IOCB_CMD_PREADV && IOCB_OP(&req->iocb) != IOCB_CMD_PWRITEV) {
+        return IOCB_LEN(&req->iocb);
     }
+    iov = IOCB_BUF(&req->iocb);
+    for (i = 0, len = 0; i < (int)IOCB_LEN(&req->iocb); i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
 
-    struct ioqueue_request *const req = ioqueue_request_alloc();
-    if (req == NULL) return -1;
+/* drop what a block holds, or what it is reading once the preads already waiting have it */
+static void ioqueue_block_drop(struct ioqueue_block *b)
+{
+    if (b->loading != NULL) {
+        b->stale = 1;
+    } else {
+        b->len = 0;
+    }
+}
 
-    req->cb = (ioqueue_cb) cb;
-    req->cb_data = cb_data;
-    IOCB_OP(&req->iocb) = IOCB_CMD_PWRITE;
-    IOCB_FD(&req->iocb) = fd;
-    IOCB_BUF(&req->iocb) = buf;
-    IOCB_LEN(&req->iocb) = len;
-    IOCB_OFF(&req->iocb) = offset;
-    if (_eventfd != -1) {
-        IOCB_FLAGS(&req->iocb) |= IOCB_FLAG_RESFD;
-        IOCB_RESFD(&req->iocb) = _eventfd;
+/* drop the read-ahead and cache blocks a write overlaps, both when it is enqueued and when it completes */
+static void ioqueue_invalidate(ioqueue_t *ioq, const struct ioqueue_request *req)
+{
+    int i;
+    unsigned int j;
+    off_t base;
+    struct ioqueue_block *b;
+    struct ioqueue_cache *const c = &ioq->cache;
+    struct ioqueue_stream *const s = ioqueue_stream_find(ioq, IOCB_FD(&req->iocb));
+    const size_t len = ioqueue_request_len(req);
+    const off_t off = IOCB_OFF(&req->iocb);
+    const off_t end = off + (off_t)len;
+
+    for (i = 0; s != NULL && i < 2; i++) {
+        b = &s->bufs[i];
+        if (b->len > 0 && off < b->off + (off_t)b->len && b->off < end) {
+            ioqueue_block_drop(b);
+        }
+    }
+    if (c->nblock == 0 || len == 0) return;
+    base = off & ~(off_t)(c->block - 1);
+    if ((uint64_t)(end - base) / c->block > c->nblock) {
+        /* a write larger than the cache, check every block */
+        for (j = 0; j < c->nblock; j++) {
+            b = &c->blocks[j];
+            if (b->fd == IOCB_FD(&req->iocb) && off < b->off + (off_t)c->block && b->off < end) {
+                ioqueue_block_drop(b);
+            }
+        }
+        return;
+    }
+    for (; base < end; base += (off_t)c->block) {
+        b = ioqueue_cache_find(c, IOCB_FD(&req->iocb), base);
+        if (b != NULL) {
+            ioqueue_block_drop(b);
+        }
+    }
+}
+
+/* give a pread its part of a block read that returned `res`, or fail it with `err` */
+static void ioqueue_block_copy(struct ioqueue_block *b, struct ioqueue_request *req, ssize_t res, int err)
+{
+    off_t pos;
+    req->err = err;
+    if (res < 0) {
+        req->res = -1;
+        return;
+    }
+    /* as for a fused read, a short read ends at EOF */
+    pos = IOCB_OFF(&req->iocb) - b->off;
+    req->res = res <= pos ? 0 : (ssize_t)IOCB_LEN(&req->iocb) < res - pos ? (ssize_t)IOCB_LEN(&req->iocb) : res - pos;
+    memcpy(IOCB_BUF(&req->iocb), b->data + pos, (size_t)req->res);
+    b->used += (size_t)req->res;
+}
+
+/* complete the preads of a finished read-ahead or cache fill, queueing them on the done-list */
+static void
+ioqueue_block_done(ioqueue_t *ioq, struct ioqueue_request *const fill, ssize_t res, int err)
+{
+    struct ioqueue_block *const b = fill->blk;
+    struct ioqueue_request *req;
+
+    b->eof = res >= 0 && (size_t)res < IOCB_LEN(&fill->iocb);
+    ioq->nextra -= b->nwaiters;
+    if (fill->cb != NULL) {
+        /* a cache fill, restore the caller's own read and serve it ahead of the rest */
+        fill->blk = NULL;
+        IOCB_BUF(&fill->iocb) = fill->dst.iov_base;
+        IOCB_LEN(&fill->iocb) = fill->dst.iov_len;
+        IOCB_OFF(&fill->iocb) = fill->dst_off;
+        fill->next = b->waiters;
+        b->waiters = fill;
+        if (b->waiters_tail == NULL) {
+            b->waiters_tail = fill;
+        }
+        b->nwaiters++;
+    }
+    for (req = b->waiters; req != NULL; req = req->next) {
+        req->t_dispatch = fill->t_dispatch;
+        ioqueue_block_copy(b, req, res, err);
+    }
+    if (b->waiters != NULL) {
+        ioqueue_done_push(ioq, b->waiters, b->waiters_tail, b->nwaiters);
+    }
+    b->waiters = b->waiters_tail = NULL;
+    b->nwaiters = 0;
+    b->loading = NULL;
+    /* keep what was read unless a write overlapped it meanwhile, and cache blocks only when whole */
+    b->len = res < 0 || b->stale || (b->stream == NULL && b->eof) ? 0 : (size_t)res;
+    b->stale = 0;
+    if (b->stream == NULL) return;
+
+    if (res < 0) {
+        /* stop reading ahead until the reads are seen to be sequential again */
+        b->stream->seq = 0;
+    }
+    ioq->ninternal--;
+    ioqueue_request_free(ioq, fill);
+    ioqueue_stream_release(ioq, b->stream);
+}
+
+/**
+ * unaligned requests
+ *   Once ioqueue_set_align() is set, a pread or pwrite whose buffer, offset
+ *   or length is not a multiple of `align` is widened to the aligned blocks
+ *   it covers and submitted through a buffer from the pool, and on
+ *   completion a read copies the caller's range out of it.  A pwrite only
+ *   partly covering its first or last block reads the blocks first, merges
+ *   its data in when the read is reaped, and writes them back; blocks read
+ *   past EOF are zero-filled and the file is cut back to its new size once
+ *   written, unless it has grown further meanwhile.  A write waits for the
+ *   earlier outstanding writes it overlaps when either is unaligned, so no
+ *   write lands between the read and the write-back of another.
+ */
+
+/* the latest earlier outstanding write `req` overlaps and must wait for, or NULL */
+static struct ioqueue_request *ioqueue_conflict(ioqueue_t *ioq, const struct ioqueue_request *req)
+{
+    unsigned int i;
+    off_t off;
+    size_t len;
+    struct ioqueue_request *r, *found = NULL;
+    const off_t lo = IOCB_OFF(&req->iocb);
+    const off_t hi = lo + (off_t)ioqueue_request_len(req);
+
+    for (i = 0; i < ioq->nreqs; i++) {
+        r = ioq->slots[i];
+        /* the parts of a split request are covered by the request itself */
+        if (r->handle == -1 || r->harvested || r->parent != NULL || r->seq >= req->seq ||
+                IOCB_FD(&r->iocb) != IOCB_FD(&req->iocb)) {
+            continue;
+        }
+        /* aligned writes need only be ordered against unaligned ones */
+        if (r->rmw == 0 && (req->rmw == 0 ||
+                (IOCB_OP(&r->iocb) != IOCB_CMD_PWRITE && IOCB_OP(&r->iocb) != IOCB_CMD_PWRITEV))) {
+            continue;
+        }
+        off = r->nchunk > 0 ? r->dst_off : IOCB_OFF(&r->iocb);
+        len = r->nchunk > 0 ? r->dst.iov_len : ioqueue_request_len(r);
+        if (off < hi && lo < off + (off_t)len && (found == NULL || r->seq > found->seq)) {
+            found = r;
+        }
     }
+    return found;
+}
+
+/* queue a write for submission, or behind an earlier write it must wait for */
+static void ioqueue_admit(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    struct ioqueue_request *const r = ioqueue_conflict(ioq, req);
+    if (r == NULL) {
+        ioqueue_request_push(ioq, req);
+        return;
+    }
+    req->after = r;
+    req->next = r->deps;
+    r->deps = req;
+}
+
+/* re-admit the writes waiting for a request that has completed */
+static void ioqueue_release(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    struct ioqueue_request *dep, *next;
+    req->harvested = 1;
+    for (dep = req->deps, req->deps = NULL; dep != NULL; dep = next) {
+        next = dep->next;
+        dep->next = NULL;
+        dep->after = NULL;
+        ioqueue_admit(ioq, dep);
+    }
+    ioq->requeued = 1;
+}
+
+/* widen an unaligned pread or pwrite to the blocks it covers, through a buffer from the pool */
+static int ioqueue_bounce(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    const off_t mask = (off_t)ioq->align - 1;
+    const off_t off = IOCB_OFF(&req->iocb);
+    const size_t len = IOCB_LEN(&req->iocb);
+    const off_t lo = off & ~mask;
+    const off_t hi = (off + (off_t)len + mask) & ~mask;
+    void *const bounce = ioqueue_pool_alloc(&ioq->pool, (size_t)(hi - lo));
+
+    if (bounce == NULL) return -1;
+    req->bounce = bounce;
+    req->eof = -1;
+    req->dst.iov_base = IOCB_BUF(&req->iocb);
+    req->dst.iov_len = len;
+    req->dst_off = off;
+    IOCB_BUF(&req->iocb) = bounce;
+    IOCB_LEN(&req->iocb) = (size_t)(hi - lo);
+    IOCB_OFF(&req->iocb) = lo;
+    if (IOCB_OP(&req->iocb) == IOCB_CMD_PWRITE) {
+        if (lo == off && hi == off + (off_t)len) {
+            /* only the buffer is unaligned */
+            memcpy(bounce, req->dst.iov_base, len);
+        } else {
+            /* read the blocks first, see ioqueue_rmw_write() */
+            IOCB_OP(&req->iocb) = IOCB_CMD_PREAD;
+            req->rmw = 1;
+            ioq->nrmw++;
+        }
+    }
+    ioq->stats.bounced++;
     return 0;
 }
 
-/* submit as many requests as possible from the front of the queue */
-static int ioqueue_submit(unsigned int *nerr)
+/* merge an unaligned write into the `res` bytes read of its blocks and queue them to be written back */
+static void ioqueue_rmw_write(ioqueue_t *ioq, struct ioqueue_request *req, ssize_t res)
 {
-    unsigned int i, n;
-    int ret;
-    for (i = 0, n = 0; i < _nwait;) {
-        ret = io_submit(_ctx, _nwait - i, _io_reqs + i);
-        if (ret < 0) {
-            if (-ret == EBADF) {
-                /* head of the queue is bad, finish the request and continue */
-                ioqueue_request_finish(IOCB_DATA(_io_reqs[i]), -1, EBADF);
-                i ++;
-            } else {
-                /* ensure wait-queue occupies the head of the array */
-                memmove(_io_reqs, _io_reqs + i, (size_t)(_nwait - i));
-                _nwait -= i;
-                errno = -ret;
-                return -1;
+    char *const bounce = req->bounce;
+    const size_t span = IOCB_LEN(&req->iocb);
+
+    if ((size_t)res < span) {
+        /* the blocks run past EOF */
+        memset(bounce + res, 0, span - (size_t)res);
+        req->eof = IOCB_OFF(&req->iocb) + res;
+    }
+    memcpy(bounce + (req->dst_off - IOCB_OFF(&req->iocb)), req->dst.iov_base, req->dst.iov_len);
+    IOCB_OP(&req->iocb) = IOCB_CMD_PWRITE;
+    req->rmw = 2;
+    ioqueue_request_push(ioq, req);
+    ioq->requeued = 1;
+}
+
+/* restore the caller's own request from a bounced one that returned `res`, returning its result */
+static ssize_t ioqueue_bounce_done(ioqueue_t *ioq, struct ioqueue_request *req, ssize_t res, int *err)
+{
+    struct stat st;
+    off_t end;
+    const off_t lo = IOCB_OFF(&req->iocb);
+    const off_t pos = req->dst_off - lo;
+    const ssize_t len = (ssize_t)req->dst.iov_len;
+
+    if (res >= 0) {
+        /* as for a fused read, a short read ends at EOF */
+        res = res <= pos ? 0 : len < res - pos ? len : res - pos;
+        if (req->rmw == 0 && IOCB_OP(&req->iocb) == IOCB_CMD_PREAD) {
+            memcpy(req->dst.iov_base, (char *)req->bounce + pos, (size_t)res);
+        } else if (req->rmw == 2 && req->eof >= 0) {
+            /* the zero-fill past EOF was written too, cut the file back unless it has grown since */
+            end = req->dst_off + len > req->eof ? req->dst_off + len : req->eof;
+            if (fstat(IOCB_FD(&req->iocb), &st) == -1 ||
+                (st.st_size == lo + (off_t)IOCB_LEN(&req->iocb) && ftruncate(IOCB_FD(&req->iocb), end) == -1)) {
+                res = -1;
+                *err = errno;
             }
-        } else {
-            /* count the submitted requests (excludes EBADF above) */
-            n += (unsigned int)ret;
-            i += (unsigned int)ret;
         }
     }
-    _nwait -= i;
-    if (nerr) {
-        *nerr = (i - n);
+    if (req->rmw != 0) {
+        IOCB_OP(&req->iocb) = IOCB_CMD_PWRITE;
+        ioq->nrmw--;
+        req->rmw = 0;
     }
-    return (int)n; // n <= _nwait <= INT_MAX
+    IOCB_BUF(&req->iocb) = req->dst.iov_base;
+    IOCB_LEN(&req->iocb) = req->dst.iov_len;
+    IOCB_OFF(&req->iocb) = req->dst_off;
+    ioqueue_pool_free(&ioq->pool, req->bounce);
+    req->bounce = NULL;
+    return res;
 }
 
-/* fetch and process any completed requests */
-int ioqueue_reap(unsigned int min)
+/* the bytes the caller asked for, however its iocb has been widened, split or aimed at a cache block */
+static size_t ioqueue_request_asked(const struct ioqueue_request *req)
 {
-    int ret, i;
-    unsigned int nerr;
+    /* only pread and pwrite take options, so the length is in bytes */
+    return req->bounce != NULL || req->nchunk > 0 || req->cached ? req->dst.iov_len : IOCB_LEN(&req->iocb);
+}
 
-    /* cannot wait for more requests than have been allocated */
-    if (_nfree == _nreqs || min > _nreqs || (unsigned int)min > _nreqs - _nfree) {
-        errno = EINVAL;
-        return -1;
+/**
+ * request splitting
+ *   Once ioqueue_set_split() is set, a pread or pwrite longer than
+ *   `split_max` is read or written in parts of that length, side by side.
+ *   The request's own iocb carries the first part, and the others take
+ *   free slots while the queue is less than half full.  As a part
+ *   completes, its iocb is aimed at the next part not yet started and
+ *   queued again behind the requests waiting meanwhile, so a long request
+ *   never holds more than half the queue and never holds up those after
+ *   it for longer than one part.  Once every part is done the request
+ *   completes with the bytes up to the first short part, or fails with
+ *   the first error.
+ */
+
+/* aim a part of a split request at the next part of it not yet started */
+static void ioqueue_split_next(struct ioqueue_request *req, struct ioqueue_request *part)
+{
+    const size_t left = req->dst.iov_len - req->split_next;
+    const size_t len = left < req->split ? left : req->split;
+    IOCB_BUF(&part->iocb) = (char *)req->dst.iov_base + req->split_next;
+    IOCB_LEN(&part->iocb) = len;
+    IOCB_OFF(&part->iocb) = req->dst_off + (off_t)req->split_next;
+    req->split_next += len;
+}
+
+/* split a long pread or pwrite into parts submitted side by side */
+static void ioqueue_split(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    size_t i;
+    struct ioqueue_request *part;
+    const size_t len = IOCB_LEN(&req->iocb);
+
+    req->dst.iov_base = IOCB_BUF(&req->iocb);
+    req->dst.iov_len = len;
+    req->dst_off = IOCB_OFF(&req->iocb);
+    req->split = ioq->split_max;
+    req->split_next = 0;
+    req->nchunk = 1;
+    req->res = (ssize_t)len;
+    req->err = 0;
+    ioqueue_split_next(req, req);
+    for (i = 1; i < (len - 1) / req->split + 1; i++) {
+        /* the rest are read by these parts in turn as they complete */
+        if (ioq->nreqs - ioq->nfree >= ioq->limit / 2) break;
+        part = ioqueue_request_alloc(ioq, 1);
+        if (part == NULL) break;
+        IOCB_OP(&part->iocb) = IOCB_OP(&req->iocb);
+        IOCB_FD(&part->iocb) = IOCB_FD(&req->iocb);
+        IOCB_FLAGS(&part->iocb) = IOCB_FLAGS(&req->iocb);
+        IOCB_PRIO(&part->iocb) = IOCB_PRIO(&req->iocb);
+        IOCB_RESFD(&part->iocb) = IOCB_RESFD(&req->iocb);
+        part->parent = req;
+        ioq->ninternal++;
+        req->nchunk++;
+        ioqueue_split_next(req, part);
     }
+    ioq->stats.split++;
+}
 
-    /* ensure the requests have been submitted */
-    ret = ioqueue_submit(&nerr);
-    if (ret == -1) return ret;
+/* account a part of a split request that returned `res`, starting the next part in its place,
+ * and return the request once all of it is done, or NULL */
+static struct ioqueue_request *ioqueue_split_done(ioqueue_t *ioq, struct ioqueue_request *part, ssize_t res, int err)
+{
+    struct ioqueue_request *const req = part->parent != NULL ? part->parent : part;
+    const size_t pos = (size_t)(IOCB_OFF(&part->iocb) - req->dst_off);
 
-    /* re-adjust minimum to account for EBADF-finished requests */
-    if (nerr > 0) {
-        min -= nerr;
+    if (res < 0) {
+        if (req->err == 0) {
+            req->err = err;
+        }
+    } else if ((size_t)res < IOCB_LEN(&part->iocb) && pos + (size_t)res < (size_t)req->res) {
+        /* as for a fused read, a short part ends at EOF */
+        req->res = (ssize_t)(pos + (size_t)res);
+    }
+    if (req->err == 0 && req->split_next < (size_t)req->res) {
+        ioqueue_split_next(req, part);
+        ioqueue_request_push(ioq, part);
+        ioq->requeued = 1;
+        return NULL;
+    }
+    if (part != req) {
+        ioq->ninternal--;
+        ioqueue_request_free(ioq, part);
     }
+    if (--req->nchunk > 0) return NULL;
+    /* restore the caller's own request */
+    IOCB_BUF(&req->iocb) = req->dst.iov_base;
+    IOCB_LEN(&req->iocb) = req->dst.iov_len;
+    IOCB_OFF(&req->iocb) = req->dst_off;
+    if (req->err != 0) {
+        req->res = -1;
+    }
+    return req;
+}
 
-    /* block for at least 'min' completion events */
-    do {
-        ret = io_getevents(_ctx, min, _depth, _io_evs, NULL);
-    } while (ret < 0 && errno == EINTR);
-    if (ret < 0) {
-        return ret;
+/* free a read of a hedged pread that lost the race, or failed with the other still running */
+static void ioqueue_hedge_discard(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    ioqueue_pool_free(&ioq->pool, req->bounce);
+    req->bounce = NULL;
+    ioq->ninternal--;
+    ioqueue_request_free(ioq, req);
+}
+
+/* hand the caller's pread over from one read of a hedged pread to the other */
+static void ioqueue_hedge_transfer(struct ioqueue_request *from, struct ioqueue_request *to)
+{
+    to->cb = from->cb;
+    to->cb_data = from->cb_data;
+    to->t_submit = from->t_submit;
+    to->t_dispatch = from->t_dispatch;
+    from->cb = NULL;
+}
+
+/* stop the read that lost a hedged pread's race, or leave it to be discarded once it completes */
+static void ioqueue_hedge_stop(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    unsigned int i;
+    struct io_event ev;
+    for (i = 0; i < ioq->nwait; i++) {
+        if (ioq->io_reqs[i] != &req->iocb) continue;
+        /* the wait-queue may be being walked by ioqueue_flush() */
+        if (ioq->flushing) return;
+        memmove(ioq->io_reqs + i, ioq->io_reqs + i + 1, (size_t)(ioq->nwait - i - 1) * sizeof(struct iocb *));
+        ioq->nwait--;
+        ioqueue_hedge_discard(ioq, req);
+        return;
+    }
+    if (io_cancel(ioq->ctx, &req->iocb, &ev) == 0) {
+        ioq->ninflight--;
+        ioqueue_hedge_discard(ioq, req);
     }
+}
+
+/* settle a read of a hedged pread that returned `res`, returning the request that completes
+ * the caller's pread, or NULL */
+static struct ioqueue_request *ioqueue_hedge_done(ioqueue_t *ioq, struct ioqueue_request *req, ssize_t res)
+{
+    struct ioqueue_request *const other = req->hedge;
 
-    /* finish the reaped requests */
-    for (i = 0; i < ret; i++) {
-        ioqueue_request_finish(IOEV_DATA(&_io_evs[i]), _io_evs[i].res, (int)_io_evs[i].res2);
+    if (req->cb == NULL && other == NULL) {
+        /* the other read already completed the pread */
+        ioqueue_hedge_discard(ioq, req);
+        return NULL;
     }
-    /* return the number of completed requests */
-    return ret + (int)nerr;
+    if (res < 0 && other == NULL && req->hedge_fd != -1) {
+        /* fail over to the replica at once rather than waiting */
+        IOCB_FD(&req->iocb) = req->hedge_fd;
+        req->hedge_fd = -1;
+        ioq->nhedge--;
+        ioq->stats.hedged++;
+        ioqueue_request_push(ioq, req);
+        ioq->requeued = 1;
+        return NULL;
+    }
+    if (req->hedge_fd != -1) {
+        /* done before its backup read was due */
+        req->hedge_fd = -1;
+        ioq->nhedge--;
+    }
+    if (other != NULL) {
+        req->hedge = other->hedge = NULL;
+        if (res < 0) {
+            /* the other read may yet succeed */
+            if (req->cb != NULL) {
+                ioqueue_hedge_transfer(req, other);
+            }
+            ioqueue_hedge_discard(ioq, req);
+            return NULL;
+        }
+        if (req->cb == NULL) {
+            ioqueue_hedge_transfer(other, req);
+        }
+        ioqueue_hedge_stop(ioq, other);
+    }
+    if (req->t_dispatch != 0) {
+        ioqueue_hist_record(&ioq->hedge_hist, ioqueue_now() - req->t_dispatch);
+        if (ioq->hedge_hist.count >= IOQUEUE_HEDGE_WINDOW) {
+            ioqueue_hist_decay(&ioq->hedge_hist);
+        }
+    }
+    return req;
 }
 
-void ioqueue_destroy()
+/* send the backup reads of hedged preads in flight for longer than their delay, returning when
+ * the next is due, or INT64_MAX */
+static int64_t ioqueue_hedge_fire(ioqueue_t *ioq)
 {
-    while (_nfree != _nreqs) {
-        /* assume latency matters -- block for requests one at a time */
-        ioqueue_reap(1);
-    }
-    free(_io_evs);
-    while (_nfree > 0) {
-        free(IOCB_DATA(_io_reqs[_depth - _nfree]));
-        _io_reqs[_depth - _nfree] = 0;
-        _nfree--;
-        _nreqs--;
-    }
-    free(_io_reqs);
-    io_destroy(_ctx);
-    _ctx = 0;
+    unsigned int i;
+    int64_t due, next = INT64_MAX;
+    void *bounce;
+    struct ioqueue_request *req, *backup;
+    const int64_t now = ioqueue_now();
+
+    for (i = 0; i < ioq->nreqs; i++) {
+        req = ioq->slots[i];
+        if (req->handle == -1 || req->hedge_fd == -1 || req->hedge_delay < 0 || req->t_dispatch == 0) continue;
+        due = req->t_dispatch + req->hedge_delay;
+        if (due > now) {
+            next = due < next ? due : next;
+            continue;
+        }
+        /* a backup read only takes a reserved slot, and is skipped without one */
+        bounce = ioq->ninternal < ioq->depth - ioq->limit ? ioqueue_pool_alloc(&ioq->pool, IOCB_LEN(&req->iocb)) : NULL;
+        backup = bounce != NULL ? ioqueue_request_alloc(ioq, 1) : NULL;
+        if (backup != NULL) {
+            IOCB_OP(&backup->iocb) = IOCB_CMD_PREAD;
+            IOCB_FD(&backup->iocb) = req->hedge_fd;
+            IOCB_BUF(&backup->iocb) = bounce;
+            IOCB_LEN(&backup->iocb) = IOCB_LEN(&req->iocb);
+            IOCB_OFF(&backup->iocb) = IOCB_OFF(&req->iocb);
+            IOCB_FLAGS(&backup->iocb) = IOCB_FLAGS(&req->iocb);
+            IOCB_RESFD(&backup->iocb) = IOCB_RESFD(&req->iocb);
+            backup->bounce = bounce;
+            backup->dst = req->dst;
+            backup->dst_off = req->dst_off;
+            backup->hedged = 1;
+            backup->hedge = req;
+            req->hedge = backup;
+            ioq->ninternal++;
+            ioq->requeued = 1;
+            ioq->stats.hedged++;
+        } else if (bounce != NULL) {
+            ioqueue_pool_free(&ioq->pool, bounce);
+        }
+        req->hedge_fd = -1;
+        ioq->nhedge--;
+    }
+    return next;
+}
+
+/* record and run the callback of a single request completed at time `now` */
+static void
+ioqueue_request_complete(ioqueue_t *ioq, struct ioqueue_request *const req, ssize_t res, int err, int64_t now)
+{
+    enum ioqueue_stats_op op;
+    if (req->bounce != NULL) {
+        res = ioqueue_bounce_done(ioq, req, res, &err);
+    }
+    if (req->deps != NULL) {
+        ioqueue_release(ioq, req);
+    }
+    switch (IOCB_OP(&req->iocb)) {
+    case IOCB_CMD_PREAD:
+    case IOCB_CMD_PREADV:
+        op = IOQUEUE_STATS_READ;
+        break;
+    case IOCB_CMD_PWRITE:
+    case IOCB_CMD_PWRITEV:
+        op = IOQUEUE_STATS_WRITE;
+        break;
+    case IOCB_CMD_FSYNC:
+    case IOCB_CMD_FDSYNC:
+        op = IOQUEUE_STATS_SYNC;
+        break;
+    default:
+        /* unreachable */
+        abort();
+    }
+    ioqueue_stats_complete(&ioq->stats, op, req->t_submit, req->t_dispatch, now);
+    if (op == IOQUEUE_STATS_WRITE && (ioq->nstream > 0 || ioq->cache.nblock > 0)) {
+        ioqueue_invalidate(ioq, req);
+    }
+    if (res < 0) {
+        /* set errno for callback */
+        errno = err;
+    }
+    /* run callback */
+    (* (ioqueue_cb) req->cb)(req->cb_data, res, IOCB_BUF(&req->iocb));
+    /* push free'd request onto tail-stack */
+    ioqueue_request_free(ioq, req);
+}
+
+/* free a gap buffer once it has been replaced and no fused read still reads into it */
+static void ioqueue_pad_free(ioqueue_t *ioq, struct ioqueue_pad *pad)
+{
+    if (pad->refs > 0 || pad == ioq->fuse_pad) return;
+    ioqueue_pool_free(&ioq->pool, pad->data);
+    free(pad);
+}
+
+/* split the result of a fused read between its requests, queueing them on the done-list */
+static void
+ioqueue_request_unfuse(ioqueue_t *ioq, struct ioqueue_request *const lead, ssize_t res, int err)
+{
+    struct ioqueue_request *req;
+    const off_t base = IOCB_OFF(&lead->iocb);
+    off_t pos;
+
+    /* restore the first request's own read */
+    IOCB_OP(&lead->iocb) = IOCB_CMD_PREAD;
+    IOCB_BUF(&lead->iocb) = lead->iov[0].iov_base;
+    IOCB_LEN(&lead->iocb) = lead->iov[0].iov_len;
+    free(lead->iov);
+    lead->iov = NULL;
+    if (lead->pad != NULL) {
+        lead->pad->refs--;
+        ioqueue_pad_free(ioq, lead->pad);
+        lead->pad = NULL;
+    }
+    ioq->nextra -= lead->nfused - 1;
+
+    for (req = lead; req != NULL; req = req->next) {
+        req->fused = 0;
+        req->t_dispatch = lead->t_dispatch;
+        req->err = err;
+        if (res < 0) {
+            req->res = -1;
+        } else {
+            /* a short read ends at EOF, reads beyond it return 0 */
+            pos = IOCB_OFF(&req->iocb) - base;
+            req->res = res <= pos ? 0 : (ssize_t)IOCB_LEN(&req->iocb) < res - pos ? (ssize_t)IOCB_LEN(&req->iocb) : res - pos;
+        }
+    }
+    /* the requests are already linked in offset order */
+    for (req = lead; req->next != NULL; req = req->next) { }
+    ioqueue_done_push(ioq, lead, req, lead->nfused);
+}
+
+/* run the callbacks of at most `max` requests on the done-list */
+static unsigned int
+ioqueue_done_run(ioqueue_t *ioq, unsigned int max, int64_t now)
+{
+    unsigned int n;
+    struct ioqueue_request *req;
+    for (n = 0; n < max && ioq->done_head != NULL; n++) {
+        req = ioq->done_head;
+        ioq->done_head = req->next;
+        if (ioq->done_head == NULL) {
+            ioq->done_tail = NULL;
+        }
+        ioq->ndone--;
+        req->next = NULL;
+        ioqueue_request_complete(ioq, req, req->res, req->err, now);
+    }
+    return n;
+}
+
+/* settle a request that ended outside a reap, queueing the callbacks it completes on the done-list
+ * for the next reap, and returning their count */
+static unsigned int
+ioqueue_request_finish(ioqueue_t *ioq, struct ioqueue_request *req, ssize_t res, int err)
+{
+    const unsigned int ndone = ioq->ndone;
+    if (req->blk != NULL) {
+        /* a read-ahead or cache fill, complete the preads waiting on it */
+        ioqueue_block_done(ioq, req, res, err);
+    } else if (req->iov != NULL) {
+        /* a fused read, complete all of its requests */
+        ioqueue_request_unfuse(ioq, req, res, err);
+    } else {
+        if (req->nchunk > 0 || req->parent != NULL) {
+            /* a part of a split request, complete the request with its last part */
+            req = ioqueue_split_done(ioq, req, res, err);
+            if (req == NULL) return 0;
+            res = req->res;
+            err = req->err;
+        }
+        if (req->hedged) {
+            /* a read of a hedged pread, complete the pread unless the other read may still */
+            req = ioqueue_hedge_done(ioq, req, res);
+            if (req == NULL) return 0;
+        }
+        req->res = res;
+        req->err = err;
+        req->next = NULL;
+        ioqueue_done_push(ioq, req, req, 1);
+    }
+    if (ioq->ndone > ndone && ioq->eventfd != -1) {
+        /* the kernel never signals for these */
+        eventfd_write(ioq->eventfd, 1);
+    }
+    return ioq->ndone - ndone;
+}
+
+/* order reads by file, then offset */
+static int ioqueue_fuse_cmp(const void *a, const void *b)
+{
+    const struct iocb *const x = *(struct iocb *const *)a;
+    const struct iocb *const y = *(struct iocb *const *)b;
+    if (IOCB_FD(x) != IOCB_FD(y)) {
+        return IOCB_FD(x) < IOCB_FD(y) ? -1 : 1;
+    }
+    return IOCB_OFF(x) < IOCB_OFF(y) ? -1 : IOCB_OFF(x) > IOCB_OFF(y);
+}
+
+/**
+ * read fusing
+ *   Runs of preads on the wait-queue against the same file, each starting
+ *   at most `fuse_gap` bytes past the end of the last, are submitted as a
+ *   single preadv of up to `fuse_max` bytes.  The first request's iocb
+ *   carries the fused read, gaps are read into `fuse_pad`, and the rest
+ *   are dropped from the wait-queue and linked behind the first.  Its
+ *   completion is split between the requests by ioqueue_request_unfuse().
+ *   Only the first `nsub` requests, those about to be submitted, are
+ *   fused, and the count that remains of them is returned.
+ */
+static unsigned int ioqueue_fuse(ioqueue_t *ioq, unsigned int nsub)
+{
+    unsigned int i, j, k, n, niov;
+    off_t end, gap;
+    struct iovec *iov;
+    struct iocb **const sorted = ioq->fuse_sort;
+    struct ioqueue_request *lead, *req;
+
+    /* gather the plain reads, but not read-aheads, cache fills, bounced or split reads, and order them by file and offset */
+    for (i = 0, n = 0; i < nsub; i++) {
+        req = IOCB_DATA(ioq->io_reqs[i]);
+        if (IOCB_OP(ioq->io_reqs[i]) == IOCB_CMD_PREAD && req->blk == NULL && req->bounce == NULL &&
+            req->nchunk == 0 && req->parent == NULL) {
+            sorted[n++] = ioq->io_reqs[i];
+        }
+    }
+    if (n < 2) return nsub;
+    qsort(sorted, n, sizeof(sorted[0]), &ioqueue_fuse_cmp);
+
+    for (i = 0; i < n; i = j) {
+        /* extend the run while the next read starts close enough after the last */
+        end = IOCB_OFF(sorted[i]) + (off_t)IOCB_LEN(sorted[i]);
+        niov = 1;
+        for (j = i + 1; j < n; j++) {
+            gap = IOCB_OFF(sorted[j]) - end;
+            if (IOCB_FD(sorted[j]) != IOCB_FD(sorted[i]) || IOCB_PRIO(sorted[j]) != IOCB_PRIO(sorted[i]) ||
+                gap < 0 || (size_t)gap > ioq->fuse_gap ||
+                (size_t)(IOCB_OFF(sorted[j]) - IOCB_OFF(sorted[i])) + IOCB_LEN(sorted[j]) > ioq->fuse_max ||
+                niov + (gap > 0 ? 2u : 1u) > IOV_MAX) {
+                break;
+            }
+            niov += gap > 0 ? 2u : 1u;
+            end = IOCB_OFF(sorted[j]) + (off_t)IOCB_LEN(sorted[j]);
+        }
+        if (j - i < 2) continue;
+        iov = malloc(niov * sizeof(struct iovec));
+        if (iov == NULL) continue;  /* submit them separately */
+
+        lead = IOCB_DATA(sorted[i]);
+        end = IOCB_OFF(sorted[i]);
+        for (k = i, niov = 0; k < j; k++) {
+            req = IOCB_DATA(sorted[k]);
+            gap = IOCB_OFF(sorted[k]) - end;
+            if (gap > 0) {
+                iov[niov].iov_base = ioq->fuse_pad->data;
+                iov[niov++].iov_len = (size_t)gap;
+                if (lead->pad == NULL) {
+                    lead->pad = ioq->fuse_pad;
+                    lead->pad->refs++;
+                }
+            }
+            iov[niov].iov_base = IOCB_BUF(sorted[k]);
+            iov[niov++].iov_len = IOCB_LEN(sorted[k]);
+            end = IOCB_OFF(sorted[k]) + (off_t)IOCB_LEN(sorted[k]);
+            req->fused = 1;
+            req->next = k + 1 < j ? IOCB_DATA(sorted[k + 1]) : NULL;
+        }
+        lead->iov = iov;
+        lead->nfused = j - i;
+        IOCB_OP(&lead->iocb) = IOCB_CMD_PREADV;
+        IOCB_BUF(&lead->iocb) = iov;
+        IOCB_LEN(&lead->iocb) = niov;
+        ioq->nextra += j - i - 1;
+        ioq->stats.fused += j - i - 1;
+    }
+
+    /* drop the requests read by another's iocb, keeping the order of the rest */
+    for (i = 0, k = 0; i < ioq->nwait; i++) {
+        req = IOCB_DATA(ioq->io_reqs[i]);
+        if (!req->fused || req->iov != NULL) {
+            ioq->io_reqs[k++] = ioq->io_reqs[i];
+        }
+    }
+    nsub -= ioq->nwait - k;
+    ioq->nwait = k;
+    return nsub;
+}
+
+/* order waiting requests by deadline, those without one last, then by age */
+static int ioqueue_deadline_cmp(const void *a, const void *b)
+{
+    const struct ioqueue_request *const x = IOCB_DATA(*(struct iocb *const *)a);
+    const struct ioqueue_request *const y = IOCB_DATA(*(struct iocb *const *)b);
+    const int64_t dx = x->deadline ? x->deadline : INT64_MAX;
+    const int64_t dy = y->deadline ? y->deadline : INT64_MAX;
+    if (dx != dy) {
+        return dx < dy ? -1 : 1;
+    }
+    if (x->t_submit != y->t_submit) {
+        return x->t_submit < y->t_submit ? -1 : 1;
+    }
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/**
+ * deadline scheduling
+ *   Waiting requests already past their deadline fail with ETIMEDOUT
+ *   without being submitted, and the rest are submitted earliest deadline
+ *   first.  Returns the number of callbacks run.
+ */
+static unsigned int ioqueue_schedule(ioqueue_t *ioq)
+{
+    unsigned int i, k, n, ndeadline;
+    struct ioqueue_request *req;
+    const int64_t now = ioqueue_now();
+
+    for (i = 0, k = 0, n = 0, ndeadline = 0; i < ioq->nwait; i++) {
+        req = IOCB_DATA(ioq->io_reqs[i]);
+        if (req->deadline != 0 && req->deadline <= now) {
+            ioq->shed[n++] = req;
+            continue;
+        }
+        ndeadline += req->deadline != 0;
+        ioq->io_reqs[k++] = ioq->io_reqs[i];
+    }
+    ioq->nwait = k;
+    if (ndeadline > 0 && k > 1) {
+        qsort(ioq->io_reqs, k, sizeof(struct iocb *), &ioqueue_deadline_cmp);
+    }
+    ioq->edf = ndeadline > 0;
+
+    /* their callbacks run from the next reap */
+    for (i = 0; i < n; i++) {
+        ioq->stats.expired++;
+        ioqueue_request_finish(ioq, ioq->shed[i], -1, ETIMEDOUT);
+    }
+    return n;
+}
+
+/* move the requests over their rate limit behind the rest of the wait-queue, returning the rest */
+static unsigned int ioqueue_throttle(ioqueue_t *ioq)
+{
+    unsigned int i, n, k;
+    int64_t wait;
+    struct ioqueue_request *req;
+    const int64_t now = ioqueue_now();
+
+    ioq->rate_next = INT64_MAX;
+    for (i = 0, n = 0, k = 0; i < ioq->nwait; i++) {
+        /* the parts of a split request go with the request, which is charged for all of them */
+        req = IOCB_DATA(ioq->io_reqs[i]);
+        req = req->parent != NULL ? req->parent : req;
+        wait = req->tag != 0 && !req->charged ? ioqueue_rate_take(&ioq->rate, req->tag, ioqueue_request_asked(req), now) : 0;
+        if (wait == 0) {
+            req->charged = req->tag != 0;
+            ioq->io_reqs[n++] = ioq->io_reqs[i];
+            continue;
+        }
+        if (!req->held) {
+            req->held = 1;
+            ioq->stats.throttled++;
+        }
+        if (now + wait < ioq->rate_next) {
+            ioq->rate_next = now + wait;
+        }
+        ioq->rate_held[k++] = ioq->io_reqs[i];
+    }
+    memcpy(ioq->io_reqs + n, ioq->rate_held, k * sizeof(struct iocb *));
+    return n;
+}
+
+/* submit as many requests as possible from the front of the queue, counting in `nerr` the
+ * callbacks of those that failed at once, which are left on the done-list */
+static int ioqueue_flush(ioqueue_t *ioq, unsigned int *nerr)
+{
+    unsigned int i, j, n, m, nsub;
+    int ret;
+    if (ioq->flushing) {
+        /* a callback is enqueueing more while a flush walks the wait-queue */
+        if (nerr) {
+            *nerr = 0;
+        }
+        return 0;
+    }
+    ioq->flushing = 1;
+    ioq->requeued = 0;
+    m = ioq->edf ? ioqueue_schedule(ioq) : 0;
+    nsub = ioq->nwait;
+    if (ioq->rate.nbucket > 0 && nsub > 0) {
+        nsub = ioqueue_throttle(ioq);
+    }
+    if (ioq->fuse_max > 0 && nsub > 1) {
+        nsub = ioqueue_fuse(ioq, nsub);
+    }
+    for (i = 0, n = 0; i < nsub;) {
+        ret = io_submit(ioq->ctx, nsub - i, ioq->io_reqs + i);
+        if (ret < 0) {
+            if (-ret == EBADF || -ret == EINVAL || -ret == EPERM) {
+                /* head of the queue is bad, e.g. a priority needing privileges, finish the request and continue */
+                m += ioqueue_request_finish(ioq, IOCB_DATA(ioq->io_reqs[i]), -1, -ret);
+                i ++;
+            } else {
+                /* ensure wait-queue occupies the head of the array */
+                memmove(ioq->io_reqs, ioq->io_reqs + i, (size_t)(ioq->nwait - i) * sizeof(struct iocb *));
+                ioq->nwait -= i;
+                ioq->flushing = 0;
+                errno = -ret;
+                return -1;
+            }
+        } else {
+            /* stamp and count the submitted requests (excludes errors above) */
+            if (ret > 0) {
+                const int64_t now = ioqueue_now();
+                struct ioqueue_request *req;
+                unsigned int nreq = 0;
+                for (j = i; j < i + (unsigned int)ret; j++) {
+                    req = IOCB_DATA(ioq->io_reqs[j]);
+                    /* a later part of a split request, the write-back of an unaligned write or a failed-over read was counted already */
+                    if (req->t_dispatch != 0) continue;
+                    req->t_dispatch = now;
+                    nreq += ((req->blk != NULL || req->hedged) && req->cb == NULL) || req->parent != NULL ? 0 :
+                            req->iov != NULL ? req->nfused : 1;
+                }
+                ioqueue_stats_batch(&ioq->stats, nreq);
+                ioq->ninflight += (unsigned int)ret;
+                n += nreq;
+            }
+            i += (unsigned int)ret;
+        }
+    }
+    /* the requests held back by a rate limit remain at the head */
+    memmove(ioq->io_reqs, ioq->io_reqs + i, (size_t)(ioq->nwait - i) * sizeof(struct iocb *));
+    ioq->nwait -= i;
+    ioq->flushing = 0;
+    if (nerr) {
+        *nerr = m;
+    }
+    return (int)n; // n <= nwait <= INT_MAX
+}
+
+/* submit the wait-queue early according to the auto-flush policy */
+static void ioqueue_autoflush(ioqueue_t *ioq)
+{
+    if ((ioq->flush_batch > 0 && ioq->nwait >= ioq->flush_batch) ||
+        (ioq->flush_delay > 0 && ioqueue_now() - ioq->wait_since >= ioq->flush_delay)) {
+        /* on failure the requests remain queued, and those failed at once are left on the done-list,
+         * until the next reap */
+        ioqueue_flush(ioq, NULL);
+    }
+}
+
+/* serve a pread from a block, at once when it is loaded or else once its read completes */
+static void ioqueue_block_serve(ioqueue_t *ioq, struct ioqueue_block *b, struct ioqueue_request *req)
+{
+    /* the request never reaches the kernel, and cannot be cancelled */
+    ioq->nwait--;
+    req->cached = 1;
+    req->t_dispatch = req->t_submit;
+    if (b->loading != NULL) {
+        if (b->waiters_tail != NULL) {
+            b->waiters_tail->next = req;
+        } else {
+            b->waiters = req;
+        }
+        b->waiters_tail = req;
+        b->nwaiters++;
+        ioq->nextra++;
+        return;
+    }
+    ioqueue_block_copy(b, req, (ssize_t)b->len, 0);
+    ioqueue_done_push(ioq, req, req, 1);
+    if (ioq->eventfd != -1) {
+        eventfd_write(ioq->eventfd, 1);
+    }
+}
+
+/* the buffer of a stream holding, or loading, all of [off, off + len), or NULL */
+static struct ioqueue_block *ioqueue_stream_block(struct ioqueue_stream *s, off_t off, size_t len)
+{
+    int i;
+    struct ioqueue_block *b;
+    for (i = 0; i < 2; i++) {
+        b = &s->bufs[i];
+        if (!b->stale && b->len > 0 && off >= b->off && off + (off_t)len <= b->off + (off_t)b->len) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/* start reading the next window of a stream at `off` into `b`, unless the queue is busy */
+static void ioqueue_readahead_load(ioqueue_t *ioq, struct ioqueue_stream *s, struct ioqueue_block *b, off_t off)
+{
+    struct ioqueue_request *req;
+    const int wasted = b->len > 0 && b->used < b->len / 2;
+
+    /* read-aheads only take slots from a queue less than half full */
+    if (ioq->nreqs - ioq->nfree >= ioq->limit / 2) return;
+    req = ioqueue_request_alloc(ioq, 1);
+    if (req == NULL) return;
+    if (wasted) {
+        /* most of the last read-ahead into this buffer went unread */
+        s->window = (s->window / 2) & ~(IOQUEUE_RA_ALIGN - 1);
+        if (s->window < s->min) {
+            s->window = s->min;
+        }
+    }
+    IOCB_OP(&req->iocb) = IOCB_CMD_PREAD;
+    IOCB_FD(&req->iocb) = s->fd;
+    IOCB_BUF(&req->iocb) = b->data;
+    IOCB_LEN(&req->iocb) = s->window;
+    IOCB_OFF(&req->iocb) = off;
+    if (ioq->eventfd != -1) {
+        IOCB_FLAGS(&req->iocb) |= IOCB_FLAG_RESFD;
+        IOCB_RESFD(&req->iocb) = ioq->eventfd;
+    }
+    req->blk = b;
+    ioq->ninternal++;
+    b->off = off;
+    b->len = s->window;
+    b->used = 0;
+    b->eof = 0;
+    b->loading = req;
+    if (!wasted) {
+        s->window = s->window * 2 < s->max ? s->window * 2 : s->max;
+    }
+}
+
+/* serve a pread on a read-ahead stream from its buffers where possible, then read ahead of it */
+static void ioqueue_readahead(ioqueue_t *ioq, struct ioqueue_stream *s, struct ioqueue_request *req)
+{
+    const off_t off = IOCB_OFF(&req->iocb);
+    const size_t len = IOCB_LEN(&req->iocb);
+    struct ioqueue_block *b = ioqueue_stream_block(s, off, len);
+    struct ioqueue_block *other;
+
+    if (off == s->next) {
+        if (s->seq < IOQUEUE_RA_SEQ) {
+            s->seq++;
+        }
+    } else if (b == NULL) {
+        /* a read elsewhere in the file starts over */
+        s->seq = 0;
+        s->window = s->min;
+    }
+    s->next = off + (off_t)len;
+
+    if (b != NULL) {
+        ioq->stats.readahead++;
+        ioqueue_block_serve(ioq, b, req);
+    }
+    if (s->seq < IOQUEUE_RA_SEQ) return;
+
+    /* keep the window after the buffer being read loaded, or loading */
+    b = ioqueue_stream_block(s, s->next, 1);
+    if (b == NULL) {
+        b = s->bufs[0].loading == NULL ? &s->bufs[0] : s->bufs[1].loading == NULL ? &s->bufs[1] : NULL;
+        if (b != NULL) {
+            ioqueue_readahead_load(ioq, s, b, s->next & ~(off_t)(IOQUEUE_RA_ALIGN - 1));
+        }
+        return;
+    }
+    other = b == &s->bufs[0] ? &s->bufs[1] : &s->bufs[0];
+    if (b->eof || other->loading != NULL ||
+        (other->len > 0 && !other->stale && other->off == b->off + (off_t)b->len)) {
+        return;
+    }
+    ioqueue_readahead_load(ioq, s, other, b->off + (off_t)b->len);
+}
+
+/* take a cache block for a file's block at `off` by CLOCK, or NULL when every block is being read */
+static struct ioqueue_block *ioqueue_cache_evict(struct ioqueue_cache *c, int fd, off_t off)
+{
+    unsigned int i, *p;
+    struct ioqueue_block *b;
+    for (i = 0; i < 2 * c->nblock; i++) {
+        b = &c->blocks[c->hand];
+        c->hand = c->hand + 1 < c->nblock ? c->hand + 1 : 0;
+        if (b->loading != NULL) continue;
+        if (b->ref) {
+            b->ref = 0;
+            continue;
+        }
+        if (b->fd != -1) {
+            /* unlink it from its old chain */
+            p = &c->hash[ioqueue_cache_hash(c, b->fd, b->off)];
+            while (&c->blocks[*p] != b) {
+                p = &c->blocks[*p].hnext;
+            }
+            *p = b->hnext;
+        }
+        p = &c->hash[ioqueue_cache_hash(c, fd, off)];
+        b->hnext = *p;
+        *p = (unsigned int)(b - c->blocks);
+        b->fd = fd;
+        b->off = off;
+        b->len = 0;
+        return b;
+    }
+    return NULL;
+}
+
+/* serve a pread from the block cache, or have the first to miss a block read all of it */
+static void ioqueue_cache_read(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    struct ioqueue_cache *const c = &ioq->cache;
+    const off_t off = IOCB_OFF(&req->iocb);
+    const off_t base = off & ~(off_t)(c->block - 1);
+    struct ioqueue_block *b;
+
+    if (off < 0 || off + (off_t)IOCB_LEN(&req->iocb) > base + (off_t)c->block) {
+        /* spans blocks, read it as is */
+        return;
+    }
+    b = ioqueue_cache_find(c, IOCB_FD(&req->iocb), base);
+    if (b != NULL && b->stale) {
+        /* the block being read may be older than a write since */
+        return;
+    }
+    if (b != NULL && (b->loading != NULL || b->len > 0)) {
+        b->ref = 1;
+        ioq->stats.cached++;
+        ioqueue_block_serve(ioq, b, req);
+        return;
+    }
+    if (req->deadline != 0) {
+        /* shedding a fill would leave the preads waiting on it stranded */
+        return;
+    }
+    if (b == NULL) {
+        b = ioqueue_cache_evict(c, IOCB_FD(&req->iocb), base);
+        if (b == NULL) return;
+    }
+    req->blk = b;
+    req->cached = 1;
+    req->dst.iov_base = IOCB_BUF(&req->iocb);
+    req->dst.iov_len = IOCB_LEN(&req->iocb);
+    req->dst_off = off;
+    IOCB_BUF(&req->iocb) = b->data;
+    IOCB_LEN(&req->iocb) = c->block;
+    IOCB_OFF(&req->iocb) = base;
+    b->len = c->block;
+    b->used = 0;
+    b->loading = req;
+}
+
+/* enqueue a read or write request, where `len` is the iovec count for vectored ops */
+static int ioqueue_request_rw(ioqueue_t *ioq, unsigned short op, int fd, void *buf, size_t len, off_t offset,
+                              const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_data)
+{
+    int handle;
+    unsigned int i;
+    struct ioqueue_request *req;
+    if (opts != NULL && opts->timeout_us > 0 && ioq->shed == NULL) {
+        ioq->shed = malloc((size_t)ioq->depth * sizeof(struct ioqueue_request *));
+        if (ioq->shed == NULL) return -1;
+    }
+    req = ioqueue_request_alloc(ioq, 0);
+    if (req == NULL) return -1;
+    ioqueue_stats_enqueue(&ioq->stats, ioqueue_outstanding(ioq));
+
+    req->cb = (ioqueue_cb) cb;
+    req->cb_data = cb_data;
+    IOCB_OP(&req->iocb) = op;
+    IOCB_FD(&req->iocb) = fd;
+    IOCB_BUF(&req->iocb) = buf;
+    IOCB_LEN(&req->iocb) = len;
+    IOCB_OFF(&req->iocb) = offset;
+    if (ioq->eventfd != -1) {
+        IOCB_FLAGS(&req->iocb) |= IOCB_FLAG_RESFD;
+        IOCB_RESFD(&req->iocb) = ioq->eventfd;
+    }
+    if (opts != NULL && opts->prio != 0) {
+        IOCB_FLAGS(&req->iocb) |= IOCB_FLAG_IOPRIO;
+        IOCB_PRIO(&req->iocb) = (unsigned short)opts->prio;
+    }
+    if (opts != NULL) {
+        req->tag = opts->tag;
+        if (opts->timeout_us > 0) {
+            req->deadline = req->t_submit + (int64_t)opts->timeout_us * 1000;
+            ioq->edf = 1;
+        }
+    }
+    if ((ioq->nstream > 0 || ioq->cache.nblock > 0) && op == IOCB_CMD_PREAD) {
+        struct ioqueue_stream *const s = ioqueue_stream_find(ioq, fd);
+        if (s != NULL) {
+            ioqueue_readahead(ioq, s, req);
+        } else if (ioq->cache.nblock > 0) {
+            ioqueue_cache_read(ioq, req);
+        }
+    }
+    if (ioq->align > 0 && !req->cached && (op == IOCB_CMD_PREAD || op == IOCB_CMD_PWRITE) && offset >= 0 &&
+        (((uint64_t)(uintptr_t)buf | (uint64_t)offset | (uint64_t)len) & (ioq->align - 1)) != 0) {
+        if (ioqueue_bounce(ioq, req) == -1) {
+            /* a read-ahead it started may be queued behind it */
+            for (i = ioq->nwait - 1; ioq->io_reqs[i] != &req->iocb; i--) {}
+            memmove(ioq->io_reqs + i, ioq->io_reqs + i + 1, (size_t)(ioq->nwait - i - 1) * sizeof(struct iocb *));
+            ioq->nwait--;
+            ioqueue_request_free(ioq, req);
+            return -1;
+        }
+    }
+    if ((ioq->nstream > 0 || ioq->cache.nblock > 0) && (op == IOCB_CMD_PWRITE || op == IOCB_CMD_PWRITEV)) {
+        ioqueue_invalidate(ioq, req);
+    }
+    if (ioq->nrmw > 0 && (op == IOCB_CMD_PWRITE || op == IOCB_CMD_PWRITEV)) {
+        /* wait for earlier overlapping writes, see ioqueue_conflict() */
+        ioq->nwait--;
+        ioqueue_admit(ioq, req);
+    }
+    /* not with a deadline, shedding one part would leave the rest in flight */
+    if (ioq->split_max > 0 && len > ioq->split_max && (op == IOCB_CMD_PREAD || op == IOCB_CMD_PWRITE) &&
+        !req->cached && req->bounce == NULL && req->after == NULL && req->deadline == 0) {
+        ioqueue_split(ioq, req);
+    }
+    /* the request may have completed by the time the flush returns */
+    handle = req->handle;
+    ioqueue_autoflush(ioq);
+    return handle;
+}
+
+/* enqueue a pread request  */
+int ioqueue_ctx_pread(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IOCB_CMD_PREAD, fd, buf, len, offset, NULL, cb, cb_data);
+}
+
+/* enqueue a pwrite request  */
+int ioqueue_ctx_pwrite(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IOCB_CMD_PWRITE, fd, buf, len, offset, NULL, cb, cb_data);
+}
+
+/* enqueue a pread request with options  */
+int ioqueue_ctx_pread_ex(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_data)
+{
+    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL || !ioqueue_opts_valid(opts)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IOCB_CMD_PREAD, fd, buf, len, offset, opts, cb, cb_data);
+}
+
+/* enqueue a pwrite request with options  */
+int ioqueue_ctx_pwrite_ex(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_data)
+{
+    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL || !ioqueue_opts_valid(opts)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IOCB_CMD_PWRITE, fd, buf, len, offset, opts, cb, cb_data);
+}
+
+/* enqueue a pread of data held on each of `fds`, with a backup read of another when the first is slow */
+int ioqueue_ctx_pread_hedged(ioqueue_t *ioq, const int *fds, int nfd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    int handle;
+    unsigned int first;
+    void *bounce;
+    struct ioqueue_request *req;
+    off_t lo = offset, hi = offset + (off_t)len;
+    if (fds == NULL || nfd <= 0 || buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* without ioqueue_set_hedge(), a hedged pread on an idle queue makes room for backup reads */
+    if (ioq->nfree == ioq->nreqs && ioqueue_reserve(ioq) == -1) return -1;
+    if (ioq->align > 0) {
+        /* widen an unaligned read to its blocks, as ioqueue_bounce() does */
+        lo &= ~((off_t)ioq->align - 1);
+        hi = (hi + (off_t)ioq->align - 1) & ~((off_t)ioq->align - 1);
+    }
+    bounce = ioqueue_pool_alloc(&ioq->pool, (size_t)(hi - lo));
+    if (bounce == NULL) return -1;
+    req = ioqueue_request_alloc(ioq, 0);
+    if (req == NULL) {
+        ioqueue_pool_free(&ioq->pool, bounce);
+        return -1;
+    }
+    ioqueue_stats_enqueue(&ioq->stats, ioqueue_outstanding(ioq));
+
+    /* read the replicas in turn, see ioqueue_hedge_done() */
+    first = ioq->hedge_next++ % (unsigned int)nfd;
+    req->cb = (ioqueue_cb) cb;
+    req->cb_data = cb_data;
+    IOCB_OP(&req->iocb) = IOCB_CMD_PREAD;
+    IOCB_FD(&req->iocb) = fds[first];
+    IOCB_BUF(&req->iocb) = bounce;
+    IOCB_LEN(&req->iocb) = (size_t)(hi - lo);
+    IOCB_OFF(&req->iocb) = lo;
+    if (ioq->eventfd != -1) {
+        IOCB_FLAGS(&req->iocb) |= IOCB_FLAG_RESFD;
+        IOCB_RESFD(&req->iocb) = ioq->eventfd;
+    }
+    req->bounce = bounce;
+    req->dst.iov_base = buf;
+    req->dst.iov_len = len;
+    req->dst_off = offset;
+    req->hedged = 1;
+    if (nfd > 1) {
+        req->hedge_fd = fds[(first + 1) % (unsigned int)nfd];
+        req->hedge_delay = -1;
+        ioq->nhedge++;
+    }
+    if (nfd > 1 && ioq->hedge_hist.count >= IOQUEUE_HEDGE_WARMUP) {
+        req->hedge_delay = (int64_t)ioqueue_hist_percentile(&ioq->hedge_hist, ioq->hedge_pct);
+        if (req->hedge_delay < ioq->hedge_min) {
+            req->hedge_delay = ioq->hedge_min;
+        }
+    }
+    handle = req->handle;
+    ioqueue_autoflush(ioq);
+    return handle;
+}
+
+/* enqueue a vectored preadv request  */
+int ioqueue_ctx_preadv(ioqueue_t *ioq, int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    if (iov == NULL || iovcnt <= 0 || iovcnt > IOV_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IOCB_CMD_PREADV, fd, (void *)iov, (size_t)iovcnt, offset, NULL, cb, cb_data);
+}
+
+/* enqueue a vectored pwritev request  */
+int ioqueue_ctx_pwritev(ioqueue_t *ioq, int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    if (iov == NULL || iovcnt <= 0 || iovcnt > IOV_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IOCB_CMD_PWRITEV, fd, (void *)iov, (size_t)iovcnt, offset, NULL, cb, cb_data);
+}
+
+/* enqueue an fsync request  */
+int ioqueue_ctx_fsync(ioqueue_t *ioq, int fd, ioqueue_cb cb, void *cb_data)
+{
+    if (cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IOCB_CMD_FSYNC, fd, NULL, 0, 0, NULL, cb, cb_data);
+}
+
+/* enqueue an fdatasync request  */
+int ioqueue_ctx_fdatasync(ioqueue_t *ioq, int fd, ioqueue_cb cb, void *cb_data)
+{
+    if (cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IOCB_CMD_FDSYNC, fd, NULL, 0, 0, NULL, cb, cb_data);
+}
+
+/* cancel an outstanding request, its callback runs with ECANCELED */
+int ioqueue_ctx_cancel(ioqueue_t *ioq, int handle)
+{
+    unsigned int i;
+    int ret;
+    struct io_event ev;
+    struct ioqueue_request *req, **p;
+
+    /* resolve the handle to an outstanding request */
+    if (handle < 0 || (unsigned int)handle % ioq->depth >= ioq->nreqs) {
+        errno = EINVAL;
+        return -1;
+    }
+    req = ioq->slots[(unsigned int)handle % ioq->depth];
+    if (req->handle != handle) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (req->fused) {
+        /* the fused read is shared with other requests */
+        errno = EALREADY;
+        return -1;
+    }
+    if (req->cached) {
+        /* the request is served from memory, or its block read is shared with other requests */
+        errno = EALREADY;
+        return -1;
+    }
+    if (req->nchunk > 0 || req->hedged) {
+        /* the parts of a split request, or the reads of a hedged pread, are under way together */
+        errno = EALREADY;
+        return -1;
+    }
+    if (req->after != NULL) {
+        /* unlink the write from the one it waits for */
+        for (p = &req->after->deps; *p != req; p = &(*p)->next) { }
+        *p = req->next;
+        req->next = NULL;
+        req->after = NULL;
+        ioqueue_request_complete(ioq, req, -1, ECANCELED, ioqueue_now());
+        return 0;
+    }
+    /* drop the request from the wait-queue if not yet submitted */
+    for (i = 0; i < ioq->nwait; i++) {
+        if (ioq->io_reqs[i] != &req->iocb) continue;
+        if (ioq->flushing) {
+            /* the wait-queue is being walked by ioqueue_flush() */
+            errno = EBUSY;
+            return -1;
+        }
+        memmove(ioq->io_reqs + i, ioq->io_reqs + i + 1, (size_t)(ioq->nwait - i - 1) * sizeof(struct iocb *));
+        ioq->nwait--;
+        ioqueue_request_complete(ioq, req, -1, ECANCELED, ioqueue_now());
+        return 0;
+    }
+    if (req->rmw != 0) {
+        /* part of the write may already be in the blocks being read */
+        errno = EALREADY;
+        return -1;
+    }
+    /* otherwise ask the kernel to cancel it in flight */
+    ret = io_cancel(ioq->ctx, &req->iocb, &ev);
+    if (ret == 0) {
+        ioq->ninflight--;
+        ioqueue_request_complete(ioq, req, ev.res < 0 ? -1 : (ssize_t)ev.res, (int)-ev.res, ioqueue_now());
+        return 0;
+    } else if (ret == -EINPROGRESS) {
+        /* the cancelled event is delivered to a later reap */
+        return 0;
+    }
+    /* the request cannot be cancelled and will complete normally */
+    errno = EALREADY;
+    return -1;
+}
+
+/* submit queued requests without waiting for completions */
+int ioqueue_ctx_submit(ioqueue_t *ioq)
+{
+    return ioqueue_flush(ioq, NULL);
+}
+
+/* submit automatically once `batch` requests wait or the oldest has waited `usec` microseconds */
+int ioqueue_ctx_set_autoflush(ioqueue_t *ioq, unsigned int batch, unsigned int usec)
+{
+    ioq->flush_batch = batch;
+    ioq->flush_delay = (int64_t)usec * 1000;
+    ioq->wait_since = ioqueue_now();
+    return 0;
+}
+
+/* fuse neighbouring reads of up to `max` bytes in total and at most `gap` bytes apart before submission */
+int ioqueue_ctx_set_coalesce(ioqueue_t *ioq, size_t gap, size_t max)
+{
+    struct ioqueue_pad *pad = NULL, *old = ioq->fuse_pad;
+    if (max > SSIZE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (max > 0 && ioq->fuse_sort == NULL) {
+        ioq->fuse_sort = malloc((size_t)ioq->depth * sizeof(struct iocb *));
+        if (ioq->fuse_sort == NULL) return -1;
+    }
+    if (max > 0 && gap > 0) {
+        /* the gaps are read into, and discarded from, a single scratch buffer */
+        pad = malloc(sizeof(struct ioqueue_pad));
+        if (pad == NULL) return -1;
+        pad->data = ioqueue_pool_alloc(&ioq->pool, gap);
+        if (pad->data == NULL) {
+            free(pad);
+            return -1;
+        }
+        pad->refs = 0;
+    }
+    /* the old buffer goes now, or else once the fused reads in flight that hold it complete */
+    ioq->fuse_pad = pad;
+    if (old != NULL) {
+        ioqueue_pad_free(ioq, old);
+    }
+    ioq->fuse_gap = max > 0 ? gap : 0;
+    ioq->fuse_max = max;
+    return 0;
+}
+
+/* limit the requests tagged `tag` to `bytes` bytes and `ops` requests per second */
+int ioqueue_ctx_set_ratelimit(ioqueue_t *ioq, unsigned int tag, uint64_t bytes, uint64_t ops)
+{
+    if (tag == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ioq->rate_held == NULL) {
+        ioq->rate_held = malloc((size_t)ioq->depth * sizeof(struct iocb *));
+        if (ioq->rate_held == NULL) return -1;
+    }
+    return ioqueue_rate_set(&ioq->rate, tag, bytes, ops);
+}
+
+/* read ahead of sequential preads on `fd` by up to `max` bytes, see ioqueue_readahead() */
+int ioqueue_ctx_set_readahead(ioqueue_t *ioq, int fd, size_t max)
+{
+    int i;
+    struct ioqueue_stream *s = NULL, *old, **streams;
+    if (fd < 0 || max > SSIZE_MAX - IOQUEUE_RA_ALIGN) {
+        errno = EINVAL;
+        return -1;
+    }
+    max = (max + IOQUEUE_RA_ALIGN - 1) & ~(IOQUEUE_RA_ALIGN - 1);
+    if (max > 0) {
+        if (ioqueue_reserve(ioq) == -1) return -1;
+        if (ioq->nstream == ioq->maxstream) {
+            streams = realloc(ioq->streams, (ioq->maxstream + 4) * sizeof(struct ioqueue_stream *));
+            if (streams == NULL) return -1;
+            ioq->streams = streams;
+            ioq->maxstream += 4;
+        }
+        s = calloc(1, sizeof(struct ioqueue_stream));
+        if (s == NULL) return -1;
+        for (i = 0; i < 2; i++) {
+            s->bufs[i].stream = s;
+            s->bufs[i].data = ioqueue_pool_alloc(&ioq->pool, max);
+            if (s->bufs[i].data == NULL) {
+                if (i > 0) {
+                    ioqueue_pool_free(&ioq->pool, s->bufs[0].data);
+                }
+                free(s);
+                return -1;
+            }
+        }
+        s->max = max;
+        s->min = IOQUEUE_RA_MIN < max ? IOQUEUE_RA_MIN : max;
+        s->window = s->min;
+        s->next = -1;
+    }
+    /* a stream with a read-ahead in flight is freed once it completes */
+    old = ioqueue_stream_find(ioq, fd);
+    if (old != NULL) {
+        old->fd = -1;
+        ioqueue_stream_release(ioq, old);
+    }
+    if (s != NULL) {
+        s->fd = fd;
+        ioq->streams[ioq->nstream++] = s;
+    }
+    return 0;
+}
+
+/* release the block cache, which must have no fills in flight */
+static void ioqueue_cache_free(ioqueue_t *ioq)
+{
+    if (ioq->cache.nblock > 0) {
+        ioqueue_pool_free(&ioq->pool, ioq->cache.data);
+    }
+    free(ioq->cache.blocks);
+    free(ioq->cache.hash);
+    memset(&ioq->cache, 0, sizeof(ioq->cache));
+}
+
+/* cache preads within blocks of `block` bytes in up to `size` bytes, see ioqueue_cache_read() */
+int ioqueue_ctx_set_cache(ioqueue_t *ioq, size_t block, size_t size)
+{
+    unsigned int i;
+    struct ioqueue_cache c;
+    if (size > 0 && (block < 512 || block > SSIZE_MAX || (block & (block - 1)) != 0 ||
+                     size < block || size / block > (1u << 30))) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; i < ioq->cache.nblock; i++) {
+        if (ioq->cache.blocks[i].loading != NULL) {
+            /* preads are waiting on the block */
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    memset(&c, 0, sizeof(c));
+    if (size > 0) {
+        c.nblock = (unsigned int)(size / block);
+        c.block = block;
+        for (c.mask = 1; c.mask < c.nblock; c.mask <<= 1) { }
+        c.blocks = calloc(c.nblock, sizeof(struct ioqueue_block));
+        c.hash = malloc(c.mask * sizeof(unsigned int));
+        c.data = c.blocks != NULL && c.hash != NULL ? ioqueue_pool_alloc(&ioq->pool, c.nblock * block) : NULL;
+        if (c.data == NULL) {
+            free(c.blocks);
+            free(c.hash);
+            return -1;
+        }
+        memset(c.hash, 0xff, c.mask * sizeof(unsigned int));
+        c.mask--;
+        for (i = 0; i < c.nblock; i++) {
+            c.blocks[i].fd = -1;
+            c.blocks[i].data = c.data + (size_t)i * block;
+        }
+    }
+    ioqueue_cache_free(ioq);
+    ioq->cache = c;
+    return 0;
+}
+
+/* bounce preads and pwrites not aligned to `align` through aligned buffers, see ioqueue_bounce() */
+int ioqueue_ctx_set_align(ioqueue_t *ioq, size_t align)
+{
+    if (align > 0 && (align < 512 || align > 4096 || (align & (align - 1)) != 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* requests already bounced complete as they were enqueued */
+    ioq->align = align;
+    return 0;
+}
+
+/* split preads and pwrites longer than `max` bytes into parts submitted side by side, see ioqueue_split() */
+int ioqueue_ctx_set_split(ioqueue_t *ioq, size_t max)
+{
+    if (max > SSIZE_MAX || max % 4096 != 0) {
+        /* parts of a direct I/O request must stay aligned */
+        errno = EINVAL;
+        return -1;
+    }
+    if (max > 0 && ioqueue_reserve(ioq) == -1) return -1;
+    /* requests already split keep their parts */
+    ioq->split_max = max;
+    return 0;
+}
+
+/* send a hedged pread's backup read once it has taken longer than `pct` percent of recent ones, and `min_us` */
+int ioqueue_ctx_set_hedge(ioqueue_t *ioq, double pct, unsigned int min_us)
+{
+    if (!(pct > 0 && pct <= 100)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ioqueue_reserve(ioq) == -1) return -1;
+    ioq->hedge_pct = pct;
+    ioq->hedge_min = (int64_t)min_us * 1000;
+    return 0;
+}
+
+/* consume at most `max` completion events directly from the user-space ring */
+static unsigned int ioqueue_ring_reap(ioqueue_t *ioq, struct io_event *evs, unsigned int max)
+{
+    unsigned int n, head, tail;
+    struct aio_ring *const ring = ioq->ring;
+
+    if (ring == NULL) {
+        return 0;
+    }
+    head = ring->head;
+    tail = RING_LOAD(&ring->tail);
+    for (n = 0; n < max && head != tail; n++) {
+        evs[n] = ring->io_events[head];
+        head = (head + 1) % ring->nr;
+    }
+    if (n > 0) {
+        /* release the slots back to the kernel */
+        RING_STORE(&ring->head, head);
+    }
+    return n;
+}
+
+/* the number of requests completed by `n` events */
+static unsigned int ioqueue_events_count(const struct io_event *evs, unsigned int n)
+{
+    unsigned int i, count;
+    const struct ioqueue_request *req;
+    for (i = 0, count = 0; i < n; i++) {
+        req = IOEV_DATA(&evs[i]);
+        count += req->blk != NULL ? req->blk->nwaiters + (req->cb != NULL) : req->iov != NULL ? req->nfused : 1;
+    }
+    return count;
+}
+
+/* account for `n` reaped events, moving unaligned writes that have read their blocks on to writing them back, returning the events left */
+static unsigned int ioqueue_events_advance(ioqueue_t *ioq, struct io_event *evs, unsigned int n)
+{
+    unsigned int i, k;
+    struct ioqueue_request *req;
+    ioq->ninflight -= n;
+    for (i = 0, k = 0; i < n; i++) {
+        req = IOEV_DATA(&evs[i]);
+        if (req->nchunk > 0 || req->parent != NULL) {
+            /* stands for the split request once its last part is done */
+            req = ioqueue_split_done(ioq, req, evs[i].res < 0 ? -1 : (ssize_t)evs[i].res, (int)-evs[i].res);
+            if (req == NULL) continue;
+            IOEV_DATA(&evs[i]) = req;
+            evs[i].res = req->res < 0 ? -req->err : req->res;
+        }
+        if (req->hedged) {
+            /* stands for the hedged pread when it wins the race */
+            req = ioqueue_hedge_done(ioq, req, evs[i].res < 0 ? -1 : (ssize_t)evs[i].res);
+            if (req == NULL) continue;
+        }
+        if (req->rmw == 1 && evs[i].res >= 0) {
+            ioqueue_rmw_write(ioq, req, (ssize_t)evs[i].res);
+            continue;
+        }
+        /* the writes waiting for it may go before its callback runs */
+        if (req->deps != NULL) {
+            ioqueue_release(ioq, req);
+        }
+        req->harvested = 1;
+        evs[k++] = evs[i];
+    }
+    return k;
+}
+
+/* submit requests, then fetch and process between `min` and `max` completed requests */
+static int ioqueue_reap_wait(ioqueue_t *ioq, unsigned int min, unsigned int max, const struct timespec *timeout)
+{
+    int ret, i;
+    unsigned int n, nev, err, want, ran, got;
+    ssize_t res;
+    int throttled, hedging;
+    int64_t deadline = 0, spin, now, wait, hold, hedge;
+    struct timespec left;
+    struct ioqueue_request *req;
+    const int expired = ioqueue_timeout_zero(timeout);
+
+    if (ioq->nhedge > 0) {
+        /* queue the backup reads already due */
+        ioqueue_hedge_fire(ioq);
+    }
+    /* ensure the requests have been submitted, any that fail at once are left on the done-list */
+    ret = ioqueue_flush(ioq, NULL);
+    if (ret == -1) return ret;
+
+    if (max > ioq->depth) {
+        max = ioq->depth;
+    }
+    if (ioq->nfree == ioq->nreqs) {
+        return 0;
+    }
+    if (timeout != NULL && !expired) {
+        deadline = ioqueue_deadline(timeout);
+    }
+
+    /* requests of fused reads left over by an earlier reap come first */
+    n = ioq->ndone < max ? ioq->ndone : max;
+
+    /* harvest what has already completed without a syscall */
+    nev = n < max ? ioqueue_ring_reap(ioq, ioq->io_evs, max - n) : 0;
+    nev = ioqueue_events_advance(ioq, ioq->io_evs, nev);
+    n += ioqueue_events_count(ioq->io_evs, nev);
+
+    /* optionally spin on the ring before blocking in the kernel */
+    if (n < min && ioq->ring != NULL && ioq->busypoll > 0 && !expired) {
+        spin = ioqueue_now() + ioq->busypoll;
+        if (timeout != NULL && deadline < spin) {
+            spin = deadline;
+        }
+        do {
+            ioqueue_cpu_relax();
+            got = ioqueue_ring_reap(ioq, ioq->io_evs + nev, max - n);
+            got = ioqueue_events_advance(ioq, ioq->io_evs + nev, got);
+            n += ioqueue_events_count(ioq->io_evs + nev, got);
+            nev += got;
+        } while (n < min && !ioq->requeued && ioqueue_now() < spin);
+    }
+
+    /* block for the remaining 'min' completion events */
+    if (n < min || (ioq->ring == NULL && n < max)) {
+        for (;;) {
+            hedge = ioq->nhedge > 0 ? ioqueue_hedge_fire(ioq) : INT64_MAX;
+            if (ioq->requeued) {
+                /* submit the writes moved on by the events reaped so far, counting any failed at once */
+                if (ioqueue_flush(ioq, &err) == -1) {
+                    ret = -errno;
+                    break;
+                }
+                n = n + err < max ? n + err : max;
+                if (n >= max) break;
+            }
+            /* a fused read or read-ahead in flight completes several requests with one event */
+            want = n < min ? min - n : 0;
+            want = want > ioq->nextra ? want - ioq->nextra : want > 0;
+            if (want > ioq->ninflight && ioq->ninflight > 0) {
+                /* writes waiting for those in flight are only submitted once they are reaped */
+                want = ioq->ninflight;
+            }
+            wait = timeout == NULL ? -1 : expired ? 0 : ioqueue_remaining(deadline);
+            throttled = 0;
+            hedging = 0;
+            if (ioq->nwait > 0 && n < min) {
+                /* wake up to submit the requests held back by a rate limit */
+                hold = ioqueue_remaining(ioq->rate_next);
+                if (wait < 0 || hold < wait) {
+                    wait = hold;
+                    throttled = 1;
+                }
+            }
+            if (hedge != INT64_MAX && n < min) {
+                /* or to send the next backup read */
+                hold = ioqueue_remaining(hedge);
+                if (wait < 0 || hold < wait) {
+                    wait = hold;
+                    throttled = 0;
+                    hedging = 1;
+                }
+            }
+            left = ioqueue_timespec(wait);
+            ret = io_getevents(ioq->ctx, want, max - n, ioq->io_evs + nev, wait >= 0 ? &left : NULL);
+            if (ret > 0) {
+                got = ioqueue_events_advance(ioq, ioq->io_evs + nev, (unsigned int)ret);
+                n += ioqueue_events_count(ioq->io_evs + nev, got);
+                nev += got;
+            }
+            if (ret == -EINTR) continue;
+            if (ret < 0 || n >= min) break;
+            if (throttled) {
+                /* submit what the rate limits now allow, counting any failed at once */
+                if (ioqueue_flush(ioq, &err) == -1) {
+                    ret = -errno;
+                    break;
+                }
+                n = n + err < max ? n + err : max;
+                if (n >= min) break;
+            } else if (ret == 0 && !hedging) {
+                break;
+            }
+        }
+        if (ret < 0 && n == 0) {
+            errno = -ret;
+            return -1;
+        }
+    }
+
+    /* finish the reaped requests, moving those of fused reads and block reads onto the done-list */
+    now = ioqueue_now();
+    ran = 0;
+    for (i = 0; i < (int)nev; i++) {
+        /* the kernel reports failure as a negative errno */
+        res = (ssize_t)ioq->io_evs[i].res;
+        req = IOEV_DATA(&ioq->io_evs[i]);
+        if (req->blk != NULL) {
+            ioqueue_block_done(ioq, req, res < 0 ? -1 : res, (int)-res);
+        } else if (req->iov != NULL) {
+            ioqueue_request_unfuse(ioq, req, res < 0 ? -1 : res, (int)-res);
+        } else {
+            ioqueue_request_complete(ioq, req, res < 0 ? -1 : res, (int)-res, now);
+            ran++;
+        }
+    }
+    ran += ioqueue_done_run(ioq, max - ran, now);
+    if (ioq->ndone > 0 && ioq->eventfd != -1) {
+        /* the kernel signalled once for requests this reap had no room for */
+        eventfd_write(ioq->eventfd, 1);
+    }
+    if (ioq->requeued) {
+        /* submit the writes let go by those just completed, any failing at once wait for the next reap */
+        ioqueue_flush(ioq, NULL);
+    }
+    /* return the number of completed requests */
+    return (int)ran;
+}
+
+/* fetch and process any completed requests */
+int ioqueue_ctx_reap(ioqueue_t *ioq, unsigned int min)
+{
+    /* cannot wait for more requests than have been allocated */
+    if (ioqueue_outstanding(ioq) == 0 || min > ioqueue_outstanding(ioq)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_reap_wait(ioq, min, ioq->depth, NULL);
+}
+
+/* fetch and process between `min` and `max` completed requests, waiting at most `timeout` */
+int ioqueue_ctx_reap_timeout(ioqueue_t *ioq, unsigned int min, unsigned int max, const struct timespec *timeout)
+{
+    /* cannot wait for more requests than have been allocated */
+    if (max == 0 || max < min || min > ioqueue_outstanding(ioq)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_reap_wait(ioq, min, max, timeout);
+}
+
+/* fetch and process any completed requests without blocking */
+int ioqueue_ctx_poll(ioqueue_t *ioq, unsigned int max)
+{
+    const struct timespec zero = { 0, 0 };
+    return ioqueue_ctx_reap_timeout(ioq, 0, max, &zero);
+}
+
+/* copy the statistics recorded since the queue was created or last reset */
+int ioqueue_ctx_stats_get(ioqueue_t *ioq, struct ioqueue_stats *stats)
+{
+    *stats = ioq->stats;
+    return 0;
+}
+
+/* clear the recorded statistics */
+int ioqueue_ctx_stats_reset(ioqueue_t *ioq)
+{
+    memset(&ioq->stats, 0, sizeof(ioq->stats));
+    return 0;
+}
+
+/* allocate an I/O buffer from the queue's pool */
+void *ioqueue_ctx_buf_alloc(ioqueue_t *ioq, size_t len)
+{
+    return ioqueue_pool_alloc(&ioq->pool, len);
+}
+
+/* return an I/O buffer to the queue's pool */
+int ioqueue_ctx_buf_free(ioqueue_t *ioq, void *buf)
+{
+    return ioqueue_pool_free(&ioq->pool, buf);
+}
+
+/* spin for completions on the user-space ring before blocking in a reap */
+int ioqueue_ctx_set_busypoll(ioqueue_t *ioq, unsigned int usec)
+{
+    if (ioq->ring == NULL && usec > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    ioq->busypoll = (int64_t)usec * 1000;
+    return 0;
+}
+
+void ioqueue_ctx_destroy(ioqueue_t *ioq)
+{
+    unsigned int i;
+    while (ioqueue_outstanding(ioq) > 0) {
+        /* assume latency matters -- block for requests one at a time */
+        ioqueue_ctx_reap(ioq, 1);
+    }
+    /* waits for any read-ahead still in flight */
+    io_destroy(ioq->ctx);
+    free(ioq->io_evs);
+    for (i = 0; i < ioq->nreqs; i++) {
+        free(ioq->slots[i]);
+    }
+    for (i = 0; i < ioq->nstream; i++) {
+        free(ioq->streams[i]);
+    }
+    free(ioq->io_reqs);
+    free(ioq->slots);
+    free(ioq->fuse_sort);
+    free(ioq->fuse_pad);
+    free(ioq->rate_held);
+    free(ioq->shed);
+    free(ioq->streams);
+    free(ioq->cache.blocks);
+    free(ioq->cache.hash);
+    ioqueue_rate_destroy(&ioq->rate);
+    if (ioq->eventfd != -1) {
+        close(ioq->eventfd);
+    }
+    ioqueue_pool_destroy(&ioq->pool);
+    free(ioq);
 }
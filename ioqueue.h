@@ -28,33 +28,326 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* read/write callback function type (required) */
+typedef void (*ioqueue_cb)(void *arg, ssize_t res, void *buf);
+
+/** queue statistics **
+ *
+ * Every queue records when each request is enqueued, when it is
+ * dispatched to the kernel or a worker thread, and when its completion
+ * is reaped, into latency histograms split by request type.
+ */
+
+/* the number of buckets in a latency histogram */
+#define IOQUEUE_HIST_BUCKETS 312
+
+/* the request types latencies are recorded by */
+enum ioqueue_stats_op {
+    IOQUEUE_STATS_READ,     /* pread, preadv */
+    IOQUEUE_STATS_WRITE,    /* pwrite, pwritev */
+    IOQUEUE_STATS_SYNC,     /* fsync, fdatasync */
+    IOQUEUE_STATS_NOPS
+};
+
+/* a latency histogram in nanoseconds, with 8 log-linear buckets per power of two */
+struct ioqueue_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[IOQUEUE_HIST_BUCKETS];
+};
+
+struct ioqueue_stats {
+    struct ioqueue_hist wait[IOQUEUE_STATS_NOPS];    /* enqueue to dispatch */
+    struct ioqueue_hist service[IOQUEUE_STATS_NOPS]; /* dispatch to reaped completion */
+    struct ioqueue_hist total[IOQUEUE_STATS_NOPS];   /* enqueue to reaped completion */
+    uint64_t enqueued;      /* requests accepted */
+    uint64_t depth_sum;     /* outstanding requests summed over each enqueue */
+    uint64_t depth_max;     /* most outstanding requests */
+    uint64_t batches;       /* submissions to the kernel or worker threads */
+    uint64_t submitted;     /* requests submitted over all batches */
+    uint64_t batch_max;     /* largest single submission */
+    uint64_t eagain;        /* enqueues refused with EAGAIN, i.e. a full queue */
+    uint64_t fused;         /* requests read by another request's fused read */
+    uint64_t throttled;     /* requests held back by a rate limit */
+    uint64_t expired;       /* requests failed with ETIMEDOUT at their deadline without being started */
+    uint64_t readahead;     /* preads served from read-ahead buffers rather than read themselves */
+    uint64_t cached;        /* preads served from the block cache rather than read themselves */
+    uint64_t bounced;       /* unaligned preads and pwrites widened through an aligned buffer */
+    uint64_t split;         /* preads and pwrites split into parts submitted side by side */
+    uint64_t hedged;        /* backup reads and retries of hedged preads */
+};
+
+/* the latency in nanoseconds that `pct` percent of a histogram is at or below (to bucket resolution) */
+uint64_t ioqueue_hist_percentile(const struct ioqueue_hist *hist, double pct);
+
+/** request options **/
+
+/* I/O priority classes, as for ioprio_set(2) */
+#define IOQUEUE_PRIO_CLASS_RT   1   /* real-time, served ahead of all other I/O */
+#define IOQUEUE_PRIO_CLASS_BE   2   /* best-effort, the default */
+#define IOQUEUE_PRIO_CLASS_IDLE 3   /* served only when no other I/O is waiting */
+
+/* an I/O priority in `class` at `level`, from 0 (highest) to 7 (lowest) */
+#define IOQUEUE_PRIO(class, level) (((class) << 13) | (level))
+
+/* optional attributes of a request for the _ex enqueue functions, zero for the defaults */
+struct ioqueue_opts {
+    int prio;       /* I/O priority from IOQUEUE_PRIO(), or 0 for the default */
+    unsigned int tag;   /* rate limit tag, see ioqueue_set_ratelimit(), or 0 for none */
+    unsigned int timeout_us;    /* fail with ETIMEDOUT rather than start the request once this many
+                                 * microseconds have passed since it was enqueued, or 0 for none */
+};
+
+/* the enqueue functions return a request handle (>= 0) to cancel the request, or -1 on error */
+
+/** default queue API **/
+
 /* initialize the queue to the given maximum outstanding requests */
 int  ioqueue_init(unsigned int depth);
 
+/* initialize the queue to `depth` maximum outstanding requests, served by between `min_threads` and
+ * `max_threads` worker threads with at most `backlog` requests waiting per thread (0 for no limit
+ * beyond `depth`); backends without worker threads ignore all but `depth` */
+int  ioqueue_init_threads(unsigned int depth, unsigned int min_threads, unsigned int max_threads, unsigned int backlog);
+
 /* retrieve a file descriptor suitable for io readiness notifications via e.g. poll/epoll */
 int  ioqueue_eventfd();
 
-/* read/write callback function type (required) */
-typedef void (*ioqueue_cb)(void *arg, ssize_t res, void *buf);
-
 /* enqueue a pread request */
 int  ioqueue_pread(int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg);
 
 /* enqueue a pwrite request */
 int  ioqueue_pwrite(int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg);
 
+/* enqueue a pread request with the given options, or the defaults when `opts` is NULL */
+int  ioqueue_pread_ex(int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a pwrite request with the given options, or the defaults when `opts` is NULL */
+int  ioqueue_pwrite_ex(int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a pread of the same data held on each of the `nfd` files `fds`, reading one and
+ * then another if the first is slow or fails, with one callback for the first to succeed;
+ * `buf` need not be aligned, as both read through buffers from the pool (KAIO only) */
+int  ioqueue_pread_hedged(const int *fds, int nfd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a vectored preadv request, the callback receives `iov` as its buffer */
+int  ioqueue_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a vectored pwritev request, the callback receives `iov` as its buffer */
+int  ioqueue_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue an fsync request, the callback receives a NULL buffer */
+int  ioqueue_fsync(int fd, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue an fdatasync request, the callback receives a NULL buffer */
+int  ioqueue_fdatasync(int fd, ioqueue_cb cb, void *cb_arg);
+
+/* cancel an outstanding request, its callback runs with ECANCELED immediately or from a
+ * later reap, or fails with EALREADY if the request has completed or cannot be stopped */
+int  ioqueue_cancel(int handle);
+
+/* submit waiting requests without handling completions, returns the number submitted */
+int  ioqueue_submit();
+
 /* submit requests and handle completion events */
 int  ioqueue_reap(unsigned int min);
 
+/* submit requests and handle between `min` and `max` completion events,
+ * blocking at most `timeout` (or indefinitely when NULL) for the first `min` */
+int  ioqueue_reap_timeout(unsigned int min, unsigned int max, const struct timespec *timeout);
+
+/* submit requests and handle at most `max` already completed events, never blocking */
+int  ioqueue_poll(unsigned int max);
+
+/* spin for up to `usec` microseconds for completions before blocking in a reap (0 disables) */
+int  ioqueue_set_busypoll(unsigned int usec);
+
+/* submit on enqueue once `batch` requests wait or the oldest has waited `usec`
+ * microseconds, rather than only on reap (0 disables either trigger) */
+int  ioqueue_set_autoflush(unsigned int batch, unsigned int usec);
+
+/* fuse queued preads on the same file, each starting at most `gap` bytes after the last,
+ * into single reads of up to `max` bytes before submission (0 disables, KAIO only) */
+int  ioqueue_set_coalesce(size_t gap, size_t max);
+
+/* limit the requests tagged `tag` to `bytes` bytes and `ops` requests per second (0 for no
+ * limit), holding back those over the limit in the queue; KAIO and Pthreads only, io_uring
+ * fails a tagged request with ENOTSUP */
+int  ioqueue_set_ratelimit(unsigned int tag, uint64_t bytes, uint64_t ops);
+
+/* read ahead of sequential preads on `fd` by up to `max` bytes, serving later preads from
+ * memory where they fall in what was read (0 disables); KAIO only, see ioqueue_create */
+int  ioqueue_set_readahead(int fd, size_t max);
+
+/* cache preads that fall within one aligned `block` of a file in up to `size` bytes of
+ * blocks, where `block` is a power of two of at least 512 (0 disables); KAIO only */
+int  ioqueue_set_cache(size_t block, size_t size);
+
+/* widen preads and pwrites whose buffer, offset or length is not a multiple of `align`, a
+ * power of two from 512 to 4096, to the blocks they cover through buffers from the pool,
+ * reading partly covered blocks before writing them (0 disables); KAIO only */
+int  ioqueue_set_align(size_t align);
+
+/* split preads and pwrites longer than `max` bytes, a multiple of 4096, into parts of that
+ * length submitted side by side, completing each with a single callback (0 disables); KAIO
+ * only, see ioqueue_create */
+int  ioqueue_set_split(size_t max);
+
+/* send a hedged pread's backup read once it has taken longer than `pct` percent of recent
+ * hedged preads, 95 by default, and at least `min_us` microseconds; KAIO only, see ioqueue_create */
+int  ioqueue_set_hedge(double pct, unsigned int min_us);
+
+/* copy the statistics recorded since the queue was created or last reset */
+int  ioqueue_stats_get(struct ioqueue_stats *stats);
+
+/* clear the recorded statistics */
+int  ioqueue_stats_reset();
+
+/* allocate a buffer of at least `len` bytes from the queue's pre-faulted, hugepage backed pool,
+ * aligned to at least 4096 bytes for O_DIRECT and valid until freed or the queue is destroyed */
+void *ioqueue_buf_alloc(size_t len);
+
+/* return a buffer from ioqueue_buf_alloc to the pool, fails with EINVAL for any other pointer */
+int  ioqueue_buf_free(void *buf);
+
 /* reap all requests and destroy the queue */
 void ioqueue_destroy();
 
+/** queue handle API **
+ *
+ * Each ioqueue_t is an independent queue with no state shared with any
+ * other, e.g. one per I/O thread.  A handle must only be used by one
+ * thread at a time.  The default queue API above operates on a single
+ * process-wide handle created by ioqueue_init().
+ */
+
+/* opaque queue handle */
+typedef struct ioqueue ioqueue_t;
+
+/* create a queue with the given maximum outstanding requests, or NULL on error; on KAIO the
+ * first of read-ahead, splitting or hedging to be enabled adds half as many kernel AIO slots
+ * again for its own reads, and fails with EBUSY unless the queue is idle */
+ioqueue_t *ioqueue_create(unsigned int depth);
+
+/* create a queue of `depth` maximum outstanding requests, served by between `min_threads` and
+ * `max_threads` worker threads with at most `backlog` requests waiting per thread (0 for no limit
+ * beyond `depth`), or NULL on error, returning once the first `min_threads` threads are idle;
+ * backends without worker threads ignore all but `depth` */
+ioqueue_t *ioqueue_create_threads(unsigned int depth, unsigned int min_threads, unsigned int max_threads, unsigned int backlog);
+
+/* retrieve a file descriptor suitable for io readiness notifications via e.g. poll/epoll */
+int  ioqueue_ctx_eventfd(ioqueue_t *ioq);
+
+/* enqueue a pread request */
+int  ioqueue_ctx_pread(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a pwrite request */
+int  ioqueue_ctx_pwrite(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a pread request with the given options, or the defaults when `opts` is NULL */
+int  ioqueue_ctx_pread_ex(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a pwrite request with the given options, or the defaults when `opts` is NULL */
+int  ioqueue_ctx_pwrite_ex(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a pread of the same data held on each of the `nfd` files `fds`, reading one and
+ * then another if the first is slow or fails, with one callback for the first to succeed;
+ * `buf` need not be aligned, as both read through buffers from the pool (KAIO only) */
+int  ioqueue_ctx_pread_hedged(ioqueue_t *ioq, const int *fds, int nfd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a vectored preadv request, the callback receives `iov` as its buffer */
+int  ioqueue_ctx_preadv(ioqueue_t *ioq, int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue a vectored pwritev request, the callback receives `iov` as its buffer */
+int  ioqueue_ctx_pwritev(ioqueue_t *ioq, int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue an fsync request, the callback receives a NULL buffer */
+int  ioqueue_ctx_fsync(ioqueue_t *ioq, int fd, ioqueue_cb cb, void *cb_arg);
+
+/* enqueue an fdatasync request, the callback receives a NULL buffer */
+int  ioqueue_ctx_fdatasync(ioqueue_t *ioq, int fd, ioqueue_cb cb, void *cb_arg);
+
+/* cancel an outstanding request, its callback runs with ECANCELED immediately or from a
+ * later reap, or fails with EALREADY if the request has completed or cannot be stopped */
+int  ioqueue_ctx_cancel(ioqueue_t *ioq, int handle);
+
+/* submit waiting requests without handling completions, returns the number submitted */
+int  ioqueue_ctx_submit(ioqueue_t *ioq);
+
+/* submit requests and handle completion events */
+int  ioqueue_ctx_reap(ioqueue_t *ioq, unsigned int min);
+
+/* submit requests and handle between `min` and `max` completion events,
+ * blocking at most `timeout` (or indefinitely when NULL) for the first `min` */
+int  ioqueue_ctx_reap_timeout(ioqueue_t *ioq, unsigned int min, unsigned int max, const struct timespec *timeout);
+
+/* submit requests and handle at most `max` already completed events, never blocking */
+int  ioqueue_ctx_poll(ioqueue_t *ioq, unsigned int max);
+
+/* spin for up to `usec` microseconds for completions before blocking in a reap (0 disables) */
+int  ioqueue_ctx_set_busypoll(ioqueue_t *ioq, unsigned int usec);
+
+/* submit on enqueue once `batch` requests wait or the oldest has waited `usec`
+ * microseconds, rather than only on reap (0 disables either trigger) */
+int  ioqueue_ctx_set_autoflush(ioqueue_t *ioq, unsigned int batch, unsigned int usec);
+
+/* fuse queued preads on the same file, each starting at most `gap` bytes after the last,
+ * into single reads of up to `max` bytes before submission (0 disables, KAIO only) */
+int  ioqueue_ctx_set_coalesce(ioqueue_t *ioq, size_t gap, size_t max);
+
+/* limit the requests tagged `tag` to `bytes` bytes and `ops` requests per second (0 for no
+ * limit), holding back those over the limit in the queue; KAIO and Pthreads only, io_uring
+ * fails a tagged request with ENOTSUP */
+int  ioqueue_ctx_set_ratelimit(ioqueue_t *ioq, unsigned int tag, uint64_t bytes, uint64_t ops);
+
+/* read ahead of sequential preads on `fd` by up to `max` bytes, serving later preads from
+ * memory where they fall in what was read (0 disables); KAIO only, see ioqueue_create */
+int  ioqueue_ctx_set_readahead(ioqueue_t *ioq, int fd, size_t max);
+
+/* cache preads that fall within one aligned `block` of a file in up to `size` bytes of
+ * blocks, where `block` is a power of two of at least 512 (0 disables); KAIO only */
+int  ioqueue_ctx_set_cache(ioqueue_t *ioq, size_t block, size_t size);
+
+/* widen preads and pwrites whose buffer, offset or length is not a multiple of `align`, a
+ * power of two from 512 to 4096, to the blocks they cover through buffers from the pool,
+ * reading partly covered blocks before writing them (0 disables); KAIO only */
+int  ioqueue_ctx_set_align(ioqueue_t *ioq, size_t align);
+
+/* split preads and pwrites longer than `max` bytes, a multiple of 4096, into parts of that
+ * length submitted side by side, completing each with a single callback (0 disables); KAIO
+ * only, see ioqueue_create */
+int  ioqueue_ctx_set_split(ioqueue_t *ioq, size_t max);
+
+/* send a hedged pread's backup read once it has taken longer than `pct` percent of recent
+ * hedged preads, 95 by default, and at least `min_us` microseconds; KAIO only, see ioqueue_create */
+int  ioqueue_ctx_set_hedge(ioqueue_t *ioq, double pct, unsigned int min_us);
+
+/* copy the statistics recorded since the queue was created or last reset */
+int  ioqueue_ctx_stats_get(ioqueue_t *ioq, struct ioqueue_stats *stats);
+
+/* clear the recorded statistics */
+int  ioqueue_ctx_stats_reset(ioqueue_t *ioq);
+
+/* allocate a buffer of at least `len` bytes from the queue's pre-faulted, hugepage backed pool,
+ * aligned to at least 4096 bytes for O_DIRECT and valid until freed or the queue is destroyed */
+void *ioqueue_ctx_buf_alloc(ioqueue_t *ioq, size_t len);
+
+/* return a buffer from ioqueue_ctx_buf_alloc to the pool, fails with EINVAL for any other pointer */
+int  ioqueue_ctx_buf_free(ioqueue_t *ioq, void *buf);
+
+/* reap all requests and destroy the queue */
+void ioqueue_ctx_destroy(ioqueue_t *ioq);
+
 #ifdef __cplusplus
 }
 #endif
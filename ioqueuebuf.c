@@ -0,0 +1,223 @@
+
+// ioqueuebuf.c - hugepage backed I/O buffer pools shared by the ioqueue backends
+//
+// Copyright (c) 2015  Jeremy R. Fishman
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the <organization> nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "ioqueue.h"
+#include "ioqueuepriv.h"
+
+/* the size class that fits `len` bytes, or -1 if it needs a chunk of its own */
+static int
+ioqueue_pool_class(size_t len)
+{
+    int cls;
+    if (len <= ((size_t)1 << IOQUEUE_POOL_MIN_SHIFT)) {
+        return 0;
+    }
+    cls = 64 - __builtin_clzll((unsigned long long)len - 1) - IOQUEUE_POOL_MIN_SHIFT;
+    return cls < IOQUEUE_POOL_CLASSES ? cls : -1;
+}
+
+/* map and pre-fault `size` bytes aligned to a chunk, preferring hugepages */
+static char *
+ioqueue_pool_map(size_t size)
+{
+    char *base, *aligned;
+    size_t i, head;
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (base != MAP_FAILED) {
+        /* hugetlb mappings are aligned to the hugepage size */
+        return base;
+    }
+
+    /* no hugepages reserved - over-map to align, then ask for transparent hugepages */
+    base = mmap(NULL, size + IOQUEUE_POOL_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    aligned = (char *)(((uintptr_t)base + IOQUEUE_POOL_CHUNK - 1) & ~(uintptr_t)(IOQUEUE_POOL_CHUNK - 1));
+    head = (size_t)(aligned - base);
+    if (head > 0) {
+        munmap(base, head);
+    }
+    if (head < IOQUEUE_POOL_CHUNK) {
+        munmap(aligned + size, IOQUEUE_POOL_CHUNK - head);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    /* fault the pages in now rather than on the first I/O */
+    for (i = 0; i < size; i += (size_t)1 << IOQUEUE_POOL_MIN_SHIFT) {
+        aligned[i] = 0;
+    }
+    return aligned;
+}
+
+/* the chunk containing `buf`, or NULL */
+static struct ioqueue_pool_chunk *
+ioqueue_pool_lookup(struct ioqueue_pool *pool, const char *buf)
+{
+    unsigned int lo = 0, hi = pool->nchunk, mid;
+    /* find the last chunk starting at or before the buffer */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (pool->chunks[mid].base <= buf) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || buf >= pool->chunks[lo - 1].base + pool->chunks[lo - 1].size) {
+        return NULL;
+    }
+    return &pool->chunks[lo - 1];
+}
+
+/* record a mapped chunk, keeping the chunks sorted */
+static int
+ioqueue_pool_insert(struct ioqueue_pool *pool, char *base, size_t size, int cls)
+{
+    unsigned int i, n;
+    struct ioqueue_pool_chunk *chunks;
+
+    if (pool->nchunk == pool->maxchunk) {
+        n = pool->maxchunk ? pool->maxchunk * 2 : 8;
+        chunks = realloc(pool->chunks, n * sizeof(chunks[0]));
+        if (chunks == NULL) {
+            return -1;
+        }
+        pool->chunks = chunks;
+        pool->maxchunk = n;
+    }
+    for (i = pool->nchunk; i > 0 && pool->chunks[i - 1].base > base; i--) {
+        pool->chunks[i] = pool->chunks[i - 1];
+    }
+    pool->chunks[i].base = base;
+    pool->chunks[i].size = size;
+    pool->chunks[i].cls = cls;
+    pool->nchunk++;
+    return 0;
+}
+
+/* allocate a buffer of at least `len` bytes */
+void *
+ioqueue_pool_alloc(struct ioqueue_pool *pool, size_t len)
+{
+    int cls;
+    size_t size, step, off;
+    char *base;
+    void *buf;
+
+    if (len == 0 || len > SSIZE_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    cls = ioqueue_pool_class(len);
+    if (cls >= 0 && pool->free[cls] != NULL) {
+        /* the common case - pop the free list */
+        buf = pool->free[cls];
+        pool->free[cls] = *(void **)buf;
+        return buf;
+    }
+
+    size = cls >= 0 ? IOQUEUE_POOL_CHUNK : (len + IOQUEUE_POOL_CHUNK - 1) & ~(IOQUEUE_POOL_CHUNK - 1);
+    base = ioqueue_pool_map(size);
+    if (base == NULL) {
+        return NULL;
+    }
+    if (ioqueue_pool_insert(pool, base, size, cls) == -1) {
+        munmap(base, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (cls >= 0) {
+        /* carve the rest of the chunk onto the free list, lowest address first */
+        step = (size_t)1 << (cls + IOQUEUE_POOL_MIN_SHIFT);
+        for (off = size - step; off > 0; off -= step) {
+            *(void **)(base + off) = pool->free[cls];
+            pool->free[cls] = base + off;
+        }
+    }
+    return base;
+}
+
+/* return a buffer to the pool, failing with EINVAL if it did not come from it */
+int
+ioqueue_pool_free(struct ioqueue_pool *pool, void *buf)
+{
+    struct ioqueue_pool_chunk *chunk;
+    unsigned int i;
+
+    if (buf == NULL) {
+        return 0;
+    }
+    chunk = ioqueue_pool_lookup(pool, buf);
+    if (chunk == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (chunk->cls < 0) {
+        if ((char *)buf != chunk->base) {
+            errno = EINVAL;
+            return -1;
+        }
+        /* large buffers are not pooled */
+        munmap(chunk->base, chunk->size);
+        i = (unsigned int)(chunk - pool->chunks);
+        memmove(chunk, chunk + 1, (pool->nchunk - i - 1) * sizeof(*chunk));
+        pool->nchunk--;
+        return 0;
+    }
+    if (((size_t)((char *)buf - chunk->base) & (((size_t)1 << (chunk->cls + IOQUEUE_POOL_MIN_SHIFT)) - 1)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    *(void **)buf = pool->free[chunk->cls];
+    pool->free[chunk->cls] = buf;
+    return 0;
+}
+
+/* unmap every chunk of the pool */
+void
+ioqueue_pool_destroy(struct ioqueue_pool *pool)
+{
+    unsigned int i;
+    for (i = 0; i < pool->nchunk; i++) {
+        munmap(pool->chunks[i].base, pool->chunks[i].size);
+    }
+    free(pool->chunks);
+    memset(pool, 0, sizeof(*pool));
+}
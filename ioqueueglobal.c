@@ -0,0 +1,376 @@
+
+// ioqueueglobal.c - default queue instance for the ioqueue API
+//
+// Copyright (c) 2015  Jeremy R. Fishman
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the <organization> nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <errno.h>
+#include <stddef.h>
+#include "ioqueue.h"
+
+/* the process-wide queue used by the default queue API */
+static ioqueue_t *_ioq = NULL;
+
+/* initiliaze the io queue to the given maximum outstanding requests */
+int
+ioqueue_init(unsigned int depth)
+{
+    if (_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    _ioq = ioqueue_create(depth);
+    return _ioq ? 0 : -1;
+}
+
+/* initiliaze the io queue to `depth` outstanding requests served by a pool of threads */
+int
+ioqueue_init_threads(unsigned int depth, unsigned int min_threads, unsigned int max_threads, unsigned int backlog)
+{
+    if (_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    _ioq = ioqueue_create_threads(depth, min_threads, max_threads, backlog);
+    return _ioq ? 0 : -1;
+}
+
+/* retrieve a file descrptor suitable for io readiness notifications via e.g. poll/epoll */
+int
+ioqueue_eventfd()
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_eventfd(_ioq);
+}
+
+/* enqueue a pread request  */
+int
+ioqueue_pread(int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_pread(_ioq, fd, buf, len, offset, cb, cb_arg);
+}
+
+/* enqueue a pwrite request  */
+int
+ioqueue_pwrite(int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_pwrite(_ioq, fd, buf, len, offset, cb, cb_arg);
+}
+
+/* enqueue a pread request with options  */
+int
+ioqueue_pread_ex(int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_arg)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_pread_ex(_ioq, fd, buf, len, offset, opts, cb, cb_arg);
+}
+
+/* enqueue a pwrite request with options  */
+int
+ioqueue_pwrite_ex(int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_arg)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_pwrite_ex(_ioq, fd, buf, len, offset, opts, cb, cb_arg);
+}
+
+/* enqueue a pread of replicated data */
+int
+ioqueue_pread_hedged(const int *fds, int nfd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_pread_hedged(_ioq, fds, nfd, buf, len, offset, cb, cb_arg);
+}
+
+/* enqueue a vectored preadv request  */
+int
+ioqueue_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_arg)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_preadv(_ioq, fd, iov, iovcnt, offset, cb, cb_arg);
+}
+
+/* enqueue a vectored pwritev request  */
+int
+ioqueue_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_arg)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_pwritev(_ioq, fd, iov, iovcnt, offset, cb, cb_arg);
+}
+
+/* enqueue an fsync request  */
+int
+ioqueue_fsync(int fd, ioqueue_cb cb, void *cb_arg)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_fsync(_ioq, fd, cb, cb_arg);
+}
+
+/* enqueue an fdatasync request  */
+int
+ioqueue_fdatasync(int fd, ioqueue_cb cb, void *cb_arg)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_fdatasync(_ioq, fd, cb, cb_arg);
+}
+
+/* cancel an outstanding request */
+int
+ioqueue_cancel(int handle)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_cancel(_ioq, handle);
+}
+
+/* submit waiting requests without handling completions */
+int
+ioqueue_submit()
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_submit(_ioq);
+}
+
+/* submit requests and handle completion events */
+int
+ioqueue_reap(unsigned int min)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_reap(_ioq, min);
+}
+
+/* submit requests and handle between `min` and `max` completion events */
+int
+ioqueue_reap_timeout(unsigned int min, unsigned int max, const struct timespec *timeout)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_reap_timeout(_ioq, min, max, timeout);
+}
+
+/* submit requests and handle already completed events, never blocking */
+int
+ioqueue_poll(unsigned int max)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_poll(_ioq, max);
+}
+
+/* spin for completions before blocking in a reap */
+int
+ioqueue_set_busypoll(unsigned int usec)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_set_busypoll(_ioq, usec);
+}
+
+/* submit on enqueue according to a batch size or delay */
+int
+ioqueue_set_autoflush(unsigned int batch, unsigned int usec)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_set_autoflush(_ioq, batch, usec);
+}
+
+/* fuse neighbouring reads before submission */
+int
+ioqueue_set_coalesce(size_t gap, size_t max)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_set_coalesce(_ioq, gap, max);
+}
+
+/* limit the rate of tagged requests */
+int
+ioqueue_set_ratelimit(unsigned int tag, uint64_t bytes, uint64_t ops)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_set_ratelimit(_ioq, tag, bytes, ops);
+}
+
+/* read ahead of sequential preads */
+int
+ioqueue_set_readahead(int fd, size_t max)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_set_readahead(_ioq, fd, max);
+}
+
+/* cache preads in fixed size blocks */
+int
+ioqueue_set_cache(size_t block, size_t size)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_set_cache(_ioq, block, size);
+}
+
+/* bounce unaligned preads and pwrites */
+int
+ioqueue_set_align(size_t align)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_set_align(_ioq, align);
+}
+
+/* split long preads and pwrites */
+int
+ioqueue_set_split(size_t max)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_set_split(_ioq, max);
+}
+
+/* tune when hedged preads send their backup read */
+int
+ioqueue_set_hedge(double pct, unsigned int min_us)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_set_hedge(_ioq, pct, min_us);
+}
+
+/* copy the recorded statistics */
+int
+ioqueue_stats_get(struct ioqueue_stats *stats)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_stats_get(_ioq, stats);
+}
+
+/* clear the recorded statistics */
+int
+ioqueue_stats_reset()
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_stats_reset(_ioq);
+}
+
+/* allocate an I/O buffer from the queue's pool */
+void *
+ioqueue_buf_alloc(size_t len)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return ioqueue_ctx_buf_alloc(_ioq, len);
+}
+
+/* return an I/O buffer to the queue's pool */
+int
+ioqueue_buf_free(void *buf)
+{
+    if (!_ioq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_ctx_buf_free(_ioq, buf);
+}
+
+/* reap all requests and destroy the queue */
+void
+ioqueue_destroy()
+{
+    if (_ioq) {
+        ioqueue_ctx_destroy(_ioq);
+        _ioq = NULL;
+    }
+}
@@ -26,23 +26,59 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
-
-#include <assert.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <errno.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include "ioqueue.h"
+#include "ioqueuepriv.h"
 
 /* NOTE: scales queue size but not depth/parallelism */
 #ifndef IOQUEUEMT_BACKLOG
 #define IOQUEUEMT_BACKLOG 1     /* the # of queued requests permitted per thread */
 #endif
 
+#ifndef IOQUEUEMT_IDLE
+#define IOQUEUEMT_IDLE 1000     /* the # of milliseconds an idle thread above the minimum lingers */
+#endif
+
+/* ioprio_set(2) target of the calling thread, not in the libc headers */
+#define IOQUEUEMT_IOPRIO_WHO_PROCESS 1
+
+#ifndef IOQUEUEMT_SPIN
+#define IOQUEUEMT_SPIN 64       /* the # of empty polls before an idle thread parks (SMP only) */
+#endif
+
+/* the submission rings, one per I/O priority class from real-time to idle */
+#define IOQUEUEMT_NRING 3
+
+/* fields written by different threads are kept on separate cache lines */
+#define IOQUEUEMT_CACHELINE 64
+
 enum ioqueue_op {
     ioqueue_OP_PREAD,
     ioqueue_OP_PWRITE,
+    ioqueue_OP_PREADV,
+    ioqueue_OP_PWRITEV,
+    ioqueue_OP_FSYNC,
+    ioqueue_OP_FDATASYNC,
+};
+
+/* request states, claimed atomically by a thread or by a cancellation */
+enum ioqueue_state {
+    ioqueue_STATE_QUEUED,
+    ioqueue_STATE_RUNNING,
+    ioqueue_STATE_CANCELLED,
 };
 
 struct ioqueue_request {
@@ -50,382 +86,1170 @@ struct ioqueue_request {
     int fd;
     ioqueue_cb cb;
     void *cb_arg;
+    int handle;     /* the request handle, or -1 when free */
+    int state;      /* enum ioqueue_state */
+    int prio;       /* the I/O priority, or 0 for the default */
+    unsigned int tag;   /* the rate limit tag, or 0 */
+    int held;       /* the request has been held back by its rate limit */
+    int64_t deadline;   /* when the request is no longer worth starting, or 0 */
+    unsigned int gen;   /* the number of times the slot has been used */
+    int64_t t_submit;   /* when the request was enqueued */
+    int64_t t_dispatch; /* when a thread started the operation, or 0 */
     union {
         struct {
-            void *buf;
-            ssize_t x;
+            void *buf;  /* the buffer, or iovec array for vectored ops */
+            ssize_t x;  /* the length, or iovec count, and then the result */
             off_t off;
         } rw;
     } u;
+} __attribute__((aligned(IOQUEUEMT_CACHELINE)));
+
+/* worker thread states, as seen by the submitting thread */
+enum ioqueue_worker_state {
+    ioqueue_WORKER_NONE,        /* never started, or joined */
+    ioqueue_WORKER_RUNNING,
+    ioqueue_WORKER_EXITED,      /* retired while idle, yet to be joined */
 };
 
-struct ioqueue_queue {
+/**
+ * worker thread
+ *   Each thread returns the slots of the requests it completes to the
+ *   submitting thread over its own single-producer/single-consumer ring.
+ */
+struct ioqueue_worker {
+    struct ioqueue *ioq;
     pthread_t thread;
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
-    struct ioqueue_request *reqs;
-    unsigned int head;  /* the first request in the queue */
-    unsigned int done;  /* the number of requests that have been completed */
-    unsigned int size;  /* the total number of requests on the queue */
-    unsigned int wait;  /* the thread needs a signal when reaped */
-};
+    int state;          /* enum ioqueue_worker_state */
+    int prio;           /* the I/O priority the thread runs at */
+    unsigned int *done; /* completed request slots */
+    unsigned int head;  /* the first completion not yet taken, written by the submitting thread */
+    unsigned int tail __attribute__((aligned(IOQUEUEMT_CACHELINE))); /* the end of the completions */
+} __attribute__((aligned(IOQUEUEMT_CACHELINE)));
+
+/**
+ * ioqueue instance
+ *   Requests live in a fixed array of slots.  Pushed slots go onto a
+ *   submission ring shared by all threads, and whichever thread is idle
+ *   claims the next one by advancing `sq_head`, so a slow request only
+ *   ever holds up its own thread.  There is one ring per I/O priority
+ *   class, and a thread only claims from a ring once those of higher
+ *   classes are empty.  No ring can overflow, as none ever holds more
+ *   than the `nslot` outstanding requests.
+ *
+ *   Requests over their rate limit are held back in `held` by the
+ *   submitting thread, and pushed once their tokens have been earned.
+ *   Requests with a deadline are also kept there until the next flush,
+ *   which pushes them earliest deadline first.  A thread fails a request
+ *   past its deadline with ETIMEDOUT rather than start it.
+ *
+ *   The pool starts `min_thread` threads and grows towards `nworker` on
+ *   submit whenever more requests wait than threads are parked.  A thread
+ *   above the minimum that stays parked for IOQUEUEMT_IDLE exits again.
+ *
+ *   Once retrieved, the eventfd is signalled by the first completion
+ *   after each reap rather than by every completion, so a burst costs a
+ *   single write.
+ */
+struct ioqueue {
+    unsigned int nslot;     /* request slots, i.e. the queue depth */
+    unsigned int nworker;   /* the maximum threads */
+    unsigned int min_thread;
+    unsigned int backlog;   /* the most requests waiting for a thread, or 0 for no limit */
+    unsigned int spin;      /* empty polls before an idle thread parks */
+    unsigned int nreqs;     /* outstanding requests, i.e. pushed and not yet taken */
+    unsigned int nfree;     /* free slot stack size */
+    unsigned int nwait;     /* requests pushed since the threads were last kicked */
+    unsigned int flush_batch;   /* auto-flush once this many requests wait */
+    int64_t flush_delay;        /* auto-flush once the oldest has waited this long */
+    int64_t wait_since;         /* when the oldest waiting request was pushed */
+    int running;
+    int eventfd;            /* eventfd(2) for poll/epoll */
+    int notifying;          /* the eventfd has been handed out, so is worth signalling */
+    pthread_attr_t attr;
+    struct ioqueue_rate rate;   /* rate limits by tag */
+    unsigned int *held;         /* slots held back, by deadline and then age */
+    unsigned int nheld;
+    int64_t rate_next;          /* when the first held request may be pushed */
 
-static unsigned int _backlog;
-static unsigned int _nqueue;
-static int _running;
+    struct ioqueue_request *reqs;   /* request slots */
+    unsigned int *free;             /* free slot stack */
+    unsigned int *sq[IOQUEUEMT_NRING];  /* submission rings of request slots */
+    struct ioqueue_worker *workers;
+    struct ioqueue_stats stats;
+    struct ioqueue_pool pool;   /* I/O buffers */
 
-static struct ioqueue_queue *_queues = NULL;
-static pthread_mutex_t _reap_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t _reap_cond = PTHREAD_COND_INITIALIZER;
+    /* written by the submitting thread, read by the threads */
+    unsigned int sq_tail[IOQUEUEMT_NRING] __attribute__((aligned(IOQUEUEMT_CACHELINE))); /* the ends of the pushed slots */
+    unsigned int reaping;   /* a reap waits, or is about to wait, on `reap_wake` */
+    /* claimed by the threads */
+    unsigned int sq_head[IOQUEUEMT_NRING] __attribute__((aligned(IOQUEUEMT_CACHELINE))); /* the first unclaimed slots */
+    unsigned int nparked;   /* threads waiting, or about to wait, on `wake` */
+    unsigned int nlive;     /* running threads */
+    unsigned int notify;    /* the next completion signals the eventfd, re-armed by each reap */
+    unsigned int wake;      /* futex word, bumped to wake parked threads */
+    unsigned int reap_wake; /* futex word, bumped by the threads to wake a parked reap */
+};
 
+/* wait while a futex word holds `val`, for at most `timeout` (or indefinitely when NULL) */
 static int
-ioqueue_request_push(struct ioqueue_queue *queue, const struct ioqueue_request *req)
+ioqueue_futex_wait(unsigned int *addr, unsigned int val, const struct timespec *timeout)
 {
-    int ret;
-    pthread_mutex_lock(&queue->lock);
+    return (int)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
 
-    if (queue->size < _backlog) {
-        /* there is space on the queue - append to the tail */
-        queue->reqs[(queue->head + queue->size++) % _backlog] = *req;
-        ret = 0;
-    } else {
+/* wake up to `n` waiters on a futex word */
+static void
+ioqueue_futex_wake(unsigned int *addr, unsigned int n)
+{
+    __atomic_add_fetch(addr, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n > INT_MAX ? INT_MAX : n, NULL, NULL, 0);
+}
+
+/* the submission ring for an I/O priority */
+static unsigned int
+ioqueue_prio_ring(int prio)
+{
+    switch (ioqueue_prio_class(prio)) {
+    case IOQUEUE_PRIO_CLASS_RT:
+        return 0;
+    case IOQUEUE_PRIO_CLASS_IDLE:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+/* the pushed requests not yet claimed by a thread */
+static unsigned int
+ioqueue_request_pending(ioqueue_t *ioq)
+{
+    unsigned int r, n, head;
+    for (r = 0, n = 0; r < IOQUEUEMT_NRING; r++) {
+        /* the head first, as it never passes the tail */
+        head = RING_LOAD(&ioq->sq_head[r]);
+        n += RING_LOAD(&ioq->sq_tail[r]) - head;
+    }
+    return n;
+}
+
+/* allocate a request slot */
+static struct ioqueue_request *
+ioqueue_request_alloc(ioqueue_t *ioq)
+{
+    unsigned int id;
+    struct ioqueue_request *req;
+
+    if (ioq->nfree == 0) {
         /* no space on the queue - temporary failure */
         errno = EAGAIN;
-        ret = -1;
+        return NULL;
+    }
+    if (ioq->backlog > 0 && ioqueue_request_pending(ioq) + ioq->nheld >= ioq->backlog) {
+        /* the threads are too far behind - temporary failure */
+        errno = EAGAIN;
+        return NULL;
     }
+    id = ioq->free[--ioq->nfree];
+    req = &ioq->reqs[id];
+    req->handle = ioqueue_handle(id, ioq->nslot, req->gen++);
+    req->state = ioqueue_STATE_QUEUED;
+    return req;
+}
 
-    pthread_mutex_unlock(&queue->lock);
-    return ret;
+/* push a filled request onto the submission ring of its priority, making it visible to the threads */
+static void
+ioqueue_request_push(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    const unsigned int r = ioqueue_prio_ring(req->prio);
+    __atomic_store_n(&ioq->sq[r][ioq->sq_tail[r] % ioq->nslot], (unsigned int)(req - ioq->reqs), __ATOMIC_RELAXED);
+    RING_STORE(&ioq->sq_tail[r], ioq->sq_tail[r] + 1);
+    if (ioq->nwait++ == 0) {
+        ioq->wait_since = ioqueue_now();
+    }
 }
 
-static struct ioqueue_request *
-ioqueue_request_next(struct ioqueue_queue *queue, int done)
+/* hold back a request until the next flush or until its rate limit allows, in deadline order */
+static void
+ioqueue_request_hold(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    unsigned int i;
+    const int64_t deadline = req->deadline ? req->deadline : INT64_MAX;
+    if (ioq->nwait + ioq->nheld == 0) {
+        ioq->wait_since = req->t_submit;
+    }
+    /* usually appended, as most requests have no or similar deadlines */
+    for (i = ioq->nheld; i > 0; i--) {
+        const struct ioqueue_request *const prev = &ioq->reqs[ioq->held[i - 1]];
+        if ((prev->deadline ? prev->deadline : INT64_MAX) <= deadline) break;
+        ioq->held[i] = ioq->held[i - 1];
+    }
+    ioq->held[i] = (unsigned int)(req - ioq->reqs);
+    ioq->nheld++;
+}
+
+/* push the held requests that their rate limits now allow, in order */
+static void
+ioqueue_request_release(ioqueue_t *ioq)
 {
+    unsigned int i, k;
+    int64_t wait;
     struct ioqueue_request *req;
-    pthread_mutex_lock(&queue->lock);
-
-    if (done) {
-        /* register completion of the last request handled */
-        if (!queue->done++) {
-            /* first request completed, main thread could be waiting */
-            pthread_mutex_unlock(&queue->lock);
-            pthread_mutex_lock(&_reap_lock);
-            pthread_cond_signal(&_reap_cond);
-            pthread_mutex_unlock(&_reap_lock);
-            pthread_mutex_lock(&queue->lock);
+    const int64_t now = ioqueue_now();
+
+    ioq->rate_next = INT64_MAX;
+    for (i = 0, k = 0; i < ioq->nheld; i++) {
+        req = &ioq->reqs[ioq->held[i]];
+        /* a cancelled or late request is passed straight on for a thread to complete */
+        wait = 0;
+        if (req->tag != 0 && RING_LOAD(&req->state) == ioqueue_STATE_QUEUED &&
+            (req->deadline == 0 || req->deadline > now)) {
+            /* only pread and pwrite take options, so the length is in bytes */
+            wait = ioqueue_rate_take(&ioq->rate, req->tag, (size_t)req->u.rw.x, now);
+        }
+        if (wait == 0) {
+            ioqueue_request_push(ioq, req);
+            continue;
+        }
+        if (!req->held) {
+            req->held = 1;
+            ioq->stats.throttled++;
         }
+        if (now + wait < ioq->rate_next) {
+            ioq->rate_next = now + wait;
+        }
+        ioq->held[k++] = ioq->held[i];
     }
+    ioq->nheld = k;
+}
 
-    /* wait for at least one request on the queue */
-    while (!queue->size || queue->done == queue->size) {
-        if (!_running) break;
-        queue->wait = 1;
-        pthread_cond_wait(&queue->cond, &queue->lock);
+/* wake parked threads for requests pushed while they were idle */
+static void
+ioqueue_request_kick(ioqueue_t *ioq)
+{
+    unsigned int pending, parked;
+    RING_FENCE();
+    parked = RING_LOAD(&ioq->nparked);
+    if (parked > 0) {
+        pending = ioqueue_request_pending(ioq);
+        if (pending > 0) {
+            ioqueue_futex_wake(&ioq->wake, pending < parked ? pending : parked);
+        }
     }
-    /* return the next request ready for processing */
-    if (_running) {
-        req = &queue->reqs[(queue->head + queue->done) % _backlog];
-    } else {
-        req = NULL;
+}
+
+/* claim the next pushed request of the highest priority, or -1 when there is none */
+static int
+ioqueue_request_claim(ioqueue_t *ioq, unsigned int *id)
+{
+    unsigned int r, head;
+    for (r = 0; r < IOQUEUEMT_NRING; r++) {
+        head = RING_LOAD(&ioq->sq_head[r]);
+        while (head != RING_LOAD(&ioq->sq_tail[r])) {
+            /* the slot cannot be overwritten before head moves past it */
+            *id = __atomic_load_n(&ioq->sq[r][head % ioq->nslot], __ATOMIC_RELAXED);
+            if (__atomic_compare_exchange_n(&ioq->sq_head[r], &head, head + 1, 1,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return 0;
+            }
+        }
     }
+    return -1;
+}
 
-    pthread_mutex_unlock(&queue->lock);
-    return req;
+static int
+ioqueue_request_take(ioqueue_t *ioq, struct ioqueue_worker *worker, struct ioqueue_request *req)
+{
+    unsigned int id;
+    if (worker->head == RING_LOAD(&worker->tail)) {
+        return -1;
+    }
+    /* pop the completed request and free its slot */
+    id = worker->done[worker->head++ % ioq->nslot];
+    *req = ioq->reqs[id];
+    ioq->reqs[id].handle = -1;
+    ioq->free[ioq->nfree++] = id;
+    return 0;
 }
 
+/* a thread has completed a request that is yet to be taken */
 static int
-ioqueue_request_take(struct ioqueue_queue *queue, struct ioqueue_request *req)
-{
-    int ret;
-    pthread_mutex_lock(&queue->lock);
-
-    /* signal when thread is waiting for ready work */
-    if (queue->wait && queue->size != queue->done) {
-        queue->wait = 0;
-        pthread_cond_signal(&queue->cond);
-    }
-
-    /* pop request from the queue */
-    if (queue->done) {
-        ret = 0;
-        *req = queue->reqs[queue->head];
-        queue->head = (queue->head + 1) % _backlog;
-        --queue->done;
-        --queue->size;
-    } else if (queue->size) {
-        ret = (int)queue->size;
-    } else {
-        ret = -1;
+ioqueue_request_ready(ioqueue_t *ioq)
+{
+    unsigned int i;
+    for (i = 0; i < ioq->nworker; i++) {
+        if (ioq->workers[i].head != RING_LOAD(&ioq->workers[i].tail)) {
+            return 1;
+        }
     }
+    return 0;
+}
+
+static void
+ioqueue_request_exec(struct ioqueue_request *req)
+{
+    switch (req->op) {
+    case ioqueue_OP_PREAD:
+        req->u.rw.x = pread(req->fd, req->u.rw.buf, (size_t)req->u.rw.x, req->u.rw.off);
+        break;
+
+    case ioqueue_OP_PWRITE:
+        req->u.rw.x = pwrite(req->fd, req->u.rw.buf, (size_t)req->u.rw.x, req->u.rw.off);
+        break;
+
+    case ioqueue_OP_PREADV:
+        req->u.rw.x = preadv(req->fd, req->u.rw.buf, (int)req->u.rw.x, req->u.rw.off);
+        break;
 
-    pthread_mutex_unlock(&queue->lock);
-    return ret;
+    case ioqueue_OP_PWRITEV:
+        req->u.rw.x = pwritev(req->fd, req->u.rw.buf, (int)req->u.rw.x, req->u.rw.off);
+        break;
+
+    case ioqueue_OP_FSYNC:
+        req->u.rw.x = fsync(req->fd);
+        break;
+
+    case ioqueue_OP_FDATASYNC:
+        req->u.rw.x = fdatasync(req->fd);
+        break;
+
+    default:
+        /* unreachable */
+        abort();
+    }
+    if (req->u.rw.x < 0) {
+        /* save errno */
+        req->u.rw.x = -errno;
+    }
+}
+
+/* retire an idle thread unless the pool is at its minimum */
+static int
+ioqueue_thread_retire(ioqueue_t *ioq)
+{
+    unsigned int live = RING_LOAD(&ioq->nlive);
+    do {
+        if (live <= ioq->min_thread) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&ioq->nlive, &live, live - 1, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+/* signal the eventfd, unless it has been signalled since the last reap */
+static void
+ioqueue_notify(ioqueue_t *ioq)
+{
+    if (ioq->eventfd != -1 && __atomic_exchange_n(&ioq->notify, 0, __ATOMIC_ACQ_REL)) {
+        /* only fails once the counter saturates, which leaves it readable anyway */
+        eventfd_write(ioq->eventfd, 1);
+    }
 }
 
 static void *
 ioqueue_thread_run(void *tdata)
 {
+    int state, idle;
+    unsigned int id, spins, wake;
     struct ioqueue_request *req;
-    struct ioqueue_queue *const queue = &_queues[(int)(unsigned long)tdata];
-
-    req = ioqueue_request_next(queue, 0);
-    while (req) {
-        /* process the request */
-        switch (req->op) {
-        case ioqueue_OP_PREAD:
-            req->u.rw.x = pread(req->fd, req->u.rw.buf, (size_t)req->u.rw.x, req->u.rw.off);
-            break;
+    struct ioqueue_worker *const worker = tdata;
+    ioqueue_t *const ioq = worker->ioq;
+    const struct timespec linger = ioqueue_timespec((int64_t)IOQUEUEMT_IDLE * 1000000);
 
-        case ioqueue_OP_PWRITE:
-            req->u.rw.x = pwrite(req->fd, req->u.rw.buf, (size_t)req->u.rw.x, req->u.rw.off);
-            break;
-
-        default:
-            /* unreachable */
-            abort();
+    for (spins = 0, idle = 0;;) {
+        if (ioqueue_request_claim(ioq, &id) == -1) {
+            if (!RING_LOAD(&ioq->running)) break;
+            if (++spins < ioq->spin) {
+                ioqueue_cpu_relax();
+                continue;
+            }
+            if (idle && ioqueue_thread_retire(ioq)) {
+                /* nothing arrived for a whole idle period, shrink the pool */
+                break;
+            }
+            /* truly idle - park until kicked, or until surplus to the pool */
+            wake = RING_LOAD(&ioq->wake);
+            __atomic_add_fetch(&ioq->nparked, 1, __ATOMIC_SEQ_CST);
+            RING_FENCE();
+            idle = 0;
+            if (ioqueue_request_pending(ioq) == 0 && RING_LOAD(&ioq->running)) {
+                if (RING_LOAD(&ioq->nlive) > ioq->min_thread) {
+                    idle = ioqueue_futex_wait(&ioq->wake, wake, &linger) == -1 && errno == ETIMEDOUT;
+                } else {
+                    ioqueue_futex_wait(&ioq->wake, wake, NULL);
+                }
+            }
+            /* a kick may have counted this thread just as it timed out, so recheck the ring */
+            __atomic_sub_fetch(&ioq->nparked, 1, __ATOMIC_SEQ_CST);
+            RING_FENCE();
+            spins = 0;
+            continue;
         }
-        if (req->u.rw.x < 0) {
-            /* save errno */
-            req->u.rw.x = -errno;
+        spins = 0;
+        idle = 0;
+
+        /* process the request, unless it was withdrawn before a thread got to it */
+        req = &ioq->reqs[id];
+        state = ioqueue_STATE_QUEUED;
+        if (__atomic_compare_exchange_n(&req->state, &state, ioqueue_STATE_RUNNING, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (req->deadline != 0 && ioqueue_now() > req->deadline) {
+                /* too late to be of use, leave the device to requests that still are */
+                req->u.rw.x = -ETIMEDOUT;
+            } else if (req->prio != worker->prio &&
+                       syscall(SYS_ioprio_set, IOQUEUEMT_IOPRIO_WHO_PROCESS, 0, req->prio) == -1) {
+                /* e.g. the real-time class without privileges, which the kernel backends fail too */
+                req->u.rw.x = -errno;
+            } else {
+                /* the kernel now schedules the thread's I/O at the request's priority */
+                worker->prio = req->prio;
+                req->t_dispatch = ioqueue_now();
+                ioqueue_request_exec(req);
+            }
+        } else {
+            req->u.rw.x = -ECANCELED;
         }
 
-        /* pull the next request off the queue */
-        req = ioqueue_request_next(queue, 1);
+        /* publish the completion, then wake the reap if it parked */
+        worker->done[worker->tail % ioq->nslot] = id;
+        RING_STORE(&worker->tail, worker->tail + 1);
+        RING_FENCE();
+        if (RING_LOAD(&ioq->reaping)) {
+            ioqueue_futex_wake(&ioq->reap_wake, 1);
+        }
+        ioqueue_notify(ioq);
     }
 
+    if (RING_LOAD(&ioq->running)) {
+        RING_STORE(&worker->state, ioqueue_WORKER_EXITED);
+    }
     pthread_exit(NULL);
 }
 
+/* start a thread on a free or drained worker, returning 0 or an error number */
+static int
+ioqueue_thread_spawn(ioqueue_t *ioq)
+{
+    int err;
+    unsigned int i;
+    struct ioqueue_worker *worker;
+
+    for (i = 0; i < ioq->nworker; i++) {
+        worker = &ioq->workers[i];
+        if (RING_LOAD(&worker->state) == ioqueue_WORKER_RUNNING) continue;
+        /* a retired thread's completions must be taken before its ring is reused */
+        if (worker->head != RING_LOAD(&worker->tail)) continue;
+        if (worker->state == ioqueue_WORKER_EXITED) {
+            pthread_join(worker->thread, NULL);
+            worker->state = ioqueue_WORKER_NONE;
+        }
+        if (worker->done == NULL) {
+            worker->done = malloc(ioq->nslot * sizeof(unsigned int));
+            if (worker->done == NULL) {
+                return errno;
+            }
+        }
+        worker->ioq = ioq;
+        worker->state = ioqueue_WORKER_RUNNING;
+        __atomic_add_fetch(&ioq->nlive, 1, __ATOMIC_SEQ_CST);
+        err = pthread_create(&worker->thread, &ioq->attr, &ioqueue_thread_run, worker);
+        if (err) {
+            worker->state = ioqueue_WORKER_NONE;
+            __atomic_sub_fetch(&ioq->nlive, 1, __ATOMIC_SEQ_CST);
+        }
+        return err;
+    }
+    return EAGAIN;
+}
+
+/* start threads for requests that the parked threads cannot take, up to the maximum */
 static void
-ioqueue_stop_wait()
+ioqueue_threads_grow(ioqueue_t *ioq)
+{
+    unsigned int pending, idle;
+    if (ioq->min_thread == ioq->nworker) {
+        /* fixed size pool */
+        return;
+    }
+    pending = ioqueue_request_pending(ioq);
+    idle = RING_LOAD(&ioq->nparked);
+    while (pending > idle && RING_LOAD(&ioq->nlive) < ioq->nworker) {
+        if (ioqueue_thread_spawn(ioq)) {
+            /* not fatal, the running threads will get to them */
+            break;
+        }
+        pending--;
+    }
+}
+
+static void
+ioqueue_stop_wait(ioqueue_t *ioq)
 {
     unsigned int i;
     /* flip the switch */
-    _running = 0;
-    /* signal any waiting threads */
-    for (i = 0; i < _nqueue; ++i) {
-        pthread_mutex_lock(&_queues[i].lock);
-        pthread_cond_signal(&_queues[i].cond);
-        pthread_mutex_unlock(&_queues[i].lock);
-    }
+    RING_STORE(&ioq->running, 0);
+    RING_FENCE();
+    /* wake any parked threads */
+    ioqueue_futex_wake(&ioq->wake, ioq->nworker);
     /* wait and cleanup */
-    for (i = 0; i < _nqueue; ++i) {
-        pthread_join(_queues[i].thread, NULL);
-        free(_queues[i].reqs);
+    for (i = 0; i < ioq->nworker; ++i) {
+        if (RING_LOAD(&ioq->workers[i].state) != ioqueue_WORKER_NONE) {
+            pthread_join(ioq->workers[i].thread, NULL);
+            ioq->workers[i].state = ioqueue_WORKER_NONE;
+        }
     }
 }
 
 static int
-ioqueue_threads_start(pthread_attr_t *attr)
+ioqueue_threads_start(ioqueue_t *ioq)
 {
     unsigned int i;
     int err;
-    struct ioqueue_queue *queue;
     /* flip the switch */
-    _running = 1;
+    ioq->running = 1;
     /* create threads */
     err = 0;
-    for (i = 0; i < _nqueue; ++i) {
-        queue = &_queues[i];
-        pthread_mutex_init(&queue->lock, NULL);
-        pthread_cond_init(&queue->cond, NULL);
-        queue->reqs = malloc(_backlog * sizeof(struct ioqueue_request));
-        queue->head = 0;
-        queue->done = 0;
-        queue->size = 0;
-        if (queue->reqs == NULL) {
-            err = errno;
-            break;
-        }
-        err = pthread_create(&queue->thread, attr, &ioqueue_thread_run, (void*)(unsigned long)i);
-        if (err) break;
+    for (i = 0; i < ioq->min_thread && !err; ++i) {
+        err = ioqueue_thread_spawn(ioq);
     }
     if (err) {
         /* an error occurred, exit existing threads */
-        _nqueue = i;
-        ioqueue_stop_wait();
+        ioqueue_stop_wait(ioq);
         errno = err;
         return -1;
     }
+    /* let them park, so none is still starting up to claim the first requests as they are pushed */
+    while (RING_LOAD(&ioq->nparked) < ioq->min_thread) {
+        sched_yield();
+    }
     return 0;
 }
 
-/* initiliaze the io queue to the given maximum outstanding requests */
-int
-ioqueue_init(unsigned int depth)
+/* release the request and thread buffers */
+static void
+ioqueue_free(ioqueue_t *ioq)
+{
+    unsigned int i;
+    if (ioq->workers != NULL) {
+        for (i = 0; i < ioq->nworker; i++) {
+            free(ioq->workers[i].done);
+        }
+    }
+    free(ioq->reqs);
+    free(ioq->free);
+    for (i = 0; i < IOQUEUEMT_NRING; i++) {
+        free(ioq->sq[i]);
+    }
+    free(ioq->workers);
+    free(ioq->held);
+    ioqueue_rate_destroy(&ioq->rate);
+    ioqueue_pool_destroy(&ioq->pool);
+    if (ioq->eventfd != -1) {
+        close(ioq->eventfd);
+    }
+    free(ioq);
+}
+
+/* create an io queue of `depth` outstanding requests served by between `min_threads` and `max_threads` threads */
+ioqueue_t *
+ioqueue_create_threads(unsigned int depth, unsigned int min_threads, unsigned int max_threads, unsigned int backlog)
 {
     int err;
-    pthread_attr_t attr;
-    if (_queues || depth == 0 || depth > INT_MAX) {
+    unsigned int i;
+    ioqueue_t *ioq;
+    if (depth == 0 || depth > INT_MAX || min_threads == 0 || max_threads < min_threads) {
         errno = EINVAL;
-        return -1;
+        return NULL;
     }
-    _backlog = IOQUEUEMT_BACKLOG;
-    _nqueue = depth;
-    _queues = calloc(_nqueue, sizeof(_queues[0]));
-    if (!_queues) {
-        return -1;
+    /* cache line aligned, as the threads share parts of it */
+    err = posix_memalign((void **)&ioq, IOQUEUEMT_CACHELINE, sizeof(ioqueue_t));
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+    memset(ioq, 0, sizeof(ioqueue_t));
+    ioq->eventfd = -1;
+    ioq->nslot = depth;
+    /* no more than `depth` threads can ever be busy */
+    ioq->nworker = max_threads < depth ? max_threads : depth;
+    ioq->min_thread = min_threads < ioq->nworker ? min_threads : ioq->nworker;
+    if (backlog > 0 && (uint64_t)backlog * ioq->nworker < depth) {
+        ioq->backlog = backlog * ioq->nworker;
+    }
+    /* spinning only helps when the pushing thread can run concurrently */
+    ioq->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? IOQUEUEMT_SPIN : 0;
+    err = posix_memalign((void **)&ioq->reqs, IOQUEUEMT_CACHELINE, ioq->nslot * sizeof(ioq->reqs[0]));
+    if (!err) {
+        err = posix_memalign((void **)&ioq->workers, IOQUEUEMT_CACHELINE, ioq->nworker * sizeof(ioq->workers[0]));
+        if (err) {
+            ioq->workers = NULL;
+        }
+    }
+    if (!err) {
+        memset(ioq->workers, 0, ioq->nworker * sizeof(ioq->workers[0]));
+        ioq->free = malloc(ioq->nslot * sizeof(unsigned int));
+        ioq->held = malloc(ioq->nslot * sizeof(unsigned int));
+        if (ioq->free == NULL || ioq->held == NULL) {
+            err = errno;
+        }
+        for (i = 0; i < IOQUEUEMT_NRING && !err; i++) {
+            ioq->sq[i] = malloc(ioq->nslot * sizeof(unsigned int));
+            if (ioq->sq[i] == NULL) {
+                err = errno;
+            }
+        }
     }
-    err = pthread_attr_init(&attr);
     if (err) {
-        free(_queues);
-        _queues = NULL;
+        ioqueue_free(ioq);
         errno = err;
-        return -1;
+        return NULL;
+    }
+    memset(ioq->reqs, 0, ioq->nslot * sizeof(ioq->reqs[0]));
+    /* stack the free slots so the lowest is used first */
+    for (i = 0; i < ioq->nslot; i++) {
+        ioq->reqs[i].handle = -1;
+        ioq->free[i] = ioq->nslot - 1 - i;
     }
-    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    ioq->nfree = ioq->nslot;
+    ioq->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    err = pthread_attr_init(&ioq->attr);
     if (err) {
-        pthread_attr_destroy(&attr);
-        free(_queues);
-        _queues = NULL;
+        ioqueue_free(ioq);
         errno = err;
-        return -1;
+        return NULL;
+    }
+    err = pthread_attr_setdetachstate(&ioq->attr, PTHREAD_CREATE_JOINABLE);
+    if (!err && ioqueue_threads_start(ioq)) {
+        err = errno;
     }
-    err = ioqueue_threads_start(&attr);
-    pthread_attr_destroy(&attr);
     if (err) {
-        free(_queues);
-        _queues = NULL;
+        pthread_attr_destroy(&ioq->attr);
+        ioqueue_free(ioq);
         errno = err;
-        return -1;
+        return NULL;
     }
-    return 0;
+    return ioq;
+}
+
+/* create an io queue with the given maximum outstanding requests, one thread each */
+ioqueue_t *
+ioqueue_create(unsigned int depth)
+{
+    if (depth == 0 || depth > INT_MAX / IOQUEUEMT_BACKLOG) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return ioqueue_create_threads(depth * IOQUEUEMT_BACKLOG, depth, depth, IOQUEUEMT_BACKLOG);
 }
 
 /* retrieve a file descrptor suitable for io readiness notifications via e.g. poll/epoll */
 int
-ioqueue_eventfd()
+ioqueue_ctx_eventfd(ioqueue_t *ioq)
 {
-    errno = ENOTSUP;
-    return -1;
+    if (ioq->eventfd != -1 && !ioq->notifying) {
+        /* start signalling, including for completions already waiting */
+        ioq->notifying = 1;
+        RING_STORE(&ioq->notify, 1);
+        RING_FENCE();
+        if (ioqueue_request_ready(ioq)) {
+            ioqueue_notify(ioq);
+        }
+    }
+    return ioq->eventfd;
 }
 
-static unsigned int _next_queue = 0;
+/* wake the threads for all pushed requests, returning the number submitted */
+static int
+ioqueue_flush(ioqueue_t *ioq)
+{
+    unsigned int n;
+    if (ioq->nheld > 0) {
+        ioqueue_request_release(ioq);
+    }
+    ioqueue_request_kick(ioq);
+    ioqueue_threads_grow(ioq);
+    n = ioq->nwait;
+    if (n > 0) {
+        ioqueue_stats_batch(&ioq->stats, n);
+    }
+    ioq->nwait = 0;
+    return (int)n; // n <= nreqs <= INT_MAX
+}
+
+/* submit the pushed requests early according to the auto-flush policy */
+static void
+ioqueue_autoflush(ioqueue_t *ioq)
+{
+    if ((ioq->flush_batch > 0 && ioq->nwait + ioq->nheld >= ioq->flush_batch) ||
+        (ioq->flush_delay > 0 && ioqueue_now() - ioq->wait_since >= ioq->flush_delay)) {
+        ioqueue_flush(ioq);
+    }
+}
+
+/* enqueue a read or write request, where `len` is the iovec count for vectored ops */
+static int
+ioqueue_request_rw(ioqueue_t *ioq, enum ioqueue_op op, int fd, void *buf, size_t len, off_t offset,
+                   const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_arg)
+{
+    struct ioqueue_request *const req = ioqueue_request_alloc(ioq);
+    if (req == NULL) {
+        ioq->stats.eagain++;
+        return -1;
+    }
+
+    req->op = op;
+    req->fd = fd;
+    req->cb = (ioqueue_cb) cb;
+    req->cb_arg = cb_arg;
+    req->prio = opts != NULL ? opts->prio : 0;
+    req->tag = opts != NULL ? opts->tag : 0;
+    req->held = 0;
+    req->t_submit = ioqueue_now();
+    req->t_dispatch = 0;
+    req->u.rw.buf = buf;
+    req->u.rw.x = (ssize_t)len;
+    req->u.rw.off = offset;
+    req->deadline = 0;
+    if (opts != NULL && opts->timeout_us > 0) {
+        req->deadline = req->t_submit + (int64_t)opts->timeout_us * 1000;
+    }
+    if (req->tag != 0 && ioq->rate.nbucket > 0) {
+        /* queue behind any held requests, so each tag is served in order */
+        ioqueue_request_hold(ioq, req);
+        ioqueue_request_release(ioq);
+    } else if (req->deadline != 0) {
+        /* pushed in deadline order by the next flush */
+        ioqueue_request_hold(ioq, req);
+    } else {
+        ioqueue_request_push(ioq, req);
+    }
+
+    ioq->nreqs++;
+    ioqueue_stats_enqueue(&ioq->stats, ioq->nreqs);
+    ioqueue_autoflush(ioq);
+    return req->handle;
+}
 
 /* enqueue a pread request  */
 int
-ioqueue_pread(int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg)
+ioqueue_ctx_pread(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg)
 {
-    int ret;
-    unsigned int tries;
-    struct ioqueue_request req;
+    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, ioqueue_OP_PREAD, fd, buf, len, offset, NULL, cb, cb_arg);
+}
 
+/* enqueue a pwrite request  */
+int
+ioqueue_ctx_pwrite(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg)
+{
     if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL) {
         errno = EINVAL;
         return -1;
     }
+    return ioqueue_request_rw(ioq, ioqueue_OP_PWRITE, fd, buf, len, offset, NULL, cb, cb_arg);
+}
 
-    req.op = ioqueue_OP_PREAD;
-    req.fd = fd;
-    req.cb = (ioqueue_cb) cb;
-    req.cb_arg = cb_arg;
-    req.u.rw.buf = buf;
-    req.u.rw.x = (ssize_t)len;
-    req.u.rw.off = offset;
+/* enqueue a pread request with options  */
+int
+ioqueue_ctx_pread_ex(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_arg)
+{
+    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL || !ioqueue_opts_valid(opts)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, ioqueue_OP_PREAD, fd, buf, len, offset, opts, cb, cb_arg);
+}
 
-    for (tries = 0; tries < _nqueue; tries ++) {
-        ret = ioqueue_request_push(&_queues[_next_queue], &req);
-        _next_queue = (_next_queue + 1) % _nqueue;
-        if (!ret) return 0;
+/* enqueue a pwrite request with options  */
+int
+ioqueue_ctx_pwrite_ex(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_arg)
+{
+    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL || !ioqueue_opts_valid(opts)) {
+        errno = EINVAL;
+        return -1;
     }
+    return ioqueue_request_rw(ioq, ioqueue_OP_PWRITE, fd, buf, len, offset, opts, cb, cb_arg);
+}
+
+/* hedged reads are not supported, a worker cannot give up on a blocked pread */
+int
+ioqueue_ctx_pread_hedged(ioqueue_t *ioq, const int *fds, int nfd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg)
+{
+    (void)ioq;
+    (void)fds;
+    (void)nfd;
+    (void)buf;
+    (void)len;
+    (void)offset;
+    (void)cb;
+    (void)cb_arg;
+    errno = ENOTSUP;
     return -1;
 }
 
-/* enqueue a pwrite request  */
+/* enqueue a vectored preadv request  */
 int
-ioqueue_pwrite(int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_arg)
+ioqueue_ctx_preadv(ioqueue_t *ioq, int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_arg)
 {
-    int ret;
-    unsigned int tries;
-    struct ioqueue_request req;
+    if (iov == NULL || iovcnt <= 0 || iovcnt > IOV_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, ioqueue_OP_PREADV, fd, (void *)iov, (size_t)iovcnt, offset, NULL, cb, cb_arg);
+}
 
-    if (buf == NULL || len == 0 || len > SSIZE_MAX || cb == NULL) {
+/* enqueue a vectored pwritev request  */
+int
+ioqueue_ctx_pwritev(ioqueue_t *ioq, int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_arg)
+{
+    if (iov == NULL || iovcnt <= 0 || iovcnt > IOV_MAX || cb == NULL) {
         errno = EINVAL;
         return -1;
     }
+    return ioqueue_request_rw(ioq, ioqueue_OP_PWRITEV, fd, (void *)iov, (size_t)iovcnt, offset, NULL, cb, cb_arg);
+}
 
-    req.op = ioqueue_OP_PWRITE;
-    req.fd = fd;
-    req.cb = (ioqueue_cb) cb;
-    req.cb_arg = cb_arg;
-    req.u.rw.buf = buf;
-    req.u.rw.x = (ssize_t)len;
-    req.u.rw.off = offset;
+/* enqueue an fsync request  */
+int
+ioqueue_ctx_fsync(ioqueue_t *ioq, int fd, ioqueue_cb cb, void *cb_arg)
+{
+    if (cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, ioqueue_OP_FSYNC, fd, NULL, 0, 0, NULL, cb, cb_arg);
+}
 
-    for (tries = 0; tries < _nqueue; tries ++) {
-        ret = ioqueue_request_push(&_queues[_next_queue], &req);
-        _next_queue = (_next_queue + 1) % _nqueue;
-        if (!ret) return 0;
+/* enqueue an fdatasync request  */
+int
+ioqueue_ctx_fdatasync(ioqueue_t *ioq, int fd, ioqueue_cb cb, void *cb_arg)
+{
+    if (cb == NULL) {
+        errno = EINVAL;
+        return -1;
     }
-    return -1;
+    return ioqueue_request_rw(ioq, ioqueue_OP_FDATASYNC, fd, NULL, 0, 0, NULL, cb, cb_arg);
 }
 
-/* submit requests and handle completion events */
+/* cancel an outstanding request, its callback runs with ECANCELED */
+int
+ioqueue_ctx_cancel(ioqueue_t *ioq, int handle)
+{
+    int state;
+    struct ioqueue_request *req;
+
+    if (handle < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    req = &ioq->reqs[(unsigned int)handle % ioq->nslot];
+    if (req->handle != handle) {
+        /* stale, or never issued */
+        errno = EINVAL;
+        return -1;
+    }
+    /* claim the request before a thread does, which then skips it */
+    state = ioqueue_STATE_QUEUED;
+    if (!__atomic_compare_exchange_n(&req->state, &state, ioqueue_STATE_CANCELLED, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* already completed, or being processed by a thread */
+        errno = EALREADY;
+        return -1;
+    }
+    return 0;
+}
+
+/* limit the requests tagged `tag` to `bytes` bytes and `ops` requests per second */
+int
+ioqueue_ctx_set_ratelimit(ioqueue_t *ioq, unsigned int tag, uint64_t bytes, uint64_t ops)
+{
+    if (tag == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ioqueue_rate_set(&ioq->rate, tag, bytes, ops) == -1) {
+        return -1;
+    }
+    /* a raised limit may let held requests go at once */
+    if (ioq->nheld > 0) {
+        ioqueue_request_release(ioq);
+    }
+    return 0;
+}
+
+/* submit queued requests without waiting for completions */
 int
-ioqueue_reap(unsigned int min)
+ioqueue_ctx_submit(ioqueue_t *ioq)
 {
-    int r;
-    unsigned int i, m, n;
-    struct ioqueue_request req = {0};
+    return ioqueue_flush(ioq);
+}
 
-    pthread_mutex_lock(&_reap_lock);
+/* submit automatically once `batch` requests wait or the oldest has waited `usec` microseconds */
+int
+ioqueue_ctx_set_autoflush(ioqueue_t *ioq, unsigned int batch, unsigned int usec)
+{
+    ioq->flush_batch = batch;
+    ioq->flush_delay = (int64_t)usec * 1000;
+    ioq->wait_since = ioqueue_now();
+    return 0;
+}
+
+/* the statistics type of an operation */
+static enum ioqueue_stats_op
+ioqueue_stats_op(enum ioqueue_op op)
+{
+    switch (op) {
+    case ioqueue_OP_PREAD:
+    case ioqueue_OP_PREADV:
+        return IOQUEUE_STATS_READ;
+    case ioqueue_OP_PWRITE:
+    case ioqueue_OP_PWRITEV:
+        return IOQUEUE_STATS_WRITE;
+    case ioqueue_OP_FSYNC:
+    case ioqueue_OP_FDATASYNC:
+        return IOQUEUE_STATS_SYNC;
+    default:
+        /* unreachable */
+        abort();
+    }
+}
+
+/* submit requests and handle between `min` and `max` completion events */
+static int
+ioqueue_reap_wait(ioqueue_t *ioq, unsigned int min, unsigned int max, const struct timespec *timeout)
+{
+    int expired, throttled;
+    unsigned int i, n, wake;
+    int64_t deadline = 0, wait;
+    struct timespec left;
+    struct ioqueue_request req;
+
+    expired = ioqueue_timeout_zero(timeout);
+    if (timeout != NULL && !expired) {
+        deadline = ioqueue_deadline(timeout);
+    }
+
+    /* wake the threads for the requests pushed since the last reap */
+    ioqueue_flush(ioq);
 
-    // TODO: clean this up
     n = 0;
-    do {
-        m = n;
-        for (i = 0; i < _nqueue; i++) {
-            do {
-                r = ioqueue_request_take(&_queues[i], &req);
-                if (r == 0) {
-                    /* count the request */
-                    ++m; /* we saw a request */
-                    ++n; /* we took a request */
-
-                    /* release lock and perform callback */
-                    pthread_mutex_unlock(&_reap_lock);
-                    switch (req.op) {
-                    case ioqueue_OP_PREAD:
-                    case ioqueue_OP_PWRITE:
-                        if (req.u.rw.x < 0) {
-                            /* set errno for callback */
-                            errno = (int)-req.u.rw.x;
-                            req.u.rw.x = -1;
-                        }
-                        (* (ioqueue_cb) req.cb)(req.cb_arg, req.u.rw.x, req.u.rw.buf);
-                        break;
-                    default:
-                        /* unreachable */
-                        abort();
-                    }
-                    /* reacquire reap lock */
-                    pthread_mutex_lock(&_reap_lock);
-                } else if (r > 0) {
-                    m += (unsigned int)r; /* we saw `r` requests on the queue */
+    for (;;) {
+        for (i = 0; i < ioq->nworker && n < max; i++) {
+            while (n < max && ioqueue_request_take(ioq, &ioq->workers[i], &req) == 0) {
+                /* count and record the request */
+                ++n;
+                --ioq->nreqs;
+                ioqueue_stats_complete(&ioq->stats, ioqueue_stats_op(req.op), req.t_submit, req.t_dispatch, ioqueue_now());
+                if (req.deadline != 0 && req.t_dispatch == 0 && req.u.rw.x == -ETIMEDOUT) {
+                    ioq->stats.expired++;
                 }
-            } while (r == 0); /* try to take another */
+
+                /* perform callback */
+                if (req.u.rw.x < 0) {
+                    /* set errno for callback */
+                    errno = (int)-req.u.rw.x;
+                    req.u.rw.x = -1;
+                }
+                (* (ioqueue_cb) req.cb)(req.cb_arg, req.u.rw.x, req.u.rw.buf);
+            }
+        }
+        if (n >= min || n == max || expired) {
+            break;
+        }
+        if (ioq->nheld > 0) {
+            /* push what the rate limits now allow */
+            ioqueue_flush(ioq);
+        }
+        /* park until a thread signals a completion, or a held request may be pushed */
+        wake = RING_LOAD(&ioq->reap_wake);
+        RING_STORE(&ioq->reaping, 1);
+        RING_FENCE();
+        if (!ioqueue_request_ready(ioq)) {
+            wait = timeout == NULL ? -1 : ioqueue_remaining(deadline);
+            throttled = 0;
+            if (ioq->nheld > 0 && (wait < 0 || ioqueue_remaining(ioq->rate_next) < wait)) {
+                wait = ioqueue_remaining(ioq->rate_next);
+                throttled = 1;
+            }
+            left = ioqueue_timespec(wait);
+            if (ioqueue_futex_wait(&ioq->reap_wake, wake, wait >= 0 ? &left : NULL) == -1 &&
+                errno == ETIMEDOUT && !throttled) {
+                /* take whatever completed in the meantime, then give up */
+                expired = 1;
+            }
         }
-        if (!m || m < min) {
-            /* there were less requests queued than requested */
-            errno = EINVAL;
-            pthread_mutex_unlock(&_reap_lock);
-            return -1;
-        } else if (n < min && n < m) {
-            /* there is at least one more request enqueued, wait for it */
-            pthread_cond_wait(&_reap_cond, &_reap_lock);
+        RING_STORE(&ioq->reaping, 0);
+    }
+
+    /* re-arm the eventfd, signalling it now for any completions left behind */
+    if (ioq->notifying) {
+        RING_STORE(&ioq->notify, 1);
+        RING_FENCE();
+        if (ioqueue_request_ready(ioq)) {
+            ioqueue_notify(ioq);
         }
-    } while (n < min && n < m);
+    }
 
-    pthread_mutex_unlock(&_reap_lock);
     return (int)n;
 }
 
+/* submit requests and handle completion events */
+int
+ioqueue_ctx_reap(ioqueue_t *ioq, unsigned int min)
+{
+    /* cannot wait for more requests than have been queued */
+    if (!ioq->nreqs || min > ioq->nreqs) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_reap_wait(ioq, min, UINT_MAX, NULL);
+}
+
+/* submit requests and handle between `min` and `max` completion events, waiting at most `timeout` */
+int
+ioqueue_ctx_reap_timeout(ioqueue_t *ioq, unsigned int min, unsigned int max, const struct timespec *timeout)
+{
+    /* cannot wait for more requests than have been queued */
+    if (max == 0 || max < min || min > ioq->nreqs) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_reap_wait(ioq, min, max, timeout);
+}
+
+/* submit requests and handle any completed events without blocking */
+int
+ioqueue_ctx_poll(ioqueue_t *ioq, unsigned int max)
+{
+    const struct timespec zero = { 0, 0 };
+    return ioqueue_ctx_reap_timeout(ioq, 0, max, &zero);
+}
+
+/* copy the statistics recorded since the queue was created or last reset */
+int
+ioqueue_ctx_stats_get(ioqueue_t *ioq, struct ioqueue_stats *stats)
+{
+    *stats = ioq->stats;
+    return 0;
+}
+
+/* clear the recorded statistics */
+int
+ioqueue_ctx_stats_reset(ioqueue_t *ioq)
+{
+    memset(&ioq->stats, 0, sizeof(ioq->stats));
+    return 0;
+}
+
+/* allocate an I/O buffer from the queue's pool */
+void *
+ioqueue_ctx_buf_alloc(ioqueue_t *ioq, size_t len)
+{
+    return ioqueue_pool_alloc(&ioq->pool, len);
+}
+
+/* return an I/O buffer to the queue's pool */
+int
+ioqueue_ctx_buf_free(ioqueue_t *ioq, void *buf)
+{
+    return ioqueue_pool_free(&ioq->pool, buf);
+}
+
+/* read fusing is not supported, each request is submitted as is */
+int
+ioqueue_ctx_set_coalesce(ioqueue_t *ioq, size_t gap, size_t max)
+{
+    (void)ioq;
+    (void)gap;
+    if (max > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* read-ahead is not supported, each pread is run by a worker as it is */
+int
+ioqueue_ctx_set_readahead(ioqueue_t *ioq, int fd, size_t max)
+{
+    (void)ioq;
+    (void)fd;
+    if (max > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* the block cache is not supported */
+int
+ioqueue_ctx_set_cache(ioqueue_t *ioq, size_t block, size_t size)
+{
+    (void)ioq;
+    (void)block;
+    if (size > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* unaligned requests are not bounced, the workers pass them to the kernel as they are */
+int
+ioqueue_ctx_set_align(ioqueue_t *ioq, size_t align)
+{
+    (void)ioq;
+    if (align > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* hedged reads are not supported */
+int
+ioqueue_ctx_set_hedge(ioqueue_t *ioq, double pct, unsigned int min_us)
+{
+    (void)ioq;
+    (void)pct;
+    (void)min_us;
+    errno = ENOTSUP;
+    return -1;
+}
+
+/* splitting is not supported, each request is run whole by one worker */
+int
+ioqueue_ctx_set_split(ioqueue_t *ioq, size_t max)
+{
+    (void)ioq;
+    if (max > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* busy-polling is not supported, completions are signalled by the threads */
+int
+ioqueue_ctx_set_busypoll(ioqueue_t *ioq, unsigned int usec)
+{
+    (void)ioq;
+    if (usec > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
 /* reap all requests and destroy the queue */
 void
-ioqueue_destroy()
+ioqueue_ctx_destroy(ioqueue_t *ioq)
 {
-    while (ioqueue_reap(1) > 0) { }
-    ioqueue_stop_wait();
-    free(_queues);
-    _queues = NULL;
+    while (ioqueue_ctx_reap(ioq, 1) > 0) { }
+    ioqueue_stop_wait(ioq);
+    pthread_attr_destroy(&ioq->attr);
+    ioqueue_free(ioq);
 }
@@ -0,0 +1,230 @@
+#ifndef _ioqueuepriv_H
+#define _ioqueuepriv_H
+
+// ioqueuepriv.h - internal helpers shared by the ioqueue backends
+//
+// Copyright (c) 2015  Jeremy R. Fishman
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the <organization> nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include "ioqueue.h"
+
+#define IOQUEUE_NSEC 1000000000L
+
+/** shared ring accessors **/
+/* load a ring index written by another thread or the kernel */
+#define RING_LOAD(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+/* publish a ring index to another thread or the kernel */
+#define RING_STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+/* order an earlier store before a later load, e.g. before checking for a parked waiter */
+#define RING_FENCE()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* hint to the processor that this is a spin-wait loop */
+#if defined(__x86_64__) || defined(__i386__)
+#define ioqueue_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define ioqueue_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define ioqueue_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* the monotonic clock in nanoseconds */
+static inline int64_t
+ioqueue_now()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (int64_t)tp.tv_sec * IOQUEUE_NSEC + tp.tv_nsec;
+}
+
+/* convert nanoseconds to a timespec */
+static inline struct timespec
+ioqueue_timespec(int64_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ns / IOQUEUE_NSEC);
+    ts.tv_nsec = (long)(ns % IOQUEUE_NSEC);
+    return ts;
+}
+
+/* convert a relative timeout to an absolute monotonic deadline in nanoseconds */
+static inline int64_t
+ioqueue_deadline(const struct timespec *timeout)
+{
+    return ioqueue_now() + (int64_t)timeout->tv_sec * IOQUEUE_NSEC + timeout->tv_nsec;
+}
+
+/* nanoseconds remaining until a deadline, or zero when it has passed */
+static inline int64_t
+ioqueue_remaining(int64_t deadline)
+{
+    int64_t left = deadline - ioqueue_now();
+    return left > 0 ? left : 0;
+}
+
+/* a relative timeout is zero, i.e. do not block */
+static inline int
+ioqueue_timeout_zero(const struct timespec *timeout)
+{
+    return timeout != NULL && timeout->tv_sec == 0 && timeout->tv_nsec == 0;
+}
+
+/**
+ * request handles
+ *   A handle identifies slot `id` of `n` on its `gen`th use, so a stale
+ *   handle only aliases a newer request after INT_MAX / n reuses of the
+ *   same slot.  The slot is recovered as handle % n.
+ */
+static inline int
+ioqueue_handle(unsigned int id, unsigned int n, unsigned int gen)
+{
+    return (int)((gen % ((unsigned int)INT_MAX / n)) * n + id);
+}
+
+/** request options **/
+/* the number of levels within an I/O priority class */
+#define IOQUEUE_PRIO_LEVELS 8
+
+/* the class of an I/O priority */
+static inline int
+ioqueue_prio_class(int prio)
+{
+    return prio >> 13;
+}
+
+/* the options are valid, where NULL selects the defaults */
+static inline int
+ioqueue_opts_valid(const struct ioqueue_opts *opts)
+{
+    if (opts == NULL) return 1;
+    return opts->prio == 0 ||
+           (ioqueue_prio_class(opts->prio) >= IOQUEUE_PRIO_CLASS_RT &&
+            ioqueue_prio_class(opts->prio) <= IOQUEUE_PRIO_CLASS_IDLE &&
+            (opts->prio & ((1 << 13) - 1)) < IOQUEUE_PRIO_LEVELS);
+}
+
+/** queue statistics **/
+/* count an accepted request, with `depth` requests now outstanding */
+static inline void
+ioqueue_stats_enqueue(struct ioqueue_stats *stats, unsigned int depth)
+{
+    stats->enqueued++;
+    stats->depth_sum += depth;
+    if (depth > stats->depth_max) {
+        stats->depth_max = depth;
+    }
+}
+
+/* count a submission of `n` requests to the kernel or worker threads */
+static inline void
+ioqueue_stats_batch(struct ioqueue_stats *stats, unsigned int n)
+{
+    stats->batches++;
+    stats->submitted += n;
+    if (n > stats->batch_max) {
+        stats->batch_max = n;
+    }
+}
+
+/* add a latency to a histogram (ioqueuestats.c) */
+void ioqueue_hist_record(struct ioqueue_hist *hist, int64_t ns);
+
+/* halve the weight of everything a histogram has recorded, so it follows later latencies (ioqueuestats.c) */
+void ioqueue_hist_decay(struct ioqueue_hist *hist);
+
+/* record the latencies of a completed request (ioqueuestats.c) */
+void ioqueue_stats_complete(struct ioqueue_stats *stats, enum ioqueue_stats_op op,
+                            int64_t submit, int64_t dispatch, int64_t complete);
+
+/**
+ * buffer pools
+ *   Buffers are carved from pre-faulted 2MB chunks, backed by hugepages
+ *   where possible, into power-of-two size classes from 4KB to 2MB.  Each
+ *   class keeps a free list threaded through its free buffers.  Larger
+ *   buffers get a chunk of their own, which is unmapped when freed.
+ */
+#define IOQUEUE_POOL_CHUNK      ((size_t)2 << 20)
+#define IOQUEUE_POOL_MIN_SHIFT  12
+#define IOQUEUE_POOL_CLASSES    10
+
+struct ioqueue_pool_chunk {
+    char *base;
+    size_t size;
+    int cls;        /* the size class, or -1 for a single large buffer */
+};
+
+struct ioqueue_pool {
+    void *free[IOQUEUE_POOL_CLASSES];   /* free buffer lists */
+    struct ioqueue_pool_chunk *chunks;  /* mapped chunks sorted by base */
+    unsigned int nchunk;
+    unsigned int maxchunk;
+};
+
+/* allocate a buffer of at least `len` bytes (ioqueuebuf.c) */
+void *ioqueue_pool_alloc(struct ioqueue_pool *pool, size_t len);
+
+/* return a buffer to the pool, failing with EINVAL if it did not come from it (ioqueuebuf.c) */
+int   ioqueue_pool_free(struct ioqueue_pool *pool, void *buf);
+
+/* unmap every chunk of the pool (ioqueuebuf.c) */
+void  ioqueue_pool_destroy(struct ioqueue_pool *pool);
+
+/**
+ * rate limits
+ *   Requests tagged through struct ioqueue_opts draw on the token buckets
+ *   of their tag, one for bytes and one for operations.  Each refills at
+ *   its rate, holding at most IOQUEUE_RATE_BURST worth, and may run into
+ *   debt so that a request larger than the burst still passes.  Requests
+ *   wait while either bucket of their tag is in debt.
+ */
+#define IOQUEUE_RATE_BURST  (IOQUEUE_NSEC / 10)   /* nanoseconds of the rate a bucket holds */
+
+struct ioqueue_bucket {
+    unsigned int tag;
+    uint64_t bytes_rate;    /* bytes per second, or 0 for no limit */
+    uint64_t ops_rate;      /* operations per second, or 0 for no limit */
+    double bytes;           /* tokens, negative when in debt */
+    double ops;
+    int64_t last;           /* when the tokens were last refilled */
+};
+
+struct ioqueue_rate {
+    struct ioqueue_bucket *buckets;
+    unsigned int nbucket;
+    unsigned int maxbucket;
+};
+
+/* set the limits of a tag, 0 for none (ioqueuerate.c) */
+int     ioqueue_rate_set(struct ioqueue_rate *rate, unsigned int tag, uint64_t bytes, uint64_t ops);
+
+/* charge a request of `len` bytes to its tag, returning 0, or the nanoseconds until it may be charged (ioqueuerate.c) */
+int64_t ioqueue_rate_take(struct ioqueue_rate *rate, unsigned int tag, size_t len, int64_t now);
+
+/* release the buckets (ioqueuerate.c) */
+void    ioqueue_rate_destroy(struct ioqueue_rate *rate);
+
+#endif
@@ -0,0 +1,149 @@
+
+// ioqueuerate.c - token bucket rate limits shared by the ioqueue backends
+//
+// Copyright (c) 2015  Jeremy R. Fishman
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the <organization> nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ioqueue.h"
+#include "ioqueuepriv.h"
+
+/* the bucket of a tag, or NULL when it has none */
+static struct ioqueue_bucket *
+ioqueue_rate_find(struct ioqueue_rate *rate, unsigned int tag)
+{
+    unsigned int i;
+    for (i = 0; i < rate->nbucket; i++) {
+        if (rate->buckets[i].tag == tag) {
+            return &rate->buckets[i];
+        }
+    }
+    return NULL;
+}
+
+/* add tokens for the time since the last refill, up to a burst */
+static void
+ioqueue_rate_refill(struct ioqueue_bucket *b, int64_t now)
+{
+    const double elapsed = (double)(now - b->last) / IOQUEUE_NSEC;
+    const double burst = (double)IOQUEUE_RATE_BURST / IOQUEUE_NSEC;
+    b->last = now;
+    if (b->bytes_rate > 0) {
+        b->bytes += elapsed * (double)b->bytes_rate;
+        if (b->bytes > burst * (double)b->bytes_rate) {
+            b->bytes = burst * (double)b->bytes_rate;
+        }
+    }
+    if (b->ops_rate > 0) {
+        b->ops += elapsed * (double)b->ops_rate;
+        if (b->ops > burst * (double)b->ops_rate) {
+            b->ops = burst * (double)b->ops_rate;
+        }
+    }
+}
+
+/* set the limits of a tag, creating its bucket on first use */
+int
+ioqueue_rate_set(struct ioqueue_rate *rate, unsigned int tag, uint64_t bytes, uint64_t ops)
+{
+    unsigned int n;
+    struct ioqueue_bucket *b = ioqueue_rate_find(rate, tag);
+    const int64_t now = ioqueue_now();
+
+    if (b == NULL) {
+        if (bytes == 0 && ops == 0) {
+            return 0;
+        }
+        if (rate->nbucket == rate->maxbucket) {
+            n = rate->maxbucket ? rate->maxbucket * 2 : 4;
+            b = realloc(rate->buckets, n * sizeof(b[0]));
+            if (b == NULL) {
+                return -1;
+            }
+            rate->buckets = b;
+            rate->maxbucket = n;
+        }
+        /* start with a full burst */
+        b = &rate->buckets[rate->nbucket++];
+        memset(b, 0, sizeof(*b));
+        b->tag = tag;
+        b->bytes = (double)bytes * IOQUEUE_RATE_BURST / IOQUEUE_NSEC;
+        b->ops = (double)ops * IOQUEUE_RATE_BURST / IOQUEUE_NSEC;
+    } else {
+        /* settle the tokens earned at the old rates, which the new burst then caps */
+        ioqueue_rate_refill(b, now);
+        if (bytes == 0) {
+            b->bytes = 0;
+        }
+        if (ops == 0) {
+            b->ops = 0;
+        }
+    }
+    b->bytes_rate = bytes;
+    b->ops_rate = ops;
+    b->last = now;
+    ioqueue_rate_refill(b, now);
+    return 0;
+}
+
+/* charge a request of `len` bytes to its tag, returning 0, or the nanoseconds until it may be charged */
+int64_t
+ioqueue_rate_take(struct ioqueue_rate *rate, unsigned int tag, size_t len, int64_t now)
+{
+    double wait = 0, w;
+    struct ioqueue_bucket *const b = ioqueue_rate_find(rate, tag);
+    if (b == NULL) {
+        return 0;
+    }
+    ioqueue_rate_refill(b, now);
+    /* a bucket may run into debt, so one request larger than the burst still passes */
+    if (b->bytes_rate > 0 && b->bytes < 0) {
+        wait = -b->bytes * IOQUEUE_NSEC / (double)b->bytes_rate;
+    }
+    if (b->ops_rate > 0 && b->ops < 0) {
+        w = -b->ops * IOQUEUE_NSEC / (double)b->ops_rate;
+        wait = w > wait ? w : wait;
+    }
+    if (wait > 0) {
+        return (int64_t)wait + 1;
+    }
+    if (b->bytes_rate > 0) {
+        b->bytes -= (double)len;
+    }
+    if (b->ops_rate > 0) {
+        b->ops -= 1;
+    }
+    return 0;
+}
+
+/* release the buckets */
+void
+ioqueue_rate_destroy(struct ioqueue_rate *rate)
+{
+    free(rate->buckets);
+    memset(rate, 0, sizeof(*rate));
+}
@@ -0,0 +1,119 @@
+
+// ioqueuestats.c - latency histograms shared by the ioqueue backends
+//
+// Copyright (c) 2015  Jeremy R. Fishman
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the <organization> nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "ioqueue.h"
+#include "ioqueuepriv.h"
+
+/* the log-linear bucket of a latency: exact below 8ns, then 8 buckets per power of two */
+static unsigned int
+ioqueue_hist_bucket(uint64_t ns)
+{
+    unsigned int e;
+    if (ns < 8) {
+        return (unsigned int)ns;
+    }
+    e = 63 - (unsigned int)__builtin_clzll(ns);
+    if (e > 40) {
+        /* beyond ~18 minutes */
+        return IOQUEUE_HIST_BUCKETS - 1;
+    }
+    return (e - 2) * 8 + (unsigned int)((ns >> (e - 3)) & 7);
+}
+
+/* the largest latency that falls in a bucket */
+static uint64_t
+ioqueue_hist_bucket_max(unsigned int b)
+{
+    unsigned int e;
+    if (b < 8) {
+        return b;
+    }
+    e = b / 8 + 2;
+    return ((uint64_t)(8 + b % 8) << (e - 3)) + ((uint64_t)1 << (e - 3)) - 1;
+}
+
+/* add a latency to a histogram */
+void
+ioqueue_hist_record(struct ioqueue_hist *hist, int64_t ns)
+{
+    const uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+    hist->count++;
+    hist->sum += v;
+    if (v > hist->max) {
+        hist->max = v;
+    }
+    hist->buckets[ioqueue_hist_bucket(v)]++;
+}
+
+/* halve the weight of everything recorded so far, keeping the largest latency seen */
+void
+ioqueue_hist_decay(struct ioqueue_hist *hist)
+{
+    unsigned int b;
+    hist->count = 0;
+    for (b = 0; b < IOQUEUE_HIST_BUCKETS; b++) {
+        hist->buckets[b] /= 2;
+        hist->count += hist->buckets[b];
+    }
+    hist->sum /= 2;
+}
+
+/* the latency in nanoseconds that `pct` percent of a histogram is at or below */
+uint64_t
+ioqueue_hist_percentile(const struct ioqueue_hist *hist, double pct)
+{
+    unsigned int b;
+    uint64_t rank, seen, max;
+    if (hist->count == 0) {
+        return 0;
+    }
+    rank = (uint64_t)((double)hist->count * pct / 100.0 + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (b = 0, seen = 0; b < IOQUEUE_HIST_BUCKETS - 1; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) break;
+    }
+    /* the bucket bound may overshoot the largest recorded value */
+    max = ioqueue_hist_bucket_max(b);
+    return max < hist->max ? max : hist->max;
+}
+
+/* record a completed request, which was never dispatched when `dispatch` is 0 */
+void
+ioqueue_stats_complete(struct ioqueue_stats *stats, enum ioqueue_stats_op op,
+                       int64_t submit, int64_t dispatch, int64_t complete)
+{
+    if (dispatch == 0) {
+        dispatch = complete;
+    }
+    ioqueue_hist_record(&stats->wait[op], dispatch - submit);
+    ioqueue_hist_record(&stats->service[op], complete - dispatch);
+    ioqueue_hist_record(&stats->total[op], complete - submit);
+}
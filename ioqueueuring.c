@@ -0,0 +1,912 @@
+// ioqueueuring.c - Linux io_uring implementation of the ioqueue API
+//
+// Copyright (c) 2015  Jeremy R. Fishman
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the <organization> nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "ioqueue.h"
+#include "ioqueuepriv.h"
+
+/* io_uring syscalls - no wrapper library is required */
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * ioqueue request closure
+ *   Contains reference to the callback, the callback closure, and a
+ *   prepared submission queue entry that is copied into the shared
+ *   ring on submit.  The entry's user_data points back to the request.
+ */
+struct ioqueue_request {
+    ioqueue_cb cb;
+    void *cb_data;
+    unsigned int id;  /* the request slot, ioq->slots[id] == &request */
+    unsigned int gen; /* the number of times the slot has been used */
+    int handle;       /* the request handle, or -1 when free */
+    int64_t t_submit;   /* when the request was enqueued */
+    int64_t t_dispatch; /* when the request was placed on the submission ring, or 0 */
+    struct io_uring_sqe sqe; /* sqe.user_data == (uintptr_t)&request */
+};
+
+/* the user_data of the asynchronous cancel of a request, odd so that it is never a request's address */
+#define IOQUEUE_CANCEL_DATA(handle) ((uint64_t)(unsigned int)(handle) << 1 | 1)
+
+/* submission queue, as mapped from the kernel */
+struct ioqueue_sq {
+    unsigned int *head;
+    unsigned int *tail;
+    unsigned int *mask;
+    unsigned int *array;
+    struct io_uring_sqe *sqes;
+};
+
+/* completion queue, as mapped from the kernel */
+struct ioqueue_cq {
+    unsigned int *head;
+    unsigned int *tail;
+    unsigned int *mask;
+    struct io_uring_cqe *cqes;
+};
+
+/**
+ * ioqueue instance
+ *   Each instance owns an io_uring along with its request buffer; no
+ *   state is shared between instances.
+ */
+struct ioqueue {
+    /* request buffer, when not in-flight
+     *   - the array head is a queue of requests yet to be submitted
+     *   - the array tail is a stack of completed and unused requests
+     */
+    struct ioqueue_request **io_reqs;
+    /* request objects by slot, for resolving handles */
+    struct ioqueue_request **slots;
+    /* io_uring instance and its mappings */
+    int ring;
+    struct ioqueue_sq sq;
+    struct ioqueue_cq cq;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_len;
+    size_t cq_map_len;
+    size_t sqes_len;
+    unsigned int sq_entries; /* submission ring size */
+    unsigned int features;   /* IORING_FEAT_* supported by the kernel */
+    unsigned int ncancel;    /* cancellations whose events are yet to be consumed */
+    int64_t busypoll;        /* nanoseconds to spin before blocking */
+    unsigned int flush_batch;   /* auto-flush once this many requests wait */
+    int64_t flush_delay;        /* auto-flush once the oldest has waited this long */
+    int64_t wait_since;         /* when the oldest waiting request was queued */
+    unsigned int depth;      /* maximum outstanding requests */
+    unsigned int nreqs;      /* allocated request objects */
+    unsigned int nfree;      /* free request stack size */
+    unsigned int nwait;      /* waiting request queue size */
+    int eventfd;             /* eventfd(2) for poll/epoll */
+    struct ioqueue_stats stats;
+    struct ioqueue_pool pool;   /* I/O buffers */
+};
+
+/* release the ring mappings and file descriptor */
+static void ioqueue_ring_close(ioqueue_t *ioq)
+{
+    if (ioq->sq.sqes != NULL && ioq->sq.sqes != MAP_FAILED) {
+        munmap(ioq->sq.sqes, ioq->sqes_len);
+    }
+    if (ioq->cq_map != NULL && ioq->cq_map != MAP_FAILED && ioq->cq_map != ioq->sq_map) {
+        munmap(ioq->cq_map, ioq->cq_map_len);
+    }
+    if (ioq->sq_map != NULL && ioq->sq_map != MAP_FAILED) {
+        munmap(ioq->sq_map, ioq->sq_map_len);
+    }
+    close(ioq->ring);
+    memset(&ioq->sq, 0, sizeof(ioq->sq));
+    memset(&ioq->cq, 0, sizeof(ioq->cq));
+    ioq->sq_map = ioq->cq_map = NULL;
+    ioq->ring = -1;
+}
+
+/* create the ring and map the submission and completion queues */
+static int ioqueue_ring_open(ioqueue_t *ioq, unsigned int depth)
+{
+    unsigned int i;
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    /* a depth beyond the kernel's ring limit gets the largest ring, which submits in turns */
+    p.flags = IORING_SETUP_CLAMP;
+    ioq->ring = io_uring_setup(depth, &p);
+    if (ioq->ring < 0) {
+        return -1;
+    }
+    ioq->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ioq->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        /* both rings share a single mapping */
+        if (ioq->cq_map_len > ioq->sq_map_len) {
+            ioq->sq_map_len = ioq->cq_map_len;
+        }
+        ioq->cq_map_len = ioq->sq_map_len;
+    }
+    ioq->sq_map = mmap(NULL, ioq->sq_map_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ioq->ring, IORING_OFF_SQ_RING);
+    if (ioq->sq_map == MAP_FAILED) {
+        ioqueue_ring_close(ioq);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ioq->cq_map = ioq->sq_map;
+    } else {
+        ioq->cq_map = mmap(NULL, ioq->cq_map_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ioq->ring, IORING_OFF_CQ_RING);
+        if (ioq->cq_map == MAP_FAILED) {
+            ioqueue_ring_close(ioq);
+            return -1;
+        }
+    }
+    ioq->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ioq->sq.sqes = mmap(NULL, ioq->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ioq->ring, IORING_OFF_SQES);
+    if (ioq->sq.sqes == MAP_FAILED) {
+        ioqueue_ring_close(ioq);
+        return -1;
+    }
+    ioq->sq.head  = (unsigned int *)((char *)ioq->sq_map + p.sq_off.head);
+    ioq->sq.tail  = (unsigned int *)((char *)ioq->sq_map + p.sq_off.tail);
+    ioq->sq.mask  = (unsigned int *)((char *)ioq->sq_map + p.sq_off.ring_mask);
+    ioq->sq.array = (unsigned int *)((char *)ioq->sq_map + p.sq_off.array);
+    ioq->cq.head  = (unsigned int *)((char *)ioq->cq_map + p.cq_off.head);
+    ioq->cq.tail  = (unsigned int *)((char *)ioq->cq_map + p.cq_off.tail);
+    ioq->cq.mask  = (unsigned int *)((char *)ioq->cq_map + p.cq_off.ring_mask);
+    ioq->cq.cqes  = (struct io_uring_cqe *)((char *)ioq->cq_map + p.cq_off.cqes);
+    /* the submission index array is an identity map onto the sqes */
+    for (i = 0; i < p.sq_entries; i++) {
+        ioq->sq.array[i] = i;
+    }
+    ioq->sq_entries = p.sq_entries;
+    ioq->features = p.features;
+    return 0;
+}
+
+/* create an io queue with the given maximum outstanding requests */
+ioqueue_t *ioqueue_create(unsigned int depth)
+{
+    ioqueue_t *ioq;
+    if (depth == 0 || depth > INT_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ioq = calloc(1, sizeof(ioqueue_t));
+    if (ioq == NULL) {
+        return NULL;
+    }
+    ioq->io_reqs = malloc((size_t)depth * sizeof(struct ioqueue_request *));
+    if (ioq->io_reqs == NULL) {
+        free(ioq);
+        return NULL;
+    }
+    ioq->slots = malloc((size_t)depth * sizeof(struct ioqueue_request *));
+    if (ioq->slots == NULL) {
+        free(ioq->io_reqs);
+        free(ioq);
+        return NULL;
+    }
+    if (ioqueue_ring_open(ioq, depth) == -1) {
+        free(ioq->io_reqs);
+        free(ioq->slots);
+        free(ioq);
+        return NULL;
+    }
+    ioq->depth = (unsigned int)depth;
+    ioq->nreqs = 0;
+    ioq->nfree = 0;
+    ioq->nwait = 0;
+    ioq->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ioq->eventfd != -1 && io_uring_register(ioq->ring, IORING_REGISTER_EVENTFD, &ioq->eventfd, 1) < 0) {
+        close(ioq->eventfd);
+        ioq->eventfd = -1;
+    }
+    return ioq;
+}
+
+/* create an io queue of `depth` outstanding requests, there are no worker threads to size */
+ioqueue_t *ioqueue_create_threads(unsigned int depth, unsigned int min_threads, unsigned int max_threads, unsigned int backlog)
+{
+    (void)min_threads;
+    (void)max_threads;
+    (void)backlog;
+    return ioqueue_create(depth);
+}
+
+/* retrieve a file descrptor suitable for io readiness notifications via e.g. poll/epoll */
+int ioqueue_ctx_eventfd(ioqueue_t *ioq)
+{
+    return ioq->eventfd;
+}
+
+/* allocate (or retrieve) a request object */
+static struct ioqueue_request * ioqueue_request_alloc(ioqueue_t *ioq)
+{
+    struct ioqueue_request *req;
+    if (ioq->nfree > 0) {
+        /* pop a request from the tail free-stack */
+        req = ioq->io_reqs[ioq->depth - (ioq->nfree--)];
+    } else if (ioq->nreqs < ioq->depth) {
+        /* allocate a new request */
+        req = malloc(sizeof(struct ioqueue_request));
+        if (req == NULL) return NULL;
+        req->id = ioq->nreqs;
+        req->gen = 0;
+        ioq->slots[ioq->nreqs++] = req;
+    } else {
+        /* queue overflow */
+        ioq->stats.eagain++;
+        errno = EAGAIN;
+        return NULL;
+    }
+    /* clear request, set self pointer and issue a new handle */
+    req->cb = NULL;
+    req->cb_data = NULL;
+    memset(&req->sqe, 0, sizeof(struct io_uring_sqe));
+    req->sqe.user_data = (uint64_t)(uintptr_t)req;
+    req->handle = ioqueue_handle(req->id, ioq->depth, req->gen++);
+    req->t_submit = ioqueue_now();
+    req->t_dispatch = 0;
+    /* push onto the head wait-queue */
+    if (ioq->nwait == 0) {
+        ioq->wait_since = req->t_submit;
+    }
+    ioq->io_reqs[ioq->nwait++] = req;
+    ioqueue_stats_enqueue(&ioq->stats, ioq->nreqs - ioq->nfree);
+    return req;
+}
+
+/* free a request */
+static void ioqueue_request_free(ioqueue_t *ioq, struct ioqueue_request *req)
+{
+    /* push onto the tail free-stack */
+    req->handle = -1;
+    ioq->io_reqs[ioq->depth - (++ioq->nfree)] = req;
+}
+
+/* record and run the callback of a request completed at time `now` */
+static void
+ioqueue_request_finish(ioqueue_t *ioq, struct ioqueue_request *const req, int res, int64_t now)
+{
+    ssize_t ret = res;
+    enum ioqueue_stats_op op;
+    switch (req->sqe.opcode) {
+    case IORING_OP_READ:
+    case IORING_OP_READV:
+        op = IOQUEUE_STATS_READ;
+        break;
+    case IORING_OP_WRITE:
+    case IORING_OP_WRITEV:
+        op = IOQUEUE_STATS_WRITE;
+        break;
+    case IORING_OP_FSYNC:
+        op = IOQUEUE_STATS_SYNC;
+        break;
+    default:
+        /* unreachable */
+        abort();
+    }
+    ioqueue_stats_complete(&ioq->stats, op, req->t_submit, req->t_dispatch, now);
+    if (res < 0) {
+        /* set errno for callback */
+        errno = -res;
+        ret = -1;
+    }
+    /* run callback */
+    (* (ioqueue_cb) req->cb)(req->cb_data, ret, (void *)(uintptr_t)req->sqe.addr);
+    /* push free'd request onto tail-stack */
+    ioqueue_request_free(ioq, req);
+}
+
+/* copy the waiting requests into the submission ring, returning the count */
+static unsigned int ioqueue_submit_prepare(ioqueue_t *ioq)
+{
+    unsigned int i, n, tail, head, mask;
+    tail = *ioq->sq.tail;
+    head = RING_LOAD(ioq->sq.head);
+    mask = *ioq->sq.mask;
+    for (i = 0; i < ioq->nwait && tail - head < ioq->sq_entries; i++, tail++) {
+        ioq->sq.sqes[tail & mask] = ioq->io_reqs[i]->sqe;
+    }
+    if (i > 0) {
+        /* stamp and count the dispatched requests */
+        const int64_t now = ioqueue_now();
+        for (n = 0; n < i; n++) {
+            ioq->io_reqs[n]->t_dispatch = now;
+        }
+        ioqueue_stats_batch(&ioq->stats, i);
+    }
+    /* ensure wait-queue occupies the head of the array */
+    memmove(ioq->io_reqs, ioq->io_reqs + i, (size_t)(ioq->nwait - i) * sizeof(ioq->io_reqs[0]));
+    ioq->nwait -= i;
+    RING_STORE(ioq->sq.tail, tail);
+    return tail - head;
+}
+
+/* enter the kernel until `nsub` prepared entries have been submitted */
+static int ioqueue_enter_submit(ioqueue_t *ioq, unsigned int nsub)
+{
+    int ret;
+    while (nsub > 0) {
+        ret = io_uring_enter(ioq->ring, nsub, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        nsub -= (unsigned int)ret; // ret <= nsub
+    }
+    return 0;
+}
+
+/* submit the wait-queue early according to the auto-flush policy */
+static void ioqueue_autoflush(ioqueue_t *ioq)
+{
+    if ((ioq->flush_batch > 0 && ioq->nwait >= ioq->flush_batch) ||
+        (ioq->flush_delay > 0 && ioqueue_now() - ioq->wait_since >= ioq->flush_delay)) {
+        /* on failure the entries remain on the ring until the next reap */
+        ioqueue_enter_submit(ioq, ioqueue_submit_prepare(ioq));
+    }
+}
+
+/* prepare a request, where `len` is the iovec count for vectored ops and `flags` are per-op */
+static int ioqueue_request_rw(ioqueue_t *ioq, unsigned char op, unsigned int flags, int fd, void *buf, size_t len, off_t offset,
+                              const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_data)
+{
+    struct ioqueue_request *const req = ioqueue_request_alloc(ioq);
+    if (req == NULL) return -1;
+
+    req->cb = (ioqueue_cb) cb;
+    req->cb_data = cb_data;
+    req->sqe.opcode = op;
+    req->sqe.fd = fd;
+    req->sqe.addr = (uint64_t)(uintptr_t)buf;
+    req->sqe.len = (unsigned int)len;
+    req->sqe.off = (uint64_t)offset;
+    req->sqe.fsync_flags = flags; /* shares the per-op flags union with rw_flags */
+    req->sqe.ioprio = opts != NULL ? (uint16_t)opts->prio : 0;
+    ioqueue_autoflush(ioq);
+    return req->handle;
+}
+
+/* enqueue a pread request  */
+int ioqueue_ctx_pread(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    if (buf == NULL || len == 0 || len > UINT_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IORING_OP_READ, 0, fd, buf, len, offset, NULL, cb, cb_data);
+}
+
+/* enqueue a pwrite request  */
+int ioqueue_ctx_pwrite(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    if (buf == NULL || len == 0 || len > UINT_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IORING_OP_WRITE, 0, fd, buf, len, offset, NULL, cb, cb_data);
+}
+
+/* enqueue a pread request with options  */
+int ioqueue_ctx_pread_ex(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_data)
+{
+    if (buf == NULL || len == 0 || len > UINT_MAX || cb == NULL || !ioqueue_opts_valid(opts)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (opts != NULL && (opts->timeout_us > 0 || opts->tag != 0)) {
+        /* deadlines and rate limits are not supported */
+        errno = ENOTSUP;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IORING_OP_READ, 0, fd, buf, len, offset, opts, cb, cb_data);
+}
+
+/* enqueue a pwrite request with options  */
+int ioqueue_ctx_pwrite_ex(ioqueue_t *ioq, int fd, void *buf, size_t len, off_t offset, const struct ioqueue_opts *opts, ioqueue_cb cb, void *cb_data)
+{
+    if (buf == NULL || len == 0 || len > UINT_MAX || cb == NULL || !ioqueue_opts_valid(opts)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (opts != NULL && (opts->timeout_us > 0 || opts->tag != 0)) {
+        /* deadlines and rate limits are not supported */
+        errno = ENOTSUP;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IORING_OP_WRITE, 0, fd, buf, len, offset, opts, cb, cb_data);
+}
+
+/* hedged reads are not supported */
+int ioqueue_ctx_pread_hedged(ioqueue_t *ioq, const int *fds, int nfd, void *buf, size_t len, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    (void)ioq;
+    (void)fds;
+    (void)nfd;
+    (void)buf;
+    (void)len;
+    (void)offset;
+    (void)cb;
+    (void)cb_data;
+    errno = ENOTSUP;
+    return -1;
+}
+
+/* enqueue a vectored preadv request  */
+int ioqueue_ctx_preadv(ioqueue_t *ioq, int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    if (iov == NULL || iovcnt <= 0 || iovcnt > IOV_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IORING_OP_READV, 0, fd, (void *)iov, (size_t)iovcnt, offset, NULL, cb, cb_data);
+}
+
+/* enqueue a vectored pwritev request  */
+int ioqueue_ctx_pwritev(ioqueue_t *ioq, int fd, const struct iovec *iov, int iovcnt, off_t offset, ioqueue_cb cb, void *cb_data)
+{
+    if (iov == NULL || iovcnt <= 0 || iovcnt > IOV_MAX || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IORING_OP_WRITEV, 0, fd, (void *)iov, (size_t)iovcnt, offset, NULL, cb, cb_data);
+}
+
+/* enqueue an fsync request  */
+int ioqueue_ctx_fsync(ioqueue_t *ioq, int fd, ioqueue_cb cb, void *cb_data)
+{
+    if (cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IORING_OP_FSYNC, 0, fd, NULL, 0, 0, NULL, cb, cb_data);
+}
+
+/* enqueue an fdatasync request  */
+int ioqueue_ctx_fdatasync(ioqueue_t *ioq, int fd, ioqueue_cb cb, void *cb_data)
+{
+    if (cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_request_rw(ioq, IORING_OP_FSYNC, IORING_FSYNC_DATASYNC, fd, NULL, 0, 0, NULL, cb, cb_data);
+}
+
+/* process at most `max` completion events from the shared ring */
+static int ioqueue_complete(ioqueue_t *ioq, unsigned int max)
+{
+    unsigned int n, head, tail, mask;
+    struct io_uring_cqe *cqe;
+    struct ioqueue_request *req;
+    int res;
+    const int64_t now = ioqueue_now();
+
+    mask = *ioq->cq.mask;
+    for (n = 0, head = *ioq->cq.head, tail = RING_LOAD(ioq->cq.tail); head != tail && n < max; head++) {
+        cqe = &ioq->cq.cqes[head & mask];
+        req = (struct ioqueue_request *)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+        /* release the entry before the callback can enqueue more */
+        RING_STORE(ioq->cq.head, head + 1);
+        if (cqe->user_data & 1) {
+            /* the event of a cancellation, not of a request */
+            ioq->ncancel--;
+            continue;
+        }
+        ioqueue_request_finish(ioq, req, res, now);
+        n++;
+    }
+    return (int)n; // n <= depth <= INT_MAX
+}
+
+/* count the completion events of requests ready on the ring, and of all events in `raw` */
+static unsigned int ioqueue_ready(ioqueue_t *ioq, unsigned int *raw)
+{
+    unsigned int n, head, tail, mask;
+    head = *ioq->cq.head;
+    tail = RING_LOAD(ioq->cq.tail);
+    *raw = tail - head;
+    if (ioq->ncancel == 0) {
+        return *raw;
+    }
+    mask = *ioq->cq.mask;
+    for (n = 0; head != tail; head++) {
+        if (!(ioq->cq.cqes[head & mask].user_data & 1)) n++;
+    }
+    return n;
+}
+
+/* the result of the cancellation with user_data `data` once its event has been posted, or 1 until then */
+static int ioqueue_cancel_result(ioqueue_t *ioq, uint64_t data, unsigned int *raw)
+{
+    unsigned int head, tail, mask;
+    head = *ioq->cq.head;
+    tail = RING_LOAD(ioq->cq.tail);
+    mask = *ioq->cq.mask;
+    *raw = tail - head;
+    for (; head != tail; head++) {
+        if (ioq->cq.cqes[head & mask].user_data == data) {
+            return ioq->cq.cqes[head & mask].res;
+        }
+    }
+    return 1;
+}
+
+/* cancel an outstanding request, its callback runs with ECANCELED */
+int ioqueue_ctx_cancel(ioqueue_t *ioq, int handle)
+{
+    int ret;
+    unsigned int i, head, tail, nsub, raw;
+    struct io_uring_sqe *sqe;
+    struct ioqueue_request *req;
+
+    /* resolve the handle to an outstanding request */
+    if (handle < 0 || (unsigned int)handle % ioq->depth >= ioq->nreqs) {
+        errno = EINVAL;
+        return -1;
+    }
+    req = ioq->slots[(unsigned int)handle % ioq->depth];
+    if (req->handle != handle) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* drop the request from the wait-queue if not yet submitted */
+    for (i = 0; i < ioq->nwait; i++) {
+        if (ioq->io_reqs[i] != req) continue;
+        memmove(ioq->io_reqs + i, ioq->io_reqs + i + 1, (size_t)(ioq->nwait - i - 1) * sizeof(ioq->io_reqs[0]));
+        ioq->nwait--;
+        ioqueue_request_finish(ioq, req, -ECANCELED, ioqueue_now());
+        return 0;
+    }
+    /* otherwise submit an asynchronous cancellation of the request in flight */
+    tail = *ioq->sq.tail;
+    head = RING_LOAD(ioq->sq.head);
+    if (tail - head >= ioq->sq_entries) {
+        errno = EAGAIN;
+        return -1;
+    }
+    sqe = &ioq->sq.sqes[tail & *ioq->sq.mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = req->sqe.user_data;
+    sqe->user_data = IOQUEUE_CANCEL_DATA(handle);
+    RING_STORE(ioq->sq.tail, tail + 1);
+    ioq->ncancel++;
+
+    /* wait for its result, leaving its event and any others on the ring for the next reap */
+    nsub = tail + 1 - head;
+    while ((ret = ioqueue_cancel_result(ioq, IOQUEUE_CANCEL_DATA(handle), &raw)) == 1) {
+        ret = io_uring_enter(ioq->ring, nsub, raw + 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        nsub -= (unsigned int)ret; // ret <= nsub
+    }
+    if (ret == -EALREADY || ret == -ENOENT) {
+        /* the request is running and may complete normally, or has already completed */
+        errno = EALREADY;
+        return -1;
+    } else if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    /* the request completes with ECANCELED */
+    return 0;
+}
+
+/* submit queued requests without waiting for completions */
+int ioqueue_ctx_submit(ioqueue_t *ioq)
+{
+    unsigned int nsub = ioqueue_submit_prepare(ioq);
+    if (ioqueue_enter_submit(ioq, nsub) == -1) {
+        return -1;
+    }
+    return (int)nsub; // nsub <= sq_entries
+}
+
+/* submit automatically once `batch` requests wait or the oldest has waited `usec` microseconds */
+int ioqueue_ctx_set_autoflush(ioqueue_t *ioq, unsigned int batch, unsigned int usec)
+{
+    ioq->flush_batch = batch;
+    ioq->flush_delay = (int64_t)usec * 1000;
+    ioq->wait_since = ioqueue_now();
+    return 0;
+}
+
+/* submit requests, then process between `min` and `max` completion events */
+static int ioqueue_reap_wait(ioqueue_t *ioq, unsigned int min, unsigned int max, const struct timespec *timeout)
+{
+    int ret;
+    unsigned int nsub, ready, raw, flags;
+    int64_t deadline = 0, spin;
+    int expired = ioqueue_timeout_zero(timeout);
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    if (timeout != NULL && !expired) {
+        deadline = ioqueue_deadline(timeout);
+    }
+
+    /* move the waiting requests onto the submission ring */
+    nsub = ioqueue_submit_prepare(ioq);
+
+    /* optionally submit, then spin on the ring before blocking in the kernel */
+    ready = ioqueue_ready(ioq, &raw);
+    if (ready < min && ioq->busypoll > 0 && !expired) {
+        if (ioqueue_enter_submit(ioq, nsub) == -1) {
+            return -1;
+        }
+        nsub = 0;
+        spin = ioqueue_now() + ioq->busypoll;
+        if (timeout != NULL && deadline < spin) {
+            spin = deadline;
+        }
+        do {
+            ioqueue_cpu_relax();
+            ready = ioqueue_ready(ioq, &raw);
+        } while (ready < min && ioqueue_now() < spin);
+    }
+
+    /* only enter the kernel to submit, or to block for missing completions */
+    while (nsub > 0 || (ready < min && !expired)) {
+        flags = 0;
+        if (ready < min && !expired) {
+            flags = IORING_ENTER_GETEVENTS;
+            if (timeout != NULL) {
+                /* bound the wait by the time remaining */
+                struct timespec left = ioqueue_timespec(ioqueue_remaining(deadline));
+                ts.tv_sec = left.tv_sec;
+                ts.tv_nsec = left.tv_nsec;
+                memset(&arg, 0, sizeof(arg));
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+                flags |= IORING_ENTER_EXT_ARG;
+            }
+        }
+        /* the kernel also counts the events of cancellations towards `min` */
+        ret = io_uring_enter(ioq->ring, nsub, min + (raw - ready), flags,
+                             flags & IORING_ENTER_EXT_ARG ? &arg : NULL,
+                             flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ETIME) {
+                expired = 1;
+                continue;
+            }
+            return -1;
+        }
+        nsub -= (unsigned int)ret; // ret <= nsub
+        ready = ioqueue_ready(ioq, &raw);
+        if (timeout != NULL && !expired && ready < min && ioqueue_remaining(deadline) == 0) {
+            expired = 1;
+        }
+    }
+
+    /* finish the reaped requests and return the count */
+    return ioqueue_complete(ioq, max);
+}
+
+/* submit requests and handle completion events */
+int ioqueue_ctx_reap(ioqueue_t *ioq, unsigned int min)
+{
+    /* cannot wait for more requests than have been allocated */
+    if (ioq->nfree == ioq->nreqs || min > ioq->nreqs - ioq->nfree) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ioqueue_reap_wait(ioq, min, ioq->depth, NULL);
+}
+
+/* submit requests and handle between `min` and `max` completion events, waiting at most `timeout` */
+int ioqueue_ctx_reap_timeout(ioqueue_t *ioq, unsigned int min, unsigned int max, const struct timespec *timeout)
+{
+    /* cannot wait for more requests than have been allocated */
+    if (max == 0 || max < min || min > ioq->nreqs - ioq->nfree) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* a bounded wait requires IORING_ENTER_EXT_ARG (Linux 5.11) */
+    if (timeout != NULL && !ioqueue_timeout_zero(timeout) && min > 0 && !(ioq->features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return ioqueue_reap_wait(ioq, min, max, timeout);
+}
+
+/* submit requests and handle any completed events without blocking */
+int ioqueue_ctx_poll(ioqueue_t *ioq, unsigned int max)
+{
+    const struct timespec zero = { 0, 0 };
+    return ioqueue_ctx_reap_timeout(ioq, 0, max, &zero);
+}
+
+/* copy the statistics recorded since the queue was created or last reset */
+int ioqueue_ctx_stats_get(ioqueue_t *ioq, struct ioqueue_stats *stats)
+{
+    *stats = ioq->stats;
+    return 0;
+}
+
+/* clear the recorded statistics */
+int ioqueue_ctx_stats_reset(ioqueue_t *ioq)
+{
+    memset(&ioq->stats, 0, sizeof(ioq->stats));
+    return 0;
+}
+
+/* allocate an I/O buffer from the queue's pool */
+void *ioqueue_ctx_buf_alloc(ioqueue_t *ioq, size_t len)
+{
+    return ioqueue_pool_alloc(&ioq->pool, len);
+}
+
+/* return an I/O buffer to the queue's pool */
+int ioqueue_ctx_buf_free(ioqueue_t *ioq, void *buf)
+{
+    return ioqueue_pool_free(&ioq->pool, buf);
+}
+
+/* rate limits are not supported, each request is submitted as soon as it is flushed */
+int ioqueue_ctx_set_ratelimit(ioqueue_t *ioq, unsigned int tag, uint64_t bytes, uint64_t ops)
+{
+    (void)ioq;
+    if (tag == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bytes > 0 || ops > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* read fusing is not supported, each request is submitted as is */
+int ioqueue_ctx_set_coalesce(ioqueue_t *ioq, size_t gap, size_t max)
+{
+    (void)ioq;
+    (void)gap;
+    if (max > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* read-ahead is not supported */
+int ioqueue_ctx_set_readahead(ioqueue_t *ioq, int fd, size_t max)
+{
+    (void)ioq;
+    (void)fd;
+    if (max > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* the block cache is not supported */
+int ioqueue_ctx_set_cache(ioqueue_t *ioq, size_t block, size_t size)
+{
+    (void)ioq;
+    (void)block;
+    if (size > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* unaligned requests are not bounced */
+int ioqueue_ctx_set_align(ioqueue_t *ioq, size_t align)
+{
+    (void)ioq;
+    if (align > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* hedged reads are not supported */
+int ioqueue_ctx_set_hedge(ioqueue_t *ioq, double pct, unsigned int min_us)
+{
+    (void)ioq;
+    (void)pct;
+    (void)min_us;
+    errno = ENOTSUP;
+    return -1;
+}
+
+/* splitting is not supported */
+int ioqueue_ctx_set_split(ioqueue_t *ioq, size_t max)
+{
+    (void)ioq;
+    if (max > 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+/* spin for completions on the shared ring before blocking in a reap */
+int ioqueue_ctx_set_busypoll(ioqueue_t *ioq, unsigned int usec)
+{
+    ioq->busypoll = (int64_t)usec * 1000;
+    return 0;
+}
+
+/* reap all requests and destroy the queue */
+void ioqueue_ctx_destroy(ioqueue_t *ioq)
+{
+    while (ioq->nfree != ioq->nreqs) {
+        /* assume latency matters -- block for requests one at a time */
+        ioqueue_ctx_reap(ioq, 1);
+    }
+    while (ioq->nfree > 0) {
+        free(ioq->io_reqs[ioq->depth - ioq->nfree]);
+        ioq->io_reqs[ioq->depth - ioq->nfree] = 0;
+        ioq->nfree--;
+        ioq->nreqs--;
+    }
+    free(ioq->io_reqs);
+    free(ioq->slots);
+    ioqueue_ring_close(ioq);
+    if (ioq->eventfd != -1) {
+        close(ioq->eventfd);
+    }
+    ioqueue_pool_destroy(&ioq->pool);
+    free(ioq);
+}
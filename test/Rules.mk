@@ -14,3 +14,9 @@ SRCS += ioqueuemt.t.cc
 
 $(call depends,ioqueuemt.t,../libioqueuemt.a)
 $(call test,ioqueuemt.t)
+
+TGTS += ioqueueuring.t
+SRCS += ioqueueuring.t.cc
+
+$(call depends,ioqueueuring.t,../libioqueueuring.a)
+$(call test,ioqueueuring.t)
@@ -2,6 +2,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -21,6 +23,14 @@
 #define HAVE_EVENTFD 1
 #endif
 
+#ifndef HAVE_BUSYPOLL
+#define HAVE_BUSYPOLL 1
+#endif
+
+#ifndef HAVE_THREADS
+#define HAVE_THREADS 0
+#endif
+
 TEST(TEST_NAME(InitTest), InitTest) {
     ASSERT_EQ(-1, ioqueue_init(0)) << "ioqueue_init: " << strerror(errno);
     ASSERT_EQ(-1, ioqueue_init(UINT_MAX)) << "ioqueue_init: " << strerror(errno);
@@ -41,6 +51,23 @@ TEST(TEST_NAME(InitTest), InitTest) {
     ioqueue_destroy();
 }
 
+TEST(TEST_NAME(InitTest), CreateTest) {
+    errno = 0;
+    ASSERT_EQ((ioqueue_t *)NULL, ioqueue_create(0));
+    ASSERT_EQ(EINVAL, errno);
+    ioqueue_t *const a = ioqueue_create(4);
+    ASSERT_NE((ioqueue_t *)NULL, a) << "ioqueue_create: " << strerror(errno);
+    ioqueue_t *const b = ioqueue_create(4);
+    ASSERT_NE((ioqueue_t *)NULL, b) << "ioqueue_create: " << strerror(errno);
+#if HAVE_EVENTFD
+    EXPECT_NE(ioqueue_ctx_eventfd(a), ioqueue_ctx_eventfd(b));
+#endif
+    EXPECT_EQ(-1, ioqueue_ctx_reap(a, 1));
+    EXPECT_EQ(-1, ioqueue_ctx_reap(b, 1));
+    ioqueue_ctx_destroy(a);
+    ioqueue_ctx_destroy(b);
+}
+
 static const int BUFSIZE = 4096;
 
 class TEST_NAME(TestClass) : public ::testing::Test {
@@ -53,6 +80,7 @@ class TEST_NAME(TestClass) : public ::testing::Test {
         ASSERT_EQ(0, posix_memalign((void **)&buf_, 512, BUFSIZE)) << "posix_memalign: " << strerror(errno);
         memset(buf_, 0, BUFSIZE);
         res_ = 0;
+        cbuf_ = NULL;
         err_ = 0;
         // initialize the ioqueue library
         ASSERT_EQ(0, ioqueue_init(DEPTH)) << "ioqueue_init: " << strerror(errno);
@@ -79,6 +107,7 @@ class TEST_NAME(TestClass) : public ::testing::Test {
         ASSERT_NE((void*)NULL, buf);
         TEST_NAME(TestClass) *const self = (TEST_NAME(TestClass) *) arg;
         self->res_ = res;
+        self->cbuf_ = buf;
         if (res < 0) {
             self->err_ = errno;
         } else {
@@ -86,10 +115,18 @@ class TEST_NAME(TestClass) : public ::testing::Test {
         }
     }
 
+    static void SyncCallback(void *arg, ssize_t res, void *buf) {
+        ASSERT_EQ((void*)NULL, buf);
+        TEST_NAME(TestClass) *const self = (TEST_NAME(TestClass) *) arg;
+        self->res_ = res;
+        self->err_ = res < 0 ? errno : 0;
+    }
+
     int fd_;
     char path_[256];
     char *buf_;
     ssize_t res_;
+    void *cbuf_;
     int err_;
 };
 
@@ -99,14 +136,14 @@ TEST_F(TEST_NAME(TestClass), ReadTest) {
 
     res_ = 0;
     memset(buf_, 0, BUFSIZE);
-    ASSERT_EQ(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this)) << "ioqueue_pread: " << strerror(errno);
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this)) << "ioqueue_pread: " << strerror(errno);
     ASSERT_EQ(1, ioqueue_reap(1));
     ASSERT_EQ(512, res_);
     ASSERT_EQ(0, memcmp(buf_, buf_ + 1024, 512));
 
     res_ = 0;
     memset(buf_, 0, BUFSIZE);
-    ASSERT_EQ(0, ioqueue_pread(fd_, buf_, 512, 512, &Callback, this));
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 512, &Callback, this));
     ASSERT_EQ(1, ioqueue_reap(1));
     ASSERT_EQ(512, res_);
     ASSERT_EQ(1, buf_[0]);
@@ -116,7 +153,7 @@ TEST_F(TEST_NAME(TestClass), ReadTest) {
 TEST_F(TEST_NAME(TestClass), WriteTest) {
     res_ = 0;
     buf_[250] = 1;
-    ASSERT_EQ(0, ioqueue_pwrite(fd_, buf_, BUFSIZE, 0, &Callback, this));
+    ASSERT_LE(0, ioqueue_pwrite(fd_, buf_, BUFSIZE, 0, &Callback, this));
     ASSERT_EQ(1, ioqueue_reap(1));
     ASSERT_EQ(BUFSIZE, res_);
 
@@ -125,12 +162,1073 @@ TEST_F(TEST_NAME(TestClass), WriteTest) {
     ASSERT_EQ(1, buf_[250]);
 }
 
+TEST_F(TEST_NAME(TestClass), VectorTest)
+{
+    struct iovec iov[2];
+    memset(buf_, 1, 512);
+    memset(buf_ + 512, 2, 512);
+    iov[0].iov_base = buf_ + 512;
+    iov[0].iov_len = 512;
+    iov[1].iov_base = buf_;
+    iov[1].iov_len = 512;
+    ASSERT_LE(0, ioqueue_pwritev(fd_, iov, 2, 0, &Callback, this)) << "ioqueue_pwritev: " << strerror(errno);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(1024, res_);
+    ASSERT_EQ((void *)iov, cbuf_);
+
+    memset(buf_, 0, BUFSIZE);
+    iov[0].iov_base = buf_ + 2048;
+    iov[1].iov_base = buf_ + 1024;
+    ASSERT_LE(0, ioqueue_preadv(fd_, iov, 2, 0, &Callback, this)) << "ioqueue_preadv: " << strerror(errno);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(1024, res_);
+    ASSERT_EQ((void *)iov, cbuf_);
+    ASSERT_EQ(2, buf_[2048]);
+    ASSERT_EQ(2, buf_[2048 + 511]);
+    ASSERT_EQ(1, buf_[1024]);
+    ASSERT_EQ(1, buf_[1024 + 511]);
+
+    ASSERT_EQ(-1, ioqueue_preadv(fd_, NULL, 2, 0, &Callback, this));
+    ASSERT_EQ(-1, ioqueue_preadv(fd_, iov, 0, 0, &Callback, this));
+    ASSERT_EQ(-1, ioqueue_pwritev(fd_, iov, -1, 0, &Callback, this));
+    ASSERT_EQ(-1, ioqueue_pwritev(fd_, iov, 2, 0, NULL, this));
+}
+
+TEST_F(TEST_NAME(TestClass), SyncTest)
+{
+    buf_[0] = 1;
+    ASSERT_LE(0, ioqueue_pwrite(fd_, buf_, BUFSIZE, 0, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(BUFSIZE, res_);
+
+    res_ = -1;
+    ASSERT_LE(0, ioqueue_fdatasync(fd_, &SyncCallback, this)) << "ioqueue_fdatasync: " << strerror(errno);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(0, res_) << strerror(err_);
+
+    res_ = -1;
+    ASSERT_LE(0, ioqueue_fsync(fd_, &SyncCallback, this)) << "ioqueue_fsync: " << strerror(errno);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(0, res_) << strerror(err_);
+
+    res_ = 0;
+    ASSERT_LE(0, ioqueue_fsync(-1, &SyncCallback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(-1, res_);
+    ASSERT_EQ(EBADF, err_);
+
+    ASSERT_EQ(-1, ioqueue_fsync(fd_, NULL, this));
+    ASSERT_EQ(-1, ioqueue_fdatasync(fd_, NULL, this));
+}
+
+TEST_F(TEST_NAME(TestClass), TimeoutReapTest)
+{
+    const struct timespec zero = { 0, 0 };
+    const struct timespec second = { 1, 0 };
+
+    // nothing outstanding is not an error for a bounded reap
+    ASSERT_EQ(0, ioqueue_poll(1));
+    ASSERT_EQ(0, ioqueue_reap_timeout(0, 1, &zero));
+    ASSERT_EQ(-1, ioqueue_reap_timeout(1, 1, &zero));
+    ASSERT_EQ(-1, ioqueue_poll(0));
+
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    for (int i = 0; i < 4; i++) {
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this));
+    }
+    ASSERT_EQ(-1, ioqueue_reap_timeout(2, 1, NULL));
+    ASSERT_EQ(-1, ioqueue_reap_timeout(5, 5, NULL));
+
+    // never more than `max` completions per call, and at least `min` within the timeout
+    int n = ioqueue_poll(1);
+    ASSERT_LE(0, n) << "ioqueue_poll: " << strerror(errno);
+    ASSERT_GE(1, n);
+    int ret = ioqueue_reap_timeout(1, 1, &second);
+    ASSERT_EQ(1, ret) << "ioqueue_reap_timeout: " << strerror(errno);
+    n += ret;
+    ret = ioqueue_reap_timeout(4 - n, 4 - n, NULL);
+    ASSERT_EQ(4 - n, ret) << "ioqueue_reap_timeout: " << strerror(errno);
+    ASSERT_EQ(512, res_);
+    ASSERT_EQ(0, ioqueue_poll(4));
+}
+
+TEST_F(TEST_NAME(TestClass), ManyReapTest)
+{
+    // cycle through the completion ring several times
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    for (int i = 0; i < 16 * DEPTH; i++) {
+        res_ = 0;
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this));
+        if (i % 2) {
+            ASSERT_LE(0, ioqueue_pread(fd_, buf_ + 512, 512, 512, &Callback, this));
+            ASSERT_EQ(2, ioqueue_reap(2));
+        } else {
+            ASSERT_EQ(1, ioqueue_reap(1));
+        }
+        ASSERT_EQ(512, res_);
+    }
+}
+
+TEST_F(TEST_NAME(TestClass), BusyPollTest)
+{
+    ASSERT_EQ(0, ioqueue_set_busypoll(0));
+#if HAVE_BUSYPOLL
+    ASSERT_EQ(0, ioqueue_set_busypoll(1000)) << "ioqueue_set_busypoll: " << strerror(errno);
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    for (int i = 0; i < DEPTH; i++) {
+        res_ = 0;
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this));
+        ASSERT_EQ(1, ioqueue_reap(1));
+        ASSERT_EQ(512, res_);
+    }
+    ASSERT_EQ(0, ioqueue_set_busypoll(0));
+#else
+    ASSERT_EQ(-1, ioqueue_set_busypoll(1000));
+#endif
+}
+
+TEST_F(TEST_NAME(TestClass), SubmitTest)
+{
+    ASSERT_EQ(0, ioqueue_submit());
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this));
+    ASSERT_EQ(1, ioqueue_submit()) << "ioqueue_submit: " << strerror(errno);
+    ASSERT_EQ(0, ioqueue_submit());
+    ASSERT_EQ(1, ioqueue_reap(1));
+
+    ASSERT_EQ(0, ioqueue_set_autoflush(2, 0));
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this));
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this));
+    // the second request flushed both without a reap
+    ASSERT_EQ(0, ioqueue_submit());
+#if HAVE_EVENTFD
+    struct pollfd pfd = { ioqueue_eventfd(), POLLIN, 0 };
+    EXPECT_EQ(1, poll(&pfd, 1, 1000));
+#endif
+    ASSERT_EQ(2, ioqueue_reap(2));
+    ASSERT_EQ(0, ioqueue_set_autoflush(0, 0));
+}
+
+TEST_F(TEST_NAME(TestClass), EventFdTest)
+{
+#if HAVE_EVENTFD
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    const int efd = ioqueue_eventfd();
+    ASSERT_NE(-1, efd);
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < DEPTH; i++) {
+            ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this));
+        }
+        ASSERT_EQ((int)DEPTH, ioqueue_submit());
+        // drive the queue from readiness alone, as an event loop would
+        for (int done = 0, n; done < DEPTH; done += n) {
+            struct pollfd pfd = { efd, POLLIN, 0 };
+            ASSERT_EQ(1, poll(&pfd, 1, 1000)) << DEPTH - done << " requests outstanding";
+            uint64_t count;
+            ASSERT_EQ((ssize_t)sizeof(count), read(efd, &count, sizeof(count)));
+            ASSERT_LE(0, n = ioqueue_poll(DEPTH)) << "ioqueue_poll: " << strerror(errno);
+        }
+        ASSERT_EQ(512, res_);
+    }
+#endif
+}
+
+TEST_F(TEST_NAME(TestClass), CancelTest)
+{
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    EXPECT_EQ(-1, ioqueue_cancel(-1));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ(-1, ioqueue_cancel(0));
+    EXPECT_EQ(EINVAL, errno);
+
+    // a request that has not been started completes with ECANCELED
+    const int handle = ioqueue_pread(fd_, buf_, 512, 0, &Callback, this);
+    ASSERT_LE(0, handle) << "ioqueue_pread: " << strerror(errno);
+    if (ioqueue_cancel(handle) == 0) {
+        if (res_ == 0) {
+            // the callback is deferred to the reap
+            ASSERT_EQ(1, ioqueue_reap(1));
+        }
+        EXPECT_EQ(-1, res_);
+        EXPECT_EQ(ECANCELED, err_);
+    } else {
+        // a worker thread got to it first
+        EXPECT_EQ(EALREADY, errno);
+        ASSERT_EQ(1, ioqueue_reap(1));
+        EXPECT_EQ(512, res_);
+    }
+    // the handle is stale once the callback has run
+    EXPECT_EQ(-1, ioqueue_cancel(handle));
+    EXPECT_EQ(EINVAL, errno);
+
+    // a request in flight either completes or is cancelled, but exactly once
+    res_ = 0;
+    const int other = ioqueue_pread(fd_, buf_, 512, 0, &Callback, this);
+    ASSERT_LE(0, other);
+    EXPECT_NE(handle, other);
+    ASSERT_EQ(1, ioqueue_submit());
+    const int cancelled = ioqueue_cancel(other);
+    const int err = errno;
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_TRUE(res_ == 512 || (res_ == -1 && err_ == ECANCELED)) << res_;
+    if (cancelled == 0) {
+        EXPECT_EQ(-1, res_);
+    } else {
+        // it had completed, or could not be stopped
+        EXPECT_EQ(EALREADY, err);
+    }
+    EXPECT_EQ(-1, ioqueue_reap(1));
+}
+
+TEST_F(TEST_NAME(TestClass), StatsTest)
+{
+    struct ioqueue_stats stats;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(0u, stats.enqueued);
+
+    for (int i = 0; i < DEPTH; i++) {
+        ASSERT_LE(0, ioqueue_pwrite(fd_, buf_, 512, i * 512, &Callback, this));
+    }
+    ASSERT_EQ(-1, ioqueue_pwrite(fd_, buf_, 512, 0, &Callback, this));
+    ASSERT_EQ((int)DEPTH, ioqueue_reap(DEPTH));
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this));
+    ASSERT_LE(0, ioqueue_fsync(fd_, &SyncCallback, this));
+    ASSERT_EQ(2, ioqueue_reap(2));
+
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(DEPTH + 2u, stats.enqueued);
+    EXPECT_EQ((uint64_t)DEPTH, stats.depth_max);
+    EXPECT_EQ(DEPTH + 2u, stats.submitted);
+    EXPECT_LE(1u, stats.batches);
+    EXPECT_LE(stats.batch_max, (uint64_t)DEPTH);
+    EXPECT_EQ(1u, stats.eagain);
+    EXPECT_EQ((uint64_t)DEPTH, stats.total[IOQUEUE_STATS_WRITE].count);
+    EXPECT_EQ(1u, stats.total[IOQUEUE_STATS_READ].count);
+    EXPECT_EQ(1u, stats.total[IOQUEUE_STATS_SYNC].count);
+    for (int op = 0; op < IOQUEUE_STATS_NOPS; op++) {
+        // each phase is measured between the same timestamps
+        EXPECT_EQ(stats.total[op].sum, stats.wait[op].sum + stats.service[op].sum);
+        EXPECT_EQ(stats.total[op].max, ioqueue_hist_percentile(&stats.total[op], 100));
+        EXPECT_LE(ioqueue_hist_percentile(&stats.total[op], 50), ioqueue_hist_percentile(&stats.total[op], 99));
+    }
+    // a percentile is within a bucket (12.5%) of a recorded value
+    const uint64_t p50 = ioqueue_hist_percentile(&stats.total[IOQUEUE_STATS_READ], 50);
+    EXPECT_LE(stats.total[IOQUEUE_STATS_READ].max - stats.total[IOQUEUE_STATS_READ].max / 8, p50);
+
+    ASSERT_EQ(0, ioqueue_stats_reset());
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(0u, stats.enqueued);
+    EXPECT_EQ(0u, stats.total[IOQUEUE_STATS_WRITE].count);
+    EXPECT_EQ(0u, ioqueue_hist_percentile(&stats.total[IOQUEUE_STATS_WRITE], 99));
+}
+
+TEST_F(TEST_NAME(TestClass), BufTest)
+{
+    char *const a = (char *)ioqueue_buf_alloc(512);
+    ASSERT_NE((char *)NULL, a) << "ioqueue_buf_alloc: " << strerror(errno);
+    EXPECT_EQ(0u, (uintptr_t)a % 4096);
+    // the buffer is suitable for direct I/O
+    memset(a, 7, 512);
+    ASSERT_LE(0, ioqueue_pwrite(fd_, a, 512, 0, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(512, res_);
+    char *const b = (char *)ioqueue_buf_alloc(BUFSIZE);
+    ASSERT_NE((char *)NULL, b) << "ioqueue_buf_alloc: " << strerror(errno);
+    EXPECT_NE(a, b);
+    ASSERT_LE(0, ioqueue_pread(fd_, b, 512, 0, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(0, memcmp(a, b, 512));
+
+    // freed buffers are reused
+    EXPECT_EQ(0, ioqueue_buf_free(b));
+    EXPECT_EQ(b, ioqueue_buf_alloc(4000));
+    EXPECT_EQ(0, ioqueue_buf_free(b));
+    EXPECT_EQ(0, ioqueue_buf_free(a));
+
+    // large buffers, beyond the largest size class
+    char *const c = (char *)ioqueue_buf_alloc(3 << 20);
+    ASSERT_NE((char *)NULL, c) << "ioqueue_buf_alloc: " << strerror(errno);
+    EXPECT_EQ(0u, (uintptr_t)c % 4096);
+    c[(3 << 20) - 1] = 1;
+    EXPECT_EQ(-1, ioqueue_buf_free(c + 4096));
+    EXPECT_EQ(0, ioqueue_buf_free(c));
+
+    EXPECT_EQ(0, ioqueue_buf_free(NULL));
+    EXPECT_EQ(-1, ioqueue_buf_free(buf_));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ((void *)NULL, ioqueue_buf_alloc(0));
+}
+
+#if HAVE_KAIO
+static void CountCallback(void *arg, ssize_t res, void *buf)
+{
+    ASSERT_NE((void*)NULL, buf);
+    EXPECT_EQ(BUFSIZE, res);
+    ++*(int *)arg;
+}
+#endif
+
+TEST_F(TEST_NAME(TestClass), CoalesceTest)
+{
+#if HAVE_KAIO
+    char *bufs[4];
+    for (int i = 0; i < 4; i++) {
+        memset(buf_, 'a' + i, BUFSIZE);
+        ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, (off_t)i * BUFSIZE)) << "pwrite: " << strerror(errno);
+        bufs[i] = (char *)ioqueue_buf_alloc(BUFSIZE);
+        ASSERT_NE((char *)NULL, bufs[i]) << "ioqueue_buf_alloc: " << strerror(errno);
+    }
+    ASSERT_EQ(0, ioqueue_set_coalesce(BUFSIZE, 1 << 20)) << "ioqueue_set_coalesce: " << strerror(errno);
+
+    // out of order reads of blocks 3, 0 and 1, skipping over block 2, are fused into one
+    int done = 0;
+    ASSERT_LE(0, ioqueue_pread(fd_, bufs[3], BUFSIZE, 3 * BUFSIZE, &CountCallback, &done));
+    ASSERT_LE(0, ioqueue_pread(fd_, bufs[0], BUFSIZE, 0, &CountCallback, &done));
+    ASSERT_LE(0, ioqueue_pread(fd_, bufs[1], BUFSIZE, BUFSIZE, &CountCallback, &done));
+    ASSERT_EQ(3, ioqueue_reap(3));
+    EXPECT_EQ(3, done);
+    struct ioqueue_stats stats;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(2u, stats.fused);
+    EXPECT_EQ(3u, stats.submitted);
+    EXPECT_EQ(1u, stats.batches);
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(i == 2 ? 0 : 'a' + i, bufs[i][0]);
+        EXPECT_EQ(i == 2 ? 0 : 'a' + i, bufs[i][BUFSIZE - 1]);
+    }
+
+    // a bounded reap leaves the rest of a fused read for the next, and it cannot be cancelled
+    done = 0;
+    ASSERT_LE(0, ioqueue_pread(fd_, bufs[2], BUFSIZE, 2 * BUFSIZE, &CountCallback, &done));
+    const int handle = ioqueue_pread(fd_, bufs[3], BUFSIZE, 3 * BUFSIZE, &CountCallback, &done);
+    ASSERT_LE(0, handle);
+    ASSERT_EQ(2, ioqueue_submit());
+    EXPECT_EQ(-1, ioqueue_cancel(handle));
+    EXPECT_EQ(EALREADY, errno);
+    ASSERT_EQ(1, ioqueue_reap_timeout(1, 1, NULL));
+    EXPECT_EQ(1, done);
+    ASSERT_EQ(1, ioqueue_poll(DEPTH));
+    EXPECT_EQ(2, done);
+    EXPECT_EQ('c', bufs[2][0]);
+    EXPECT_EQ(-1, ioqueue_reap(1));
+
+    // the gap buffer can be replaced while a fused read still reads into it
+    done = 0;
+    memset(bufs[0], 0, BUFSIZE);
+    memset(bufs[2], 0, BUFSIZE);
+    ASSERT_LE(0, ioqueue_pread(fd_, bufs[0], BUFSIZE, 0, &CountCallback, &done));
+    ASSERT_LE(0, ioqueue_pread(fd_, bufs[2], BUFSIZE, 2 * BUFSIZE, &CountCallback, &done));
+    ASSERT_EQ(2, ioqueue_submit());
+    ASSERT_EQ(0, ioqueue_set_coalesce(2 * BUFSIZE, 1 << 20));
+    ASSERT_EQ(2, ioqueue_reap(2));
+    EXPECT_EQ(2, done);
+    EXPECT_EQ('a', bufs[0][BUFSIZE - 1]);
+    EXPECT_EQ('c', bufs[2][BUFSIZE - 1]);
+
+    // disabled again, reads are submitted separately
+    ASSERT_EQ(0, ioqueue_set_coalesce(0, 0));
+    ASSERT_LE(0, ioqueue_pread(fd_, bufs[0], BUFSIZE, 0, &CountCallback, &done));
+    ASSERT_LE(0, ioqueue_pread(fd_, bufs[1], BUFSIZE, BUFSIZE, &CountCallback, &done));
+    ASSERT_EQ(2, ioqueue_reap(2));
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(4u, stats.fused);
+#else
+    EXPECT_EQ(-1, ioqueue_set_coalesce(BUFSIZE, 1 << 20));
+    EXPECT_EQ(ENOTSUP, errno);
+    EXPECT_EQ(0, ioqueue_set_coalesce(0, 0));
+#endif
+}
+
+static int prio_seq;
+
+static void PrioCallback(void *arg, ssize_t res, void *buf)
+{
+    ASSERT_NE((void*)NULL, buf);
+    if (res == -1) {
+        // the real-time class without privileges
+        EXPECT_EQ(EPERM, errno);
+    } else {
+        EXPECT_EQ(512, res);
+    }
+    *(int *)arg = prio_seq++;
+}
+
+TEST_F(TEST_NAME(TestClass), PrioTest)
+{
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    struct ioqueue_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    int order[4] = {-1, -1, -1, -1};
+    prio_seq = 0;
+
+    // the defaults, and each class the kernel accepts without privileges
+    ASSERT_LE(0, ioqueue_pread_ex(fd_, buf_, 512, 0, NULL, &PrioCallback, &order[0]));
+    opts.prio = IOQUEUE_PRIO(IOQUEUE_PRIO_CLASS_BE, 7);
+    ASSERT_LE(0, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &PrioCallback, &order[1]));
+    opts.prio = IOQUEUE_PRIO(IOQUEUE_PRIO_CLASS_IDLE, 0);
+    ASSERT_LE(0, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &PrioCallback, &order[2]));
+    ASSERT_LE(0, ioqueue_pwrite_ex(fd_, buf_, 512, 0, &opts, &PrioCallback, &order[3]));
+    ASSERT_EQ(4, ioqueue_reap(4));
+    for (int i = 0; i < 4; i++) {
+        EXPECT_LE(0, order[i]);
+    }
+
+    opts.prio = IOQUEUE_PRIO(4, 0);
+    EXPECT_EQ(-1, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &PrioCallback, &order[0]));
+    EXPECT_EQ(EINVAL, errno);
+    opts.prio = IOQUEUE_PRIO(IOQUEUE_PRIO_CLASS_BE, 8);
+    EXPECT_EQ(-1, ioqueue_pwrite_ex(fd_, buf_, 512, 0, &opts, &PrioCallback, &order[0]));
+    EXPECT_EQ(EINVAL, errno);
+
+#if HAVE_THREADS
+    // a single thread serves waiting requests in priority order
+    ioqueue_t *ioq = ioqueue_create_threads(DEPTH, 1, 1, 0);
+    ASSERT_NE((ioqueue_t *)NULL, ioq) << "ioqueue_create_threads: " << strerror(errno);
+    prio_seq = 0;
+    opts.prio = IOQUEUE_PRIO(IOQUEUE_PRIO_CLASS_IDLE, 0);
+    ASSERT_LE(0, ioqueue_ctx_pread_ex(ioq, fd_, buf_, 512, 0, &opts, &PrioCallback, &order[3]));
+    ASSERT_LE(0, ioqueue_ctx_pread_ex(ioq, fd_, buf_, 512, 0, NULL, &PrioCallback, &order[1]));
+    opts.prio = IOQUEUE_PRIO(IOQUEUE_PRIO_CLASS_BE, 0);
+    ASSERT_LE(0, ioqueue_ctx_pread_ex(ioq, fd_, buf_, 512, 0, &opts, &PrioCallback, &order[2]));
+    opts.prio = IOQUEUE_PRIO(IOQUEUE_PRIO_CLASS_RT, 0);
+    ASSERT_LE(0, ioqueue_ctx_pread_ex(ioq, fd_, buf_, 512, 0, &opts, &PrioCallback, &order[0]));
+    ASSERT_EQ(4, ioqueue_ctx_reap(ioq, 4));
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(i, order[i]);
+    }
+    ioqueue_ctx_destroy(ioq);
+#endif
+}
+
+#if HAVE_KAIO || HAVE_THREADS
+static int64_t NowMs()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (int64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+#endif
+
+TEST_F(TEST_NAME(TestClass), RateLimitTest)
+{
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    struct ioqueue_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.tag = 1;
+    EXPECT_EQ(-1, ioqueue_set_ratelimit(0, 0, 100));
+    EXPECT_EQ(EINVAL, errno);
+#if HAVE_KAIO || HAVE_THREADS
+    // 100 requests per second allows a burst of 10, then one every 10ms
+    ASSERT_EQ(0, ioqueue_set_ratelimit(1, 0, 100)) << "ioqueue_set_ratelimit: " << strerror(errno);
+    const int64_t start = NowMs();
+    for (int i = 0; i < 20; i++) {
+        ASSERT_LE(0, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &Callback, this));
+    }
+    // untagged requests are not held back
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, 0, &Callback, this));
+    ASSERT_EQ(21, ioqueue_reap(21));
+    EXPECT_LE(50, NowMs() - start);
+    EXPECT_EQ(512, res_);
+    struct ioqueue_stats stats;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_LE(5u, stats.throttled);
+    EXPECT_GE(10u, stats.throttled);
+
+    // held requests never block a poll, and lifting the limit lets them go
+    for (int i = 0; i < 20; i++) {
+        ASSERT_LE(0, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &Callback, this));
+    }
+    int n = ioqueue_poll(DEPTH);
+    ASSERT_LE(0, n);
+    ASSERT_GT(20, n);
+    ASSERT_EQ(0, ioqueue_set_ratelimit(1, 0, 0));
+    ASSERT_EQ(20 - n, ioqueue_reap(20 - n));
+
+    // bytes per second, charged by request length
+    opts.tag = 2;
+    ASSERT_EQ(0, ioqueue_set_ratelimit(2, 51200, 0));
+    for (int i = 0; i < 16; i++) {
+        ASSERT_LE(0, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &Callback, this));
+    }
+    ASSERT_EQ(16, ioqueue_reap(16));
+#if HAVE_KAIO
+
+    // a split request is charged once, however many parts it is read in
+    char *const data = (char *)ioqueue_buf_alloc(4 * BUFSIZE);
+    ASSERT_NE((char *)NULL, data) << "ioqueue_buf_alloc: " << strerror(errno);
+    ASSERT_EQ(0, ioqueue_set_split(BUFSIZE)) << "ioqueue_set_split: " << strerror(errno);
+    opts.tag = 3;
+    ASSERT_EQ(0, ioqueue_set_ratelimit(3, 0, 100));
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    const uint64_t throttled = stats.throttled;
+    for (int i = 0; i < 10; i++) {
+        ASSERT_LE(0, ioqueue_pread_ex(fd_, data, 4 * BUFSIZE, 0, &opts, &Callback, this));
+    }
+    ASSERT_EQ(10, ioqueue_reap(10));
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(throttled, stats.throttled);
+    EXPECT_EQ(10u, stats.split);
+    ASSERT_EQ(0, ioqueue_set_split(0));
+    ASSERT_EQ(0, ioqueue_buf_free(data));
+#endif
+#else
+    EXPECT_EQ(-1, ioqueue_set_ratelimit(1, 0, 100));
+    EXPECT_EQ(ENOTSUP, errno);
+    EXPECT_EQ(0, ioqueue_set_ratelimit(1, 0, 0));
+    // nor is a tagged request
+    EXPECT_EQ(-1, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &Callback, this));
+    EXPECT_EQ(ENOTSUP, errno);
+    EXPECT_EQ(-1, ioqueue_pwrite_ex(fd_, buf_, 512, 0, &opts, &Callback, this));
+    EXPECT_EQ(ENOTSUP, errno);
+#endif
+}
+
+TEST_F(TEST_NAME(TestClass), DeadlineTest)
+{
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    struct ioqueue_opts opts;
+    memset(&opts, 0, sizeof(opts));
+#if HAVE_KAIO || HAVE_THREADS
+    // a request in time completes normally
+    opts.timeout_us = 10000000;
+    ASSERT_LE(0, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(512, res_);
+
+    // a request past its deadline fails without being started
+    opts.timeout_us = 1000;
+    ASSERT_LE(0, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &Callback, this));
+    usleep(5000);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(-1, res_);
+    EXPECT_EQ(ETIMEDOUT, err_);
+    struct ioqueue_stats stats;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(1u, stats.expired);
+#if HAVE_THREADS
+    // a single thread serves requests earliest deadline first
+    ioqueue_t *ioq = ioqueue_create_threads(DEPTH, 1, 1, 0);
+    ASSERT_NE((ioqueue_t *)NULL, ioq) << "ioqueue_create_threads: " << strerror(errno);
+    int order[3] = {-1, -1, -1};
+    prio_seq = 0;
+    opts.timeout_us = 3000000;
+    ASSERT_LE(0, ioqueue_ctx_pread_ex(ioq, fd_, buf_, 512, 0, &opts, &PrioCallback, &order[2]));
+    opts.timeout_us = 1000000;
+    ASSERT_LE(0, ioqueue_ctx_pread_ex(ioq, fd_, buf_, 512, 0, &opts, &PrioCallback, &order[0]));
+    opts.timeout_us = 2000000;
+    ASSERT_LE(0, ioqueue_ctx_pread_ex(ioq, fd_, buf_, 512, 0, &opts, &PrioCallback, &order[1]));
+    ASSERT_EQ(3, ioqueue_ctx_reap(ioq, 3));
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(i, order[i]);
+    }
+    ioqueue_ctx_destroy(ioq);
+#endif
+#else
+    opts.timeout_us = 1000;
+    EXPECT_EQ(-1, ioqueue_pread_ex(fd_, buf_, 512, 0, &opts, &Callback, this));
+    EXPECT_EQ(ENOTSUP, errno);
+#endif
+}
+
+TEST_F(TEST_NAME(TestClass), ReadaheadTest)
+{
+#if HAVE_KAIO
+    const int nblocks = 64;
+    for (int i = 0; i < nblocks; i++) {
+        memset(buf_, 'A' + i % 26, BUFSIZE);
+        memcpy(buf_, &i, sizeof(i));
+        ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, (off_t)i * BUFSIZE)) << "pwrite: " << strerror(errno);
+    }
+    EXPECT_EQ(-1, ioqueue_set_readahead(-1, 1 << 16));
+    EXPECT_EQ(EINVAL, errno);
+    // the slots read-aheads take are only added to an idle queue
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &Callback, this));
+    EXPECT_EQ(-1, ioqueue_set_readahead(fd_, 1 << 16));
+    EXPECT_EQ(EBUSY, errno);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(0, ioqueue_set_readahead(fd_, 1 << 16)) << "ioqueue_set_readahead: " << strerror(errno);
+
+    // a serial scan is mostly served from the read-ahead buffers
+    for (int i = 0; i < nblocks; i++) {
+        int block = -1;
+        memset(buf_, 0, BUFSIZE);
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, (off_t)i * BUFSIZE, &Callback, this));
+        ASSERT_EQ(1, ioqueue_reap(1));
+        ASSERT_EQ(BUFSIZE, res_) << "block " << i;
+        memcpy(&block, buf_, sizeof(block));
+        EXPECT_EQ(i, block);
+        EXPECT_EQ('A' + i % 26, buf_[BUFSIZE - 1]);
+    }
+    struct ioqueue_stats stats;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_LE(48u, stats.readahead);
+    EXPECT_EQ((uint64_t)nblocks + 1, stats.total[IOQUEUE_STATS_READ].count);
+    EXPECT_EQ(1u, stats.depth_max);
+    // only the caller's requests can be reaped, even with a read-ahead in flight
+    EXPECT_EQ(-1, ioqueue_reap(1));
+
+    // read-aheads keep to their own slots, so the caller still gets its whole depth
+    for (int i = 20; i < 22; i++) {
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, (off_t)i * BUFSIZE, &Callback, this));
+        ASSERT_EQ(1, ioqueue_reap(1));
+    }
+    int done = 0;
+    for (int i = 0; i < DEPTH; i++) {
+        // the first starts a read-ahead, which is still waiting to be submitted
+        const off_t off = i == 0 ? 22 * BUFSIZE : 0;
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, off, &CountCallback, &done)) << "pread " << i << ": " << strerror(errno);
+    }
+    EXPECT_EQ(-1, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &CountCallback, &done));
+    EXPECT_EQ(EAGAIN, errno);
+    ASSERT_EQ((int)DEPTH, ioqueue_reap(DEPTH));
+    EXPECT_EQ((int)DEPTH, done);
+
+    // a read past EOF still returns 0
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, (off_t)nblocks * BUFSIZE, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(0, res_);
+
+    // a write invalidates what was read ahead of it, and served reads cannot be cancelled
+    for (int i = 0; i < 4; i++) {
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, (off_t)i * BUFSIZE, &Callback, this));
+        ASSERT_EQ(1, ioqueue_reap(1));
+    }
+    const int handle = ioqueue_pread(fd_, buf_, BUFSIZE, 4 * BUFSIZE, &Callback, this);
+    ASSERT_LE(0, handle);
+    EXPECT_EQ(-1, ioqueue_cancel(handle));
+    EXPECT_EQ(EALREADY, errno);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    memset(buf_, 'z', BUFSIZE);
+    ASSERT_LE(0, ioqueue_pwrite(fd_, buf_, BUFSIZE, 5 * BUFSIZE, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(BUFSIZE, res_);
+    memset(buf_, 0, BUFSIZE);
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, 5 * BUFSIZE, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ('z', buf_[0]);
+    EXPECT_EQ('z', buf_[BUFSIZE - 1]);
+
+    // disabled again, possibly with a read-ahead still in flight
+    ASSERT_EQ(0, ioqueue_set_readahead(fd_, 0));
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    const uint64_t served = stats.readahead;
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, 6 * BUFSIZE, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(served, stats.readahead);
+#else
+    EXPECT_EQ(-1, ioqueue_set_readahead(fd_, 1 << 16));
+    EXPECT_EQ(ENOTSUP, errno);
+    EXPECT_EQ(0, ioqueue_set_readahead(fd_, 0));
+#endif
+}
+
+#if HAVE_KAIO
+static void ResCallback(void *arg, ssize_t res, void *buf)
+{
+    ASSERT_NE((void*)NULL, buf);
+    *(ssize_t *)arg = res;
+}
+#endif
+
+TEST_F(TEST_NAME(TestClass), CacheTest)
+{
+#if HAVE_KAIO
+    const int nblocks = 8;
+    for (int i = 0; i < nblocks; i++) {
+        memset(buf_, 'a' + i, BUFSIZE);
+        ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, (off_t)i * BUFSIZE)) << "pwrite: " << strerror(errno);
+    }
+    EXPECT_EQ(-1, ioqueue_set_cache(1000, 1 << 20));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ(-1, ioqueue_set_cache(BUFSIZE, BUFSIZE - 1));
+    EXPECT_EQ(EINVAL, errno);
+    ASSERT_EQ(0, ioqueue_set_cache(BUFSIZE, 4 * BUFSIZE)) << "ioqueue_set_cache: " << strerror(errno);
+
+    // concurrent misses of one block are merged into a single device read
+    char parts[2][512];
+    ssize_t res[2] = { 0, 0 };
+    memset(buf_, 0, BUFSIZE);
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &Callback, this));
+    ASSERT_LE(0, ioqueue_pread(fd_, parts[0], 512, 0, &ResCallback, &res[0]));
+    ASSERT_LE(0, ioqueue_pread(fd_, parts[1], 512, 1024, &ResCallback, &res[1]));
+    EXPECT_EQ(-1, ioqueue_set_cache(0, 0));
+    EXPECT_EQ(EBUSY, errno);
+    ASSERT_EQ(3, ioqueue_reap(3));
+    EXPECT_EQ(BUFSIZE, res_);
+    EXPECT_EQ(512, res[0]);
+    EXPECT_EQ(512, res[1]);
+    EXPECT_EQ('a', buf_[BUFSIZE - 1]);
+    EXPECT_EQ('a', parts[0][0]);
+    EXPECT_EQ('a', parts[1][511]);
+    struct ioqueue_stats stats;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(1u, stats.submitted);
+    EXPECT_EQ(2u, stats.cached);
+
+    // a hit completes on the next reap without a device read, and cannot be cancelled
+    memset(buf_, 0, BUFSIZE);
+    const int handle = ioqueue_pread(fd_, buf_, BUFSIZE, 0, &Callback, this);
+    ASSERT_LE(0, handle);
+    EXPECT_EQ(-1, ioqueue_cancel(handle));
+    EXPECT_EQ(EALREADY, errno);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(BUFSIZE, res_);
+    EXPECT_EQ('a', buf_[0]);
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(1u, stats.submitted);
+    EXPECT_EQ(3u, stats.cached);
+
+    // a write through the queue drops the block it overlaps
+    memset(buf_, 'z', BUFSIZE);
+    ASSERT_LE(0, ioqueue_pwrite(fd_, buf_, 512, 512, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    ASSERT_EQ(512, res_);
+    memset(buf_, 0, BUFSIZE);
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ('a', buf_[0]);
+    EXPECT_EQ('z', buf_[512]);
+    EXPECT_EQ('a', buf_[1024]);
+
+    // scanning more blocks than fit evicts some, and every read still sees the file
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < nblocks; i++) {
+            memset(buf_, 0, BUFSIZE);
+            ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, (off_t)i * BUFSIZE, &Callback, this));
+            ASSERT_EQ(1, ioqueue_reap(1));
+            ASSERT_EQ(BUFSIZE, res_);
+            EXPECT_EQ('a' + i, buf_[BUFSIZE - 1]);
+        }
+    }
+
+    // the block reads of misses are not mistaken for reads fused by coalescing
+    ASSERT_EQ(0, ioqueue_set_cache(0, 0));
+    ASSERT_EQ(0, ioqueue_set_cache(BUFSIZE, 4 * BUFSIZE));
+    ASSERT_EQ(0, ioqueue_set_coalesce(BUFSIZE, 4 * BUFSIZE));
+    char *const other = (char *)ioqueue_buf_alloc(BUFSIZE);
+    ASSERT_NE((char *)NULL, other);
+    memset(buf_, 0, BUFSIZE);
+    memset(other, 0, BUFSIZE);
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &ResCallback, &res[0]));
+    // reads across blocks bypass the cache, and these two are fused
+    ASSERT_LE(0, ioqueue_pread(fd_, other, 1024, 2 * BUFSIZE - 512, &ResCallback, &res[1]));
+    ASSERT_LE(0, ioqueue_pread(fd_, other + 1024, 1024, 3 * BUFSIZE - 512, &Callback, this));
+    const struct timespec second = { 1, 0 };
+    ASSERT_EQ(3, ioqueue_reap_timeout(3, 3, &second));
+    EXPECT_EQ(BUFSIZE, res[0]);
+    EXPECT_EQ(1024, res[1]);
+    EXPECT_EQ(1024, res_);
+    EXPECT_EQ('a', buf_[BUFSIZE - 1]);
+    EXPECT_EQ('b', other[0]);
+    EXPECT_EQ('c', other[1023]);
+    EXPECT_EQ('c', other[1024]);
+    EXPECT_EQ('d', other[2047]);
+    ASSERT_EQ(0, ioqueue_set_coalesce(0, 0));
+    ASSERT_EQ(0, ioqueue_buf_free(other));
+
+    // a short block at EOF is not kept
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    for (int i = 0; i < 2; i++) {
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, (off_t)nblocks * BUFSIZE, &Callback, this));
+        ASSERT_EQ(1, ioqueue_reap(1));
+        EXPECT_EQ(0, res_);
+    }
+    const uint64_t submitted = stats.submitted;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(submitted + 2, stats.submitted);
+    ASSERT_EQ(0, ioqueue_set_cache(0, 0));
+#else
+    EXPECT_EQ(-1, ioqueue_set_cache(BUFSIZE, 1 << 20));
+    EXPECT_EQ(ENOTSUP, errno);
+    EXPECT_EQ(0, ioqueue_set_cache(0, 0));
+#endif
+}
+
+TEST_F(TEST_NAME(TestClass), AlignTest)
+{
+#if HAVE_KAIO
+    memset(buf_, 'a', BUFSIZE);
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    memset(buf_, 'b', BUFSIZE);
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, BUFSIZE)) << "pwrite: " << strerror(errno);
+    EXPECT_EQ(-1, ioqueue_set_align(3));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ(-1, ioqueue_set_align(8192));
+    EXPECT_EQ(EINVAL, errno);
+    ASSERT_EQ(0, ioqueue_set_align(512)) << "ioqueue_set_align: " << strerror(errno);
+
+    // an unaligned read across blocks copies out only its own bytes
+    char part[1001];
+    memset(part, 0, sizeof(part));
+    ASSERT_LE(0, ioqueue_pread(fd_, part + 1, 1000, BUFSIZE - 500, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(1000, res_);
+    EXPECT_EQ(part + 1, cbuf_);
+    EXPECT_EQ(0, part[0]);
+    EXPECT_EQ('a', part[500]);
+    EXPECT_EQ('b', part[501]);
+    EXPECT_EQ('b', part[1000]);
+    struct ioqueue_stats stats;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(1u, stats.bounced);
+
+    // an unaligned write reads the blocks it partly covers and writes them back
+    memset(part, 'x', sizeof(part));
+    ASSERT_LE(0, ioqueue_pwrite(fd_, part, 1000, BUFSIZE - 500, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(1000, res_);
+    ASSERT_EQ(BUFSIZE, pread(fd_, buf_, BUFSIZE, 0)) << "pread: " << strerror(errno);
+    EXPECT_EQ('a', buf_[BUFSIZE - 501]);
+    EXPECT_EQ('x', buf_[BUFSIZE - 500]);
+    ASSERT_EQ(BUFSIZE, pread(fd_, buf_, BUFSIZE, BUFSIZE)) << "pread: " << strerror(errno);
+    EXPECT_EQ('x', buf_[499]);
+    EXPECT_EQ('b', buf_[500]);
+
+    // overlapping unaligned writes land in the order they were enqueued
+    char first[100], second[100];
+    ssize_t res[2] = { 0, 0 };
+    memset(first, 'c', sizeof(first));
+    memset(second, 'd', sizeof(second));
+    ASSERT_LE(0, ioqueue_pwrite(fd_, first, 100, 10, &ResCallback, &res[0]));
+    ASSERT_LE(0, ioqueue_pwrite(fd_, second, 100, 60, &ResCallback, &res[1]));
+    ASSERT_EQ(2, ioqueue_reap(2));
+    EXPECT_EQ(100, res[0]);
+    EXPECT_EQ(100, res[1]);
+    ASSERT_EQ(BUFSIZE, pread(fd_, buf_, BUFSIZE, 0)) << "pread: " << strerror(errno);
+    EXPECT_EQ('a', buf_[9]);
+    EXPECT_EQ('c', buf_[10]);
+    EXPECT_EQ('c', buf_[59]);
+    EXPECT_EQ('d', buf_[60]);
+    EXPECT_EQ('d', buf_[159]);
+    EXPECT_EQ('a', buf_[160]);
+
+    // and aligned writes are ordered against them either way
+    char *const block = (char *)ioqueue_buf_alloc(512);
+    ASSERT_NE((char *)NULL, block) << "ioqueue_buf_alloc: " << strerror(errno);
+    memset(block, 'e', 512);
+    ASSERT_LE(0, ioqueue_pwrite(fd_, first, 100, 100, &ResCallback, &res[0]));
+    ASSERT_LE(0, ioqueue_pwrite(fd_, block, 512, 0, &ResCallback, &res[1]));
+    ASSERT_EQ(2, ioqueue_reap(2));
+    EXPECT_EQ(100, res[0]);
+    EXPECT_EQ(512, res[1]);
+    ASSERT_LE(0, ioqueue_pwrite(fd_, block, 512, 0, &ResCallback, &res[0]));
+    ASSERT_LE(0, ioqueue_pwrite(fd_, second, 10, 20, &ResCallback, &res[1]));
+    ASSERT_EQ(2, ioqueue_reap(2));
+    EXPECT_EQ(512, res[0]);
+    EXPECT_EQ(10, res[1]);
+    ASSERT_EQ(BUFSIZE, pread(fd_, buf_, BUFSIZE, 0)) << "pread: " << strerror(errno);
+    EXPECT_EQ('e', buf_[19]);
+    EXPECT_EQ('d', buf_[20]);
+    EXPECT_EQ('d', buf_[29]);
+    EXPECT_EQ('e', buf_[30]);
+    EXPECT_EQ('e', buf_[100]);
+    EXPECT_EQ('a', buf_[512]);
+    EXPECT_EQ(0, ioqueue_buf_free(block));
+
+    // a write past EOF fills the rest of its block with zeros, then cuts the file back
+    ASSERT_LE(0, ioqueue_pwrite(fd_, part, 100, 2 * BUFSIZE + 10, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(100, res_);
+    struct stat st;
+    ASSERT_EQ(0, fstat(fd_, &st)) << "fstat: " << strerror(errno);
+    EXPECT_EQ(2 * BUFSIZE + 110, st.st_size);
+    ASSERT_EQ(110, pread(fd_, buf_, BUFSIZE, 2 * BUFSIZE)) << "pread: " << strerror(errno);
+    EXPECT_EQ(0, buf_[9]);
+    EXPECT_EQ('x', buf_[10]);
+    EXPECT_EQ('x', buf_[109]);
+
+    // a write waiting for another can be cancelled
+    ASSERT_LE(0, ioqueue_pwrite(fd_, first, 100, 10, &ResCallback, &res[0]));
+    const int handle = ioqueue_pwrite(fd_, second, 100, 50, &Callback, this);
+    ASSERT_LE(0, handle);
+    ASSERT_EQ(0, ioqueue_cancel(handle));
+    EXPECT_EQ(-1, res_);
+    EXPECT_EQ(ECANCELED, err_);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(100, res[0]);
+
+    // a read whose buffer cannot be had fails, leaving the read-ahead it started queued
+    ASSERT_EQ(0, ioqueue_set_readahead(fd_, 1 << 16)) << "ioqueue_set_readahead: " << strerror(errno);
+    for (int i = 0; i < 2; i++) {
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, 512, (off_t)i * 512, &Callback, this));
+        ASSERT_EQ(1, ioqueue_reap(1));
+    }
+    EXPECT_EQ(-1, ioqueue_pread(fd_, buf_, ((size_t)1 << 50) + 1, 1024, &Callback, this));
+    EXPECT_EQ(ENOMEM, errno);
+    ASSERT_LE(0, ioqueue_pread(fd_, part, 100, 10, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(100, res_);
+    ASSERT_EQ(0, ioqueue_set_readahead(fd_, 0));
+
+    // once disabled, the kernel refuses unaligned direct I/O again
+    ASSERT_EQ(0, ioqueue_set_align(0));
+    ASSERT_LE(0, ioqueue_pread(fd_, part, 100, 10, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(-1, res_);
+    EXPECT_EQ(EINVAL, err_);
+#else
+    EXPECT_EQ(-1, ioqueue_set_align(512));
+    EXPECT_EQ(ENOTSUP, errno);
+    EXPECT_EQ(0, ioqueue_set_align(0));
+#endif
+}
+
+TEST_F(TEST_NAME(TestClass), SplitTest)
+{
+#if HAVE_KAIO
+    const size_t len = 32 * BUFSIZE;
+    char *const big = (char *)ioqueue_buf_alloc(len);
+    ASSERT_NE((char *)NULL, big) << "ioqueue_buf_alloc: " << strerror(errno);
+    EXPECT_EQ(-1, ioqueue_set_split(1000));
+    EXPECT_EQ(EINVAL, errno);
+    ASSERT_EQ(0, ioqueue_set_split(BUFSIZE)) << "ioqueue_set_split: " << strerror(errno);
+
+    // a long write is split into more parts than half the queue holds, with one callback
+    for (size_t i = 0; i < len / BUFSIZE; i++) {
+        memset(big + i * BUFSIZE, 'a' + (int)i % 26, BUFSIZE);
+    }
+    ASSERT_LE(0, ioqueue_pwrite(fd_, big, len, 0, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ((ssize_t)len, res_);
+    EXPECT_EQ(big, cbuf_);
+    ASSERT_EQ(BUFSIZE, pread(fd_, buf_, BUFSIZE, 31 * BUFSIZE)) << "pread: " << strerror(errno);
+    EXPECT_EQ('a' + 31 % 26, buf_[0]);
+    struct ioqueue_stats stats;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(1u, stats.split);
+    EXPECT_EQ(1u, stats.submitted);
+
+    // a long read completes alongside a short one enqueued after it, and cannot be cancelled
+    memset(big, 0, len);
+    const int handle = ioqueue_pread(fd_, big, len, 0, &Callback, this);
+    ASSERT_LE(0, handle);
+    ssize_t res = 0;
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, BUFSIZE, &ResCallback, &res));
+    EXPECT_EQ(-1, ioqueue_cancel(handle));
+    EXPECT_EQ(EALREADY, errno);
+    ASSERT_EQ(2, ioqueue_reap(2));
+    EXPECT_EQ((ssize_t)len, res_);
+    EXPECT_EQ(BUFSIZE, res);
+    EXPECT_EQ('b', buf_[0]);
+    for (size_t i = 0; i < len / BUFSIZE; i++) {
+        EXPECT_EQ('a' + (int)i % 26, big[i * BUFSIZE + BUFSIZE - 1]);
+    }
+
+    // a read across EOF returns the bytes up to it, and one beyond it none
+    ASSERT_LE(0, ioqueue_pread(fd_, big, len, len - 3 * BUFSIZE, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(3 * BUFSIZE, res_);
+    ASSERT_LE(0, ioqueue_pread(fd_, big, len, len, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(0, res_);
+
+    // a failed part fails the whole request
+    ASSERT_LE(0, ioqueue_pread(fd_, big + 1, len, 0, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(-1, res_);
+    EXPECT_EQ(EINVAL, err_);
+    EXPECT_EQ(0, ioqueue_set_split(0));
+    EXPECT_EQ(0, ioqueue_buf_free(big));
+#else
+    EXPECT_EQ(-1, ioqueue_set_split(BUFSIZE));
+    EXPECT_EQ(ENOTSUP, errno);
+    EXPECT_EQ(0, ioqueue_set_split(0));
+#endif
+}
+
+TEST_F(TEST_NAME(TestClass), HedgeTest)
+{
+#if HAVE_KAIO
+    char path[256];
+    strcpy(path, P_tmpdir "/ioqueue.tmp.XXXXXX");
+    int fd = mkstemp(path);
+    ASSERT_NE(-1, fd) << "mkstemp: " << strerror(errno);
+    close(fd);
+    fd = open(path, O_RDWR | O_DIRECT);
+    ASSERT_NE(-1, fd) << "open: " << strerror(errno);
+    unlink(path);
+    // the first block differs between the replicas, the second is the same
+    memset(buf_, 'a', BUFSIZE);
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    memset(buf_, 'b', BUFSIZE);
+    ASSERT_EQ(BUFSIZE, pwrite(fd, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    memset(buf_, 'r', BUFSIZE);
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, BUFSIZE)) << "pwrite: " << strerror(errno);
+    ASSERT_EQ(BUFSIZE, pwrite(fd, buf_, BUFSIZE, BUFSIZE)) << "pwrite: " << strerror(errno);
+    EXPECT_EQ(-1, ioqueue_set_hedge(0, 0));
+    EXPECT_EQ(EINVAL, errno);
+    const int fds[2] = { fd_, fd };
+    char part[101];
+    EXPECT_EQ(-1, ioqueue_pread_hedged(fds, 0, part, 100, 0, &Callback, this));
+    EXPECT_EQ(EINVAL, errno);
+
+    // the replicas are read in turn, unaligned once bounced, and the pread cannot be cancelled
+    ASSERT_EQ(0, ioqueue_set_align(512));
+    const int handle = ioqueue_pread_hedged(fds, 2, part + 1, 100, 10, &Callback, this);
+    ASSERT_LE(0, handle);
+    EXPECT_EQ(-1, ioqueue_cancel(handle));
+    EXPECT_EQ(EALREADY, errno);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(100, res_);
+    EXPECT_EQ(part + 1, cbuf_);
+    EXPECT_EQ('a', part[1]);
+    ASSERT_LE(0, ioqueue_pread_hedged(fds, 2, part, 100, 10, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(100, res_);
+    EXPECT_EQ('b', part[0]);
+
+    // a failed read fails over to the other replica at once, and fails when both have
+    const int bad[2] = { -1, fd_ };
+    ASSERT_LE(0, ioqueue_pread_hedged(bad, 2, part, 100, 10, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(100, res_);
+    EXPECT_EQ('a', part[0]);
+    struct ioqueue_stats stats;
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_EQ(1u, stats.hedged);
+    const int worse[2] = { -1, -1 };
+    ASSERT_LE(0, ioqueue_pread_hedged(worse, 2, part, 100, 10, &Callback, this));
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(-1, res_);
+    EXPECT_EQ(EBADF, err_);
+
+    // reads left for longer than the threshold send a backup read, yet each pread calls back once
+    ASSERT_EQ(0, ioqueue_set_hedge(1, 0));
+    char *const data = (char *)malloc(BUFSIZE);
+    ASSERT_NE((char *)NULL, data);
+    const struct timespec slow = { 0, 1000000 };
+    int count = 0;
+    for (int i = 0; i < 64; i++) {
+        memset(data, 0, BUFSIZE);
+        ASSERT_LE(0, ioqueue_pread_hedged(fds, 2, data, BUFSIZE, BUFSIZE, &CountCallback, &count));
+        ASSERT_EQ(1, ioqueue_submit());
+        nanosleep(&slow, NULL);
+        ASSERT_EQ(1, ioqueue_reap(1));
+        EXPECT_EQ(i + 1, count);
+        EXPECT_EQ('r', data[BUFSIZE - 1]);
+    }
+    const struct timespec wait = { 0, 10000000 };
+    EXPECT_EQ(0, ioqueue_reap_timeout(0, 1, &wait));
+    EXPECT_EQ(64, count);
+    ASSERT_EQ(0, ioqueue_stats_get(&stats));
+    EXPECT_LT(1u, stats.hedged);
+    free(data);
+    close(fd);
+#else
+    const int fds[1] = { fd_ };
+    EXPECT_EQ(-1, ioqueue_pread_hedged(fds, 1, buf_, BUFSIZE, 0, &Callback, this));
+    EXPECT_EQ(ENOTSUP, errno);
+    EXPECT_EQ(-1, ioqueue_set_hedge(95, 0));
+    EXPECT_EQ(ENOTSUP, errno);
+#endif
+}
+
 TEST_F(TEST_NAME(TestClass), BadReapTest)
 {
     ASSERT_EQ(-1, ioqueue_reap(0));
     ASSERT_EQ(-1, ioqueue_reap(1));
     ASSERT_EQ(-1, ioqueue_reap(UINT_MAX));
-    ASSERT_EQ(0, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &Callback, this));
+    ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &Callback, this));
     ASSERT_EQ(-1, ioqueue_reap(2));
     ASSERT_EQ(-1, ioqueue_reap(UINT_MAX));
     ASSERT_EQ(1, ioqueue_reap(1));
@@ -138,7 +1236,7 @@ TEST_F(TEST_NAME(TestClass), BadReapTest)
 
 TEST_F(TEST_NAME(TestClass), ReapOnDestroyTest)
 {
-    ASSERT_EQ(0, ioqueue_pwrite(fd_, buf_, BUFSIZE, 0, &Callback, this));
+    ASSERT_LE(0, ioqueue_pwrite(fd_, buf_, BUFSIZE, 0, &Callback, this));
     TearDown();
     ASSERT_EQ(res_, BUFSIZE);
 }
@@ -146,20 +1244,103 @@ TEST_F(TEST_NAME(TestClass), ReapOnDestroyTest)
 TEST_F(TEST_NAME(TestClass), FullQueueTest)
 {
     for (int i = 0; i < DEPTH; i++) {
-        ASSERT_EQ(0, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &Callback, this));
+        ASSERT_LE(0, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &Callback, this));
     }
     ASSERT_EQ(-1, ioqueue_pread(fd_, buf_, BUFSIZE, 0, &Callback, this));
 }
 
+static void FailCallback(void *arg, ssize_t res, void *buf)
+{
+    ASSERT_NE((void*)NULL, buf);
+    EXPECT_EQ(-1, res);
+    EXPECT_EQ(EBADF, errno);
+    ++*(int *)arg;
+}
+
 TEST_F(TEST_NAME(TestClass), BadFileReadTest)
 {
-    ASSERT_EQ(0, ioqueue_pread(-1, buf_, 512, 0, &Callback, this));
+    ASSERT_LE(0, ioqueue_pread(-1, buf_, 512, 0, &Callback, this));
     ASSERT_EQ(1, ioqueue_reap(1));
     ASSERT_EQ(-1, res_);
     ASSERT_EQ(EBADF, err_);
 
+    // requests failed at submission complete from a reap, no more than its max at a time
+    int failed = 0;
+    for (int i = 0; i < 3; i++) {
+        ASSERT_LE(0, ioqueue_pread(-1, buf_, 512, 0, &FailCallback, &failed));
+    }
+    ASSERT_LE(0, ioqueue_submit());
+    EXPECT_EQ(0, failed);
+    ASSERT_EQ(1, ioqueue_reap_timeout(1, 1, NULL));
+    EXPECT_EQ(1, failed);
+    ASSERT_EQ(2, ioqueue_reap_timeout(2, 4, NULL));
+    EXPECT_EQ(3, failed);
+
+    // as do those submitted by an auto-flush, which still return a handle
+    ASSERT_EQ(0, ioqueue_set_autoflush(1, 0));
+    const int handle = ioqueue_pread(-1, buf_, 512, 0, &FailCallback, &failed);
+    EXPECT_LE(0, handle);
+    EXPECT_EQ(3, failed);
+    ASSERT_EQ(1, ioqueue_reap(1));
+    EXPECT_EQ(4, failed);
+    EXPECT_EQ(-1, ioqueue_cancel(handle));
+    const struct timespec zero = { 0, 0 };
+    EXPECT_EQ(0, ioqueue_reap_timeout(0, 1, &zero));
+    EXPECT_EQ(4, failed);
+    ASSERT_EQ(0, ioqueue_set_autoflush(0, 0));
+
     ASSERT_EQ(-1, ioqueue_pread(fd_, NULL, 512, 0, &Callback, this));
     ASSERT_EQ(-1, ioqueue_pread(fd_, buf_, 0, 0, &Callback, this));
     ASSERT_EQ(-1, ioqueue_pread(fd_, buf_, SIZE_MAX, 0, &Callback, this));
     ASSERT_EQ(-1, ioqueue_pread(fd_, buf_, 512, 0, NULL, this));
 }
+
+TEST_F(TEST_NAME(TestClass), ContextTest)
+{
+    buf_[0] = 1;
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+    memset(buf_, 0, BUFSIZE);
+
+    ioqueue_t *const ioq = ioqueue_create(DEPTH);
+    ASSERT_NE((ioqueue_t *)NULL, ioq) << "ioqueue_create: " << strerror(errno);
+    ASSERT_LE(0, ioqueue_ctx_pread(ioq, fd_, buf_, 512, 0, &Callback, this));
+    // the default queue is independent of the new one
+    EXPECT_EQ(-1, ioqueue_reap(1));
+    EXPECT_EQ(1, ioqueue_ctx_reap(ioq, 1));
+    EXPECT_EQ(512, res_);
+    EXPECT_EQ(1, buf_[0]);
+    EXPECT_EQ(-1, ioqueue_ctx_reap(ioq, 1));
+    ioqueue_ctx_destroy(ioq);
+}
+
+TEST_F(TEST_NAME(TestClass), ThreadsTest)
+{
+    ASSERT_EQ(BUFSIZE, pwrite(fd_, buf_, BUFSIZE, 0)) << "pwrite: " << strerror(errno);
+
+    // a deep queue on a small pool that grows with load
+    ioqueue_t *ioq = ioqueue_create_threads(DEPTH, 1, 4, 0);
+    ASSERT_NE((ioqueue_t *)NULL, ioq) << "ioqueue_create_threads: " << strerror(errno);
+    for (int i = 0; i < DEPTH; i++) {
+        ASSERT_LE(0, ioqueue_ctx_pread(ioq, fd_, buf_ + (i % 8) * 512, 512, (i % 8) * 512, &Callback, this));
+    }
+    ASSERT_EQ((int)DEPTH, ioqueue_ctx_reap(ioq, DEPTH));
+    EXPECT_EQ(512, res_);
+    ioqueue_ctx_destroy(ioq);
+
+#if HAVE_THREADS
+    errno = 0;
+    EXPECT_EQ((ioqueue_t *)NULL, ioqueue_create_threads(DEPTH, 0, 4, 0));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ((ioqueue_t *)NULL, ioqueue_create_threads(DEPTH, 4, 2, 0));
+
+    // no more than `backlog` requests may wait for each thread
+    ioq = ioqueue_create_threads(DEPTH, 2, 2, 1);
+    ASSERT_NE((ioqueue_t *)NULL, ioq) << "ioqueue_create_threads: " << strerror(errno);
+    ASSERT_LE(0, ioqueue_ctx_pread(ioq, fd_, buf_, 512, 0, &Callback, this));
+    ASSERT_LE(0, ioqueue_ctx_pread(ioq, fd_, buf_, 512, 0, &Callback, this));
+    EXPECT_EQ(-1, ioqueue_ctx_pread(ioq, fd_, buf_, 512, 0, &Callback, this));
+    EXPECT_EQ(EAGAIN, errno);
+    ASSERT_EQ(2, ioqueue_ctx_reap(ioq, 2));
+    ioqueue_ctx_destroy(ioq);
+#endif
+}
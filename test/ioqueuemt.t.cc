@@ -1,4 +1,5 @@
 #define TEST_NAME(name) IOQueueMt ## name
 #define HAVE_KAIO 0
-#define HAVE_EVENTFD 0
+#define HAVE_BUSYPOLL 0
+#define HAVE_THREADS 1
 #include "ioqueue.t.cc"
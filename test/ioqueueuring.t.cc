@@ -0,0 +1,4 @@
+#define TEST_NAME(name) IOQueueUring ## name
+#define HAVE_KAIO 0
+#define HAVE_EVENTFD 1
+#include "ioqueue.t.cc"